@@ -14,7 +14,7 @@
   * limitations under the License.
   */
 #include "candy_utility.h"
-#include "core/candy_vm.h"
+#include "core/candy.h"
 #include <stdlib.h>
 
 static int _builtin_exit(candy_state_t *self) {
@@ -23,7 +23,13 @@ static int _builtin_exit(candy_state_t *self) {
 }
 
 static int _builtin_print(candy_state_t *self) {
-
+  size_t size = candy_get_top(self);
+  for (size_t idx = 0; idx < size; ++idx) {
+    if (idx)
+      fputc(' ', stdout);
+    candy_fprint(self, idx, stdout);
+  }
+  fputc('\n', stdout);
   return 0;
 }
 
@@ -13,6 +13,8 @@
   * See the License for the specific language governing permissions and
   * limitations under the License.
   */
+/* mmap and fileno are not part of c99 */
+#define _DEFAULT_SOURCE
 #include "core/candy.h"
 #include "core/candy_object.h"
 #include "core/candy_reader.h"
@@ -23,8 +25,18 @@
 #include "core/candy_closure.h"
 #include "core/candy_userdef.h"
 #include "core/candy_state.h"
+#include "core/candy_wrap.h"
+#include "core/candy_vm.h"
 #include <stdlib.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define CANDY_MMAP 1
+#else
+#define CANDY_MMAP 0
+#endif
+
 static void *default_allocator(void *prev, size_t prev_size, size_t next_size, void *arg) {
   if (next_size)
     return realloc(prev, next_size);
@@ -42,30 +54,37 @@ static int _event_delete(candy_object_t *self, candy_gc_t *gc) {
     case CANDY_TYPE_TABLE: return candy_table_delete((candy_table_t *)self, gc);
     case CANDY_TYPE_PROTO: return candy_proto_delete((candy_proto_t *)self, gc);
     case CANDY_TYPE_STATE: return candy_state_delete((candy_state_t *)self, gc);
+    case CANDY_TYPE_UPVAL: return candy_upval_delete((candy_upval_t *)self, gc);
     default:               return -1;
   }
 }
 
 static int _event_colouring(candy_object_t *self, candy_gc_t *gc) {
+  if (candy_object_get_mask(self) & MASK_ARRAY)
+    return candy_array_colouring((candy_array_t *)self, gc);
   switch (candy_object_get_type(self)) {
     case CANDY_TYPE_CCLSR: return -1;
     case CANDY_TYPE_SCLSR: return candy_sclosure_colouring((candy_sclosure_t *)self, gc);
     case CANDY_TYPE_UDHVY: return -1;
-    case CANDY_TYPE_TABLE: return -1;
+    case CANDY_TYPE_TABLE: return candy_table_colouring((candy_table_t *)self, gc);
     case CANDY_TYPE_PROTO: return candy_proto_colouring((candy_proto_t *)self, gc);
     case CANDY_TYPE_STATE: return candy_state_colouring((candy_state_t *)self, gc);
+    case CANDY_TYPE_UPVAL: return candy_upval_colouring((candy_upval_t *)self, gc);
     default:               return -1;
   }
 }
 
 static int _event_diffusion(candy_object_t *self, candy_gc_t *gc) {
+  if (candy_object_get_mask(self) & MASK_ARRAY)
+    return candy_array_diffusion((candy_array_t *)self, gc);
   switch (candy_object_get_type(self)) {
     case CANDY_TYPE_CCLSR: return -1;
     case CANDY_TYPE_SCLSR: return candy_sclosure_diffusion((candy_sclosure_t *)self, gc);
     case CANDY_TYPE_UDHVY: return -1;
-    case CANDY_TYPE_TABLE: return -1;
+    case CANDY_TYPE_TABLE: return candy_table_diffusion((candy_table_t *)self, gc);
     case CANDY_TYPE_PROTO: return candy_proto_diffusion((candy_proto_t *)self, gc);
     case CANDY_TYPE_STATE: return candy_state_diffusion((candy_state_t *)self, gc);
+    case CANDY_TYPE_UPVAL: return candy_upval_diffusion((candy_upval_t *)self, gc);
     default:               return -1;
   }
 }
@@ -107,12 +126,163 @@ int candy_dostring(candy_state_t *self, const char exp[], size_t size) {
   return res;
 }
 
+/**
+  * @brief  run a regular file from a read-only mapping, the lexer works on
+  *         it in place and it is unmapped once the chunk returns
+  * @retval false if it cannot be mapped, pipes and fifos are streamed
+  */
+static bool _domap(candy_state_t *self, FILE *f, int *res) {
+#if CANDY_MMAP
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+    return false;
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  if (map == MAP_FAILED)
+    return false;
+  struct str_info info = {(const char *)map, (size_t)st.st_size, 0};
+  *res = candy_dostream(self, string_reader, &info);
+  munmap(map, (size_t)st.st_size);
+  return true;
+#else
+  (void)self, (void)f, (void)res;
+  return false;
+#endif
+}
+
 int candy_dofile(candy_state_t *self, const char name[]) {
   FILE *f = fopen(name, "r");
   if (f == NULL)
     return perror(NULL), -1;
+  int res = 0;
+  if (_domap(self, f, &res)) {
+    fclose(f);
+    return res;
+  }
   struct file_info info = {f};
-  int res = candy_dostream(self, file_reader, &info);
+  res = candy_dostream(self, file_reader, &info);
   fclose(f);
   return res;
 }
+
+void candy_set_budget(candy_state_t *self, int64_t budget) {
+  candy_vm_set_budget(candy_state_vm(self), budget);
+}
+
+bool candy_suspended(candy_state_t *self) {
+  return candy_vm_is_suspended(candy_state_vm(self));
+}
+
+int candy_resume(candy_state_t *self) {
+  return candy_state_resume(self);
+}
+
+void candy_set_optimize(candy_state_t *self, int level) {
+  candy_state_set_optimize(self, level);
+}
+
+void candy_set_lazy(candy_state_t *self, bool lazy) {
+  candy_state_set_lazy(self, lazy);
+}
+
+int candy_regist(candy_state_t *self, const candy_regist_t list[]) {
+  return candy_vm_regist(candy_state_vm(self), list);
+}
+
+int candy_regist_fast(candy_state_t *self, const candy_regist_fast_t list[]) {
+  return candy_vm_regist_fast(candy_state_vm(self), list);
+}
+
+/* the window is a run of wraps, only the public side keeps it opaque */
+#define _arg(_args, _idx) ((candy_wrap_t *)(_args) + (_idx))
+
+candy_types_t candy_arg_type(const candy_args_t *args, int idx) {
+  return candy_wrap_get_type(_arg(args, idx));
+}
+
+candy_integer_t candy_arg_integer(const candy_args_t *args, int idx) {
+  return candy_wrap_get_integer(_arg(args, idx));
+}
+
+candy_float_t candy_arg_float(const candy_args_t *args, int idx) {
+  return candy_wrap_get_float(_arg(args, idx));
+}
+
+candy_boolean_t candy_arg_boolean(const candy_args_t *args, int idx) {
+  return candy_wrap_get_boolean(_arg(args, idx));
+}
+
+void candy_arg_set_none(candy_args_t *args, int idx) {
+  candy_wrap_set_none(_arg(args, idx));
+}
+
+void candy_arg_set_integer(candy_args_t *args, int idx, candy_integer_t val) {
+  candy_wrap_set_integer(_arg(args, idx), val);
+}
+
+void candy_arg_set_float(candy_args_t *args, int idx, candy_float_t val) {
+  candy_wrap_set_float(_arg(args, idx), val);
+}
+
+void candy_arg_set_boolean(candy_args_t *args, int idx, candy_boolean_t val) {
+  candy_wrap_set_boolean(_arg(args, idx), val);
+}
+
+int candy_fprint(candy_state_t *self, size_t idx, FILE *out) {
+  return candy_vm_fprint(candy_state_vm(self), idx, out);
+}
+
+size_t candy_get_top(candy_state_t *self) {
+  return candy_vm_get_top(candy_state_vm(self));
+}
+
+candy_types_t candy_get_type(candy_state_t *self, size_t idx) {
+  return candy_wrap_get_type(candy_vm_get(candy_state_vm(self), idx));
+}
+
+candy_integer_t candy_get_integer(candy_state_t *self, size_t idx) {
+  return candy_wrap_get_integer(candy_vm_get(candy_state_vm(self), idx));
+}
+
+candy_float_t candy_get_float(candy_state_t *self, size_t idx) {
+  return candy_wrap_get_float(candy_vm_get(candy_state_vm(self), idx));
+}
+
+candy_boolean_t candy_get_boolean(candy_state_t *self, size_t idx) {
+  return candy_wrap_get_boolean(candy_vm_get(candy_state_vm(self), idx));
+}
+
+const char *candy_get_string(candy_state_t *self, size_t idx, size_t *size) {
+  candy_array_t *arr = (candy_array_t *)candy_wrap_get_object(candy_vm_get(candy_state_vm(self), idx));
+  if (size)
+    *size = candy_array_size(arr);
+  return (const char *)candy_array_data(arr);
+}
+
+void candy_push_none(candy_state_t *self) {
+  candy_wrap_t wrap;
+  candy_wrap_set_none(&wrap);
+  candy_vm_push(candy_state_vm(self), &wrap);
+}
+
+void candy_push_integer(candy_state_t *self, candy_integer_t val) {
+  candy_wrap_t wrap;
+  candy_wrap_set_integer(&wrap, val);
+  candy_vm_push(candy_state_vm(self), &wrap);
+}
+
+void candy_push_float(candy_state_t *self, candy_float_t val) {
+  candy_wrap_t wrap;
+  candy_wrap_set_float(&wrap, val);
+  candy_vm_push(candy_state_vm(self), &wrap);
+}
+
+void candy_push_boolean(candy_state_t *self, candy_boolean_t val) {
+  candy_wrap_t wrap;
+  candy_wrap_set_boolean(&wrap, val);
+  candy_vm_push(candy_state_vm(self), &wrap);
+}
+
+void candy_push_string(candy_state_t *self, const char str[], size_t size) {
+  candy_wrap_t wrap = candy_vm_string(candy_state_vm(self), str, size);
+  candy_vm_push(candy_state_vm(self), &wrap);
+}
@@ -20,6 +20,7 @@ extern "C" {
 #endif /* __cplusplus */
 
 #include "core/candy_types.h"
+#include <stdio.h>
 
 candy_state_t *candy_new_state(candy_allocator_t alloc, void *arg);
 
@@ -35,6 +36,84 @@ int candy_dostring(candy_state_t *self, const char exp[], size_t size);
 
 int candy_dofile(candy_state_t *self, const char name[]);
 
+/**
+  * @brief  make the do functions return once the script has taken 'budget'
+  *         backward jumps and calls, 0 lets it run to the end; the budget is
+  *         per slice, each do or resume call starts with all of it
+  */
+void candy_set_budget(candy_state_t *self, int64_t budget);
+
+/* whether the last do or resume call has run out of budget */
+bool candy_suspended(candy_state_t *self);
+
+/* continue the script the last do or resume call has left suspended */
+int candy_resume(candy_state_t *self);
+
+/**
+  * @brief  the optimization level of what the do functions compile from now
+  *         on, 0 keeps the code as the parser emits it, 1 is the default
+  */
+void candy_set_optimize(candy_state_t *self, int level);
+
+/**
+  * @brief  make the do functions only skim the bodies of the functions a
+  *         script defines at its top level, each one is compiled on its
+  *         first call and a syntax error in it is reported there
+  */
+void candy_set_lazy(candy_state_t *self, bool lazy);
+
+int candy_regist(candy_state_t *self, const candy_regist_t list[]);
+
+/**
+  * @brief  register c-functions that read their arguments in place through
+  *         the candy_arg functions, without the push and get calls
+  */
+int candy_regist_fast(candy_state_t *self, const candy_regist_fast_t list[]);
+
+/**
+  * @brief  the slots of a fast c-function, 'idx' is below 'nargs' to read and
+  *         below 'nargs' or @ref CANDY_FAST_RESULTS to write
+  */
+candy_types_t candy_arg_type(const candy_args_t *args, int idx);
+
+candy_integer_t candy_arg_integer(const candy_args_t *args, int idx);
+
+candy_float_t candy_arg_float(const candy_args_t *args, int idx);
+
+candy_boolean_t candy_arg_boolean(const candy_args_t *args, int idx);
+
+void candy_arg_set_none(candy_args_t *args, int idx);
+
+void candy_arg_set_integer(candy_args_t *args, int idx, candy_integer_t val);
+
+void candy_arg_set_float(candy_args_t *args, int idx, candy_float_t val);
+
+void candy_arg_set_boolean(candy_args_t *args, int idx, candy_boolean_t val);
+
+int candy_fprint(candy_state_t *self, size_t idx, FILE *out);
+
+size_t candy_get_top(candy_state_t *self);
+
+candy_types_t candy_get_type(candy_state_t *self, size_t idx);
+
+candy_integer_t candy_get_integer(candy_state_t *self, size_t idx);
+
+candy_float_t candy_get_float(candy_state_t *self, size_t idx);
+
+candy_boolean_t candy_get_boolean(candy_state_t *self, size_t idx);
+
+const char *candy_get_string(candy_state_t *self, size_t idx, size_t *size);
+
+void candy_push_none(candy_state_t *self);
+
+void candy_push_integer(candy_state_t *self, candy_integer_t val);
+
+void candy_push_float(candy_state_t *self, candy_float_t val);
+
+void candy_push_boolean(candy_state_t *self, candy_boolean_t val);
+
+void candy_push_string(candy_state_t *self, const char str[], size_t size);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -14,101 +14,93 @@
   * limitations under the License.
   */
 #include "core/candy_buffer.h"
+#include "core/candy_memory.h"
 #include <string.h>
 
-static char *_data(candy_buffer_t *self) {
-  return (char *)candy_vector_data(&self->vec);
-}
-
-static char *_wptr(candy_buffer_t *self) {
-  return _data(self) + self->w;
-}
+#if CANDY_BUFFER_CHUNK_SIZE <= 0 || (CANDY_BUFFER_CHUNK_SIZE & (CANDY_BUFFER_CHUNK_SIZE - 1))
+#error "the chunk size of the buffer has to be a power of two"
+#endif
 
-static char *_rptr(candy_buffer_t *self) {
-  return _data(self) + self->r;
+/* a ring and the room repeating the bytes across its end */
+static size_t _bytes(size_t capacity) {
+  return capacity * 2;
 }
 
-static size_t _size(candy_buffer_t *self) {
-  return candy_vector_size(&self->vec);
+/* the unread bytes move to the start of a ring large enough for 'size' */
+static void _grow(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, size_t size) {
+  size_t capacity = self->capacity ? self->capacity * 2 : CANDY_BUFFER_CHUNK_SIZE * 2;
+  for (; capacity < size; capacity *= 2);
+  char *data = (char *)candy_memory_alloc(mem, ctx, _bytes(capacity));
+  size_t n = self->w - self->r, pos = self->r & (self->capacity - 1);
+  if (n) {
+    size_t first = n < self->capacity - pos ? n : self->capacity - pos;
+    memcpy(data, self->data + pos, first);
+    memcpy(data + first, self->data, n - first);
+  }
+  candy_memory_free(mem, self->data, _bytes(self->capacity));
+  self->data = data;
+  self->capacity = capacity;
+  self->r = 0;
+  self->w = n;
 }
 
-static int _fill(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, size_t ahead) {
-  size_t size = _size(self);
-  /* if the look-ahead step is smaller than the total length will be returned directly */
-  if (self->r + ahead < size)
-    return 0;
-  /* calculate the filling position of the read-only buffer */
-  size_t offset = self->w + ahead;
-  /** if the number of bytes that can be filled is less than
-      @ref CANDY_BUFFER_EXPAND_SIZE bytes, the buffer will be enlarged */
-  if (size <= offset) {
-    candy_vector_append(&self->vec, mem, ctx, NULL, CANDY_BUFFER_EXPAND_SIZE);
-    offset = size;
+const char *candy_buffer_fill(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, size_t size) {
+  if (size > self->capacity)
+    _grow(self, mem, ctx, size);
+  size_t mask = self->capacity - 1;
+  /* as much as fits up to the end of the ring or the first unread byte */
+  while (self->w - self->r < size && self->eos == 0) {
+    size_t pos = self->w & mask, room = self->capacity - (self->w - self->r);
+    int res = self->reader(self->data + pos, room < self->capacity - pos ? room : self->capacity - pos, self->arg);
+    if (res <= 0)
+      self->eos = res < 0 ? -1 : 1;
+    else
+      self->w += (size_t)res;
   }
-  /* otherwise buffer will be filled directly */
-  else {
-    /* restore the unread remain bytes to the header of the read-only buffer */
-    memmove(_wptr(self), _rptr(self), ahead);
-    self->r = self->w;
-  }
-  /* fill buffer */
-  int res = self->reader(_data(self) + offset, _size(self) - offset, self->arg);
-  if (res > 0)
-    candy_vector_resize(&self->vec, mem, ctx, offset + res);
-  return res;
+  if (self->w - self->r < size)
+    return NULL;
+  size_t pos = self->r & mask;
+  if (pos + size > self->capacity)
+    memcpy(self->data + self->capacity, self->data, pos + size - self->capacity);
+  return self->data + pos;
 }
 
 int candy_buffer_init(candy_buffer_t *self, candy_reader_t reader, void *arg) {
-  candy_vector_init(&self->vec, sizeof(char));
+  self->data = NULL;
+  self->capacity = 0;
   self->w = 0;
-  self->r = self->w;
+  self->r = 0;
+  self->eos = 0;
   self->reader = reader;
   self->arg = arg;
+  candy_vector_init(&self->text, sizeof(char));
+  self->record = NULL;
   return 0;
 }
 
 int candy_buffer_deinit(candy_buffer_t *self, candy_memory_t *mem) {
-  candy_vector_deinit(&self->vec, mem);
+  candy_memory_free(mem, self->data, _bytes(self->capacity));
+  candy_vector_deinit(&self->text, mem);
   return 0;
 }
 
-int candy_buffer_view(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, void *data, size_t cell, size_t ahead) {
-  size_t size = cell * ahead;
-  int res = 0;
-  while ((res = _fill(self, mem, ctx, cell * ahead)) > 0);
-  if (res < 0)
-    return res;
-  memcpy(data, _rptr(self) + size, cell);
-  return res;
-}
-
-int candy_buffer_read(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, void *data, size_t size) {
-  int res = 0;
-  while ((res = _fill(self, mem, ctx, size)) > 0);
-  if (res < 0)
-    return res;
-  if (data)
-    memcpy(data, _rptr(self), size);
-  self->r += size;
-  return size;
-}
-
-int candy_buffer_write(candy_buffer_t *self, const void *data, size_t size) {
-  if (self->r < self->w + size)
-    return -1;
-  memcpy(_wptr(self), data, size);
-  self->w += size;
+int candy_buffer_write(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, const void *data, size_t size) {
+  candy_vector_append(&self->text, mem, ctx, data, size);
   return size;
 }
 
 const void *candy_buffer_head(candy_buffer_t *self) {
-  return _data(self);
+  return candy_vector_data(&self->text);
 }
 
 size_t candy_buffer_size(candy_buffer_t *self) {
-  return self->w;
+  return candy_vector_size(&self->text);
 }
 
 void candy_buffer_reset(candy_buffer_t *self) {
-  self->w = 0;
+  candy_vector_resize(&self->text, NULL, NULL, 0);
+}
+
+void candy_buffer_record(candy_buffer_t *self, candy_vector_t *vec) {
+  self->record = vec;
 }
@@ -21,26 +21,89 @@ extern "C" {
 
 #include "core/candy_vector.h"
 #include "core/candy_priv.h"
+#include <string.h>
 
 typedef struct candy_buffer candy_buffer_t;
 
+/**
+  * a ring the reader fills a chunk at a time, the unread bytes stay where
+  * they are and those across its end are repeated after it when a peek
+  * needs them in one piece
+  */
 struct candy_buffer {
-  candy_vector_t vec;
+  /* a ring of 'capacity' bytes, a power of two, followed by as many */
+  char *data;
+  size_t capacity;
+  /* bytes filled and read since the start, the unread ones are in between */
   size_t w;
   size_t r;
+  /* 1 once the reader has nothing more, -1 once it failed */
+  int eos;
   candy_reader_t reader;
   void *arg;
+  /* text of the token being read, see @ref candy_buffer_write */
+  candy_vector_t text;
+  /* every byte read is appended to it, see @ref candy_buffer_record */
+  candy_vector_t *record;
 };
 
 int candy_buffer_init(candy_buffer_t *self, candy_reader_t reader, void *arg);
 
 int candy_buffer_deinit(candy_buffer_t *self, candy_memory_t *mem);
 
-int candy_buffer_view(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, void *data, size_t cell, size_t ahead);
+/* the slow path of @ref candy_buffer_peek, it calls the reader */
+const char *candy_buffer_fill(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, size_t size);
+
+/**
+  * @brief  the next 'size' bytes in one piece, valid until the buffer is
+  *         read or peeked again
+  * @retval NULL if the stream ends or fails before
+  */
+static inline const char *candy_buffer_peek(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, size_t size) {
+  size_t pos = self->r & (self->capacity - 1);
+  if (self->w - self->r >= size && pos + size <= self->capacity)
+    return self->data + pos;
+  return candy_buffer_fill(self, mem, ctx, size);
+}
+
+/* the unread bytes already in one piece, the reader is not called */
+static inline const char *candy_buffer_window(candy_buffer_t *self, size_t *size) {
+  size_t pos = self->r & (self->capacity - 1);
+  size_t n = self->w - self->r;
+  *size = n < self->capacity - pos ? n : self->capacity - pos;
+  return self->data + pos;
+}
+
+/**
+  * @brief  copy the cell 'ahead' of the next one, zero past the end
+  * @retval -1 if the reader failed
+  */
+static inline int candy_buffer_view(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, void *data, size_t cell, size_t ahead) {
+  const char *ptr = candy_buffer_peek(self, mem, ctx, cell * (ahead + 1));
+  if (ptr)
+    memcpy(data, ptr + cell * ahead, cell);
+  else
+    memset(data, 0, cell);
+  return self->eos < 0 ? -1 : 0;
+}
 
-int candy_buffer_read(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, void *data, size_t size);
+/**
+  * @brief  consume the next 'size' bytes, copied to 'data' unless it is NULL
+  * @retval -1 if the stream ends or fails before
+  */
+static inline int candy_buffer_read(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, void *data, size_t size) {
+  const char *ptr = candy_buffer_peek(self, mem, ctx, size);
+  if (ptr == NULL)
+    return -1;
+  if (data)
+    memcpy(data, ptr, size);
+  if (self->record)
+    candy_vector_append(self->record, mem, ctx, ptr, size);
+  self->r += size;
+  return (int)size;
+}
 
-int candy_buffer_write(candy_buffer_t *self, const void *data, size_t size);
+int candy_buffer_write(candy_buffer_t *self, candy_memory_t *mem, candy_exce_t *ctx, const void *data, size_t size);
 
 const void *candy_buffer_head(candy_buffer_t *self);
 
@@ -48,6 +111,9 @@ size_t candy_buffer_size(candy_buffer_t *self);
 
 void candy_buffer_reset(candy_buffer_t *self);
 
+/* append what is read from now on to 'vec', NULL stops recording */
+void candy_buffer_record(candy_buffer_t *self, candy_vector_t *vec);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -16,6 +16,8 @@
 #include "core/candy_closure.h"
 #include "core/candy_object.h"
 #include "core/candy_gc.h"
+#include "core/candy_wrap.h"
+#include "core/candy_proto.h"
 
 struct candy_cclosure {
   candy_object_t header;
@@ -27,8 +29,25 @@ struct candy_sclosure {
   candy_object_t header;
   candy_object_t *gray;
   candy_proto_t *proto;
+  /* as many as the prototype describes, see @ref candy_proto_get_upval */
+  size_t nupval;
+  candy_upval_t *upval[];
 };
 
+struct candy_upval {
+  candy_object_t header;
+  candy_object_t *gray;
+  /* the register while its frame runs, then 'closed' */
+  candy_wrap_t *val;
+  candy_wrap_t closed;
+  /* the next open one, with a lower register */
+  candy_upval_t *next;
+};
+
+static size_t _sclosure_size(size_t nupval) {
+  return sizeof(struct candy_sclosure) + nupval * sizeof(candy_upval_t *);
+}
+
 candy_cclosure_t *candy_cclosure_create(candy_gc_t *gc, candy_exce_t *ctx, candy_cfunc_t cfunc) {
   candy_cclosure_t *self = (candy_cclosure_t *)candy_gc_add(gc, ctx, CANDY_TYPE_CCLSR, sizeof(struct candy_cclosure));
   self->gray = NULL;
@@ -42,25 +61,91 @@ int candy_cclosure_delete(candy_cclosure_t *self, candy_gc_t *gc) {
 }
 
 candy_sclosure_t *candy_sclosure_create(candy_gc_t *gc, candy_exce_t *ctx, candy_proto_t *proto) {
-  candy_sclosure_t *self = (candy_sclosure_t *)candy_gc_add(gc, ctx, CANDY_TYPE_SCLSR, sizeof(struct candy_sclosure));
+  size_t nupval = candy_proto_get_size_upval(proto);
+  candy_sclosure_t *self = (candy_sclosure_t *)candy_gc_add(gc, ctx, CANDY_TYPE_SCLSR, _sclosure_size(nupval));
   self->gray = NULL;
   self->proto = proto;
+  self->nupval = nupval;
+  for (size_t idx = 0; idx < nupval; ++idx)
+    self->upval[idx] = NULL;
   return self;
 }
 
 int candy_sclosure_delete(candy_sclosure_t *self, candy_gc_t *gc) {
-  candy_gc_free(gc, self, sizeof(struct candy_sclosure));
+  candy_gc_free(gc, self, _sclosure_size(self->nupval));
   return 0;
 }
 
 int candy_sclosure_colouring(candy_sclosure_t *self, candy_gc_t *gc) {
+  self->gray = candy_gc_gray_swap(gc, (candy_object_t *)self);
+  candy_object_set_mark((candy_object_t *)self, MARK_GRAY);
   return 0;
 }
 
 int candy_sclosure_diffusion(candy_sclosure_t *self, candy_gc_t *gc) {
-  return -1;
+  candy_gc_gray_swap(gc, self->gray);
+  candy_object_set_mark((candy_object_t *)self, MARK_DARK);
+  for (size_t idx = 0; idx < self->nupval; ++idx)
+    candy_gc_colouring(gc, (candy_object_t *)self->upval[idx]);
+  return candy_gc_colouring(gc, (candy_object_t *)self->proto);
 }
 
-const candy_proto_t *candy_sclosure_get_proto(candy_sclosure_t *self) {
+candy_proto_t *candy_sclosure_get_proto(const candy_sclosure_t *self) {
   return self->proto;
 }
+
+candy_upval_t **candy_sclosure_get_upval(candy_sclosure_t *self) {
+  return self->upval;
+}
+
+int candy_upval_delete(candy_upval_t *self, candy_gc_t *gc) {
+  candy_gc_free(gc, self, sizeof(struct candy_upval));
+  return 0;
+}
+
+int candy_upval_colouring(candy_upval_t *self, candy_gc_t *gc) {
+  self->gray = candy_gc_gray_swap(gc, (candy_object_t *)self);
+  candy_object_set_mark((candy_object_t *)self, MARK_GRAY);
+  return 0;
+}
+
+int candy_upval_diffusion(candy_upval_t *self, candy_gc_t *gc) {
+  candy_gc_gray_swap(gc, self->gray);
+  candy_object_set_mark((candy_object_t *)self, MARK_DARK);
+  candy_wrap_colouring(self->val, gc);
+  return 0;
+}
+
+candy_upval_t *candy_upval_find(candy_upval_t **open, candy_gc_t *gc, candy_exce_t *ctx, candy_wrap_t *reg) {
+  for (; *open && (*open)->val >= reg; open = &(*open)->next)
+    if ((*open)->val == reg)
+      return *open;
+  candy_upval_t *self = (candy_upval_t *)candy_gc_add(gc, ctx, CANDY_TYPE_UPVAL, sizeof(struct candy_upval));
+  self->gray = NULL;
+  self->val = reg;
+  self->next = *open;
+  *open = self;
+  return self;
+}
+
+void candy_upval_close(candy_upval_t **open, const candy_wrap_t *level) {
+  while (*open && (*open)->val >= level) {
+    candy_upval_t *self = *open;
+    self->closed = *self->val;
+    self->val = &self->closed;
+    *open = self->next;
+  }
+}
+
+void candy_upval_relocate(candy_upval_t *open, uintptr_t prev, uintptr_t next) {
+  for (; open; open = open->next)
+    open->val = (candy_wrap_t *)((uintptr_t)open->val - prev + next);
+}
+
+candy_wrap_t *candy_upval_get(const candy_upval_t *self) {
+  return self->val;
+}
+
+candy_upval_t *candy_upval_next(const candy_upval_t *self) {
+  return self->next;
+}
@@ -39,7 +39,33 @@ int candy_sclosure_colouring(candy_sclosure_t *self, candy_gc_t *gc);
 
 int candy_sclosure_diffusion(candy_sclosure_t *self, candy_gc_t *gc);
 
-const candy_proto_t *candy_closure_get_proto(candy_sclosure_t *self);
+candy_proto_t *candy_sclosure_get_proto(const candy_sclosure_t *self);
+
+/* the upvalues of the closure, NULL until @ref candy_upval_find fills them in */
+candy_upval_t **candy_sclosure_get_upval(candy_sclosure_t *self);
+
+int candy_upval_delete(candy_upval_t *self, candy_gc_t *gc);
+
+int candy_upval_colouring(candy_upval_t *self, candy_gc_t *gc);
+
+int candy_upval_diffusion(candy_upval_t *self, candy_gc_t *gc);
+
+/**
+  * @brief  the open upvalue of register 'reg', created if no closure has
+  *         captured it yet. 'open' lists them from the highest register down.
+  */
+candy_upval_t *candy_upval_find(candy_upval_t **open, candy_gc_t *gc, candy_exce_t *ctx, candy_wrap_t *reg);
+
+/* copy the registers from 'level' up into their upvalues, the frame is leaving */
+void candy_upval_close(candy_upval_t **open, const candy_wrap_t *level);
+
+/* the registers have moved from 'prev' to 'next' */
+void candy_upval_relocate(candy_upval_t *open, uintptr_t prev, uintptr_t next);
+
+/* the value, in a register or the upvalue itself once closed */
+candy_wrap_t *candy_upval_get(const candy_upval_t *self);
+
+candy_upval_t *candy_upval_next(const candy_upval_t *self);
 
 #ifdef __cplusplus
 }
@@ -20,6 +20,7 @@ extern "C" {
 #endif /* __cplusplus */
 
 #include "core/candy_memory.h"
+#include "core/candy_object.h"
 #include "core/candy_priv.h"
 
 typedef enum candy_events {
@@ -82,6 +83,15 @@ static inline candy_handler_t candy_gc_event_handler(candy_gc_t *self) {
   return self->handler;
 }
 
+/**
+  * @brief  colour a reachable object unless it has been visited in this cycle
+  */
+static inline int candy_gc_colouring(candy_gc_t *self, candy_object_t *obj) {
+  if (obj == NULL || candy_object_get_mark(obj) != MARK_WHITE)
+    return 0;
+  return candy_gc_event_handler(self)(obj, self, EVT_COLOURING);
+}
+
 static inline void *candy_gc_alloc(candy_gc_t *self, candy_exce_t *ctx, size_t size) {
   return candy_memory_alloc(candy_gc_memory(self), ctx, size);
 }
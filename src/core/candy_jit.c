@@ -0,0 +1,695 @@
+/**
+  * Copyright 2022-2024 ShunzDai
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+/* mmap and mprotect are not part of c99 */
+#define _DEFAULT_SOURCE
+#include "core/candy_jit.h"
+#include "core/candy_trace.h"
+#include "core/candy_peephole.h"
+#include "core/candy_vector.h"
+#include "core/candy_memory.h"
+#include "core/candy_table.h"
+#include "core/candy_wrap.h"
+#include "core/candy_gc.h"
+#include "core/candy_exception.h"
+#include <stddef.h>
+#include <string.h>
+
+#if CANDY_JIT_X64
+#include <sys/mman.h>
+
+/**
+  * @brief  the native code is entered as
+  *         uint32_t fn(base, cnst, caches, glb, budget, entry)
+  *         and keeps the first five in callee saved registers.
+  */
+typedef uint32_t (*candy_native_t)(candy_wrap_t *, const candy_wrap_t *, candy_cache_t *, const candy_table_t *, int64_t *, const void *);
+
+struct candy_jit {
+  uint8_t *code;
+  size_t size;
+  /* offset of the template of each instruction */
+  uint32_t *entry;
+  size_t ninst;
+};
+
+typedef enum jit_regs {
+  RAX = 0, RCX = 1, RBX = 3,
+  R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+} jit_regs_t;
+
+/* what the frame is addressed with inside the native code */
+#define REG_BASE   RBX
+#define REG_CNST   R12
+#define REG_CACHES R13
+#define REG_GLB    R14
+#define REG_BUDGET R15
+
+/* both the data and the tags of a wrap are copied, see @ref _copy */
+#define WRAP_SIZE  sizeof(struct candy_wrap)
+#define WRAP_TAGS  sizeof(union candy_udata)
+
+/* jcc rel32 condition codes */
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_A  0x7
+#define CC_L  0xC
+#define CC_LE 0xE
+
+typedef struct jit_fixup {
+  uint32_t pos;
+  uint32_t target;
+  /* a failed guard lands on an exit stub instead of an instruction */
+  bool exit;
+} jit_fixup_t;
+
+typedef struct jit_emitter {
+  candy_vector_t code;
+  candy_vector_t fixups;
+  candy_memory_t *mem;
+  candy_exce_t *ctx;
+  uint32_t epilogue;
+  /* what is translated, a prototype or a trace */
+  const void *src;
+  /* allocated while emitting, released if anything throws */
+  candy_jit_t *jit;
+  uint32_t *entry;
+  size_t nentry;
+} jit_emitter_t;
+
+static void _emit(jit_emitter_t *self, const uint8_t *bytes, size_t size) {
+  size_t need = candy_vector_size(&self->code) + size;
+  if (need > candy_vector_capacity(&self->code)) {
+    size_t next = candy_vector_capacity(&self->code) ? candy_vector_capacity(&self->code) : 256;
+    while (next < need)
+      next <<= 1;
+    candy_vector_reserve(&self->code, self->mem, self->ctx, next);
+  }
+  candy_vector_append(&self->code, self->mem, self->ctx, bytes, size);
+}
+
+static inline uint32_t _here(jit_emitter_t *self) {
+  return (uint32_t)candy_vector_size(&self->code);
+}
+
+static inline void _byte(jit_emitter_t *self, uint8_t byte) {
+  _emit(self, &byte, 1);
+}
+
+static inline void _imm16(jit_emitter_t *self, uint16_t imm) {
+  _emit(self, (uint8_t []) {imm & 0xFF, imm >> 8}, 2);
+}
+
+static inline void _imm32(jit_emitter_t *self, uint32_t imm) {
+  _emit(self, (uint8_t []) {imm & 0xFF, (imm >> 8) & 0xFF, (imm >> 16) & 0xFF, imm >> 24}, 4);
+}
+
+static inline void _patch(jit_emitter_t *self, uint32_t pos, uint32_t target) {
+  uint32_t rel = target - (pos + 4);
+  memcpy((uint8_t *)candy_vector_data(&self->code) + pos, &rel, 4);
+}
+
+/**
+  * @brief  'op reg, [base + disp32]', 'w' selects the 64-bit operand size;
+  *         the prefixes of the instruction are already emitted.
+  */
+static void _mem(jit_emitter_t *self, bool w, const uint8_t *op, size_t size, uint8_t reg, uint8_t base, uint32_t disp) {
+  uint8_t rex = 0x40 | (w ? 0x08 : 0) | ((reg >> 3) << 2) | (base >> 3);
+  if (rex != 0x40)
+    _byte(self, rex);
+  _emit(self, op, size);
+  _byte(self, 0x80 | ((reg & 7) << 3) | (base & 7));
+  /* rsp and r12 can only be a base through a sib byte */
+  if ((base & 7) == 4)
+    _byte(self, 0x24);
+  _imm32(self, disp);
+}
+
+#define _mem_op(_self, _w, _reg, _base, _disp, ...) \
+_mem(_self, _w, (const uint8_t []) {__VA_ARGS__}, sizeof((const uint8_t []) {__VA_ARGS__}), _reg, _base, _disp)
+
+static inline uint32_t _r(uint32_t idx) {
+  return (uint32_t)(idx * WRAP_SIZE);
+}
+
+/* the register or constant a 'b'/'c' operand refers to */
+static inline void _rk(uint32_t rk, uint8_t *reg, uint32_t *disp) {
+  *reg = candy_inst_is_k(rk) ? REG_CNST : REG_BASE;
+  *disp = _r(candy_inst_get_k(rk));
+}
+
+static void _jump(jit_emitter_t *self, uint32_t target, bool exit) {
+  _emit(self, (uint8_t []) {0xE9}, 1);
+  jit_fixup_t fixup = {_here(self), target, exit};
+  candy_vector_append(&self->fixups, self->mem, self->ctx, &fixup, 1);
+  _imm32(self, 0);
+}
+
+static void _branch(jit_emitter_t *self, uint8_t cc, uint32_t target, bool exit) {
+  _emit(self, (uint8_t []) {0x0F, 0x80 | cc}, 2);
+  jit_fixup_t fixup = {_here(self), target, exit};
+  candy_vector_append(&self->fixups, self->mem, self->ctx, &fixup, 1);
+  _imm32(self, 0);
+}
+
+/* a backward jump uses up the budget, an empty one leaves at 'target' */
+static void _tick(jit_emitter_t *self, uint32_t target) {
+  _emit(self, (uint8_t []) {0x49, 0xFF, 0x0F}, 3); /* dec qword [r15] */
+  _branch(self, CC_E, target, true);
+}
+
+/* hand the pc back to the interpreter */
+static void _leave(jit_emitter_t *self, uint32_t pc) {
+  _byte(self, 0xB8);
+  _imm32(self, pc);
+  _byte(self, 0xE9);
+  _imm32(self, self->epilogue - (_here(self) + 4));
+}
+
+/* dst = src, the data as a qword and the type and mask as a word */
+static void _copy(jit_emitter_t *self, uint8_t dst, uint32_t ddisp, uint8_t src, uint32_t sdisp) {
+  _mem_op(self, true, RAX, src, sdisp, 0x8B);
+  _mem_op(self, true, RAX, dst, ddisp, 0x89);
+  _mem_op(self, false, RAX, src, sdisp + WRAP_TAGS, 0x0F, 0xB7);
+  _byte(self, 0x66);
+  _mem_op(self, false, RAX, dst, ddisp + WRAP_TAGS, 0x89);
+}
+
+/* the type of the wrap with a clear mask */
+static void _tag(jit_emitter_t *self, uint8_t dst, uint32_t disp, candy_types_t type) {
+  _byte(self, 0x66);
+  _mem_op(self, false, 0, dst, disp + WRAP_TAGS, 0xC7);
+  _imm16(self, type);
+}
+
+/* leave at 'pc' unless the wrap holds an integer */
+static void _guard(jit_emitter_t *self, uint8_t reg, uint32_t disp, uint32_t pc) {
+  _mem_op(self, false, 7, reg, disp + WRAP_TAGS, 0x80);
+  _byte(self, CANDY_TYPE_INTEGER);
+  _branch(self, CC_NE, pc, true);
+}
+
+/* rax = RK(B), guarded by the integer type of both operands */
+static void _operands(jit_emitter_t *self, candy_inst_t ins, uint32_t pc, uint8_t *rc, uint32_t *dc) {
+  uint8_t rb;
+  uint32_t db;
+  _rk(ins.iabc.b, &rb, &db);
+  _rk(ins.iabc.c, rc, dc);
+  _guard(self, rb, db, pc);
+  _guard(self, *rc, *dc, pc);
+  _mem_op(self, true, RAX, rb, db, 0x8B);
+}
+
+static void _arith(jit_emitter_t *self, candy_inst_t ins, uint32_t pc, const uint8_t *op, size_t size) {
+  uint8_t rc;
+  uint32_t dc;
+  _operands(self, ins, pc, &rc, &dc);
+  _mem(self, true, op, size, RAX, rc, dc);
+  _mem_op(self, true, RAX, REG_BASE, _r(ins.iabc.a), 0x89);
+  _tag(self, REG_BASE, _r(ins.iabc.a), CANDY_TYPE_INTEGER);
+}
+
+/* skip the next instruction unless the comparison equals A */
+static void _compare(jit_emitter_t *self, candy_inst_t ins, uint32_t pc, uint8_t cc) {
+  uint8_t rc;
+  uint32_t dc;
+  _operands(self, ins, pc, &rc, &dc);
+  _mem_op(self, true, RAX, rc, dc, 0x3B);
+  /* the lowest bit of a condition code negates it */
+  _branch(self, ins.iabc.a ? cc ^ 1 : cc, pc + 2, false);
+}
+
+/* rax = the value cache 'idx' holds for the key RK(rk), leave at 'pc' unless it is valid */
+static void _cached(jit_emitter_t *self, uint32_t idx, uint32_t rk, uint32_t pc) {
+  uint32_t cache = (uint32_t)(idx * sizeof(candy_cache_t));
+  uint8_t reg;
+  uint32_t disp;
+  _rk(rk, &reg, &disp);
+  _mem_op(self, false, RCX, REG_CACHES, cache + offsetof(candy_cache_t, version), 0x8B);
+  _mem_op(self, false, RCX, REG_GLB, offsetof(struct candy_table, version), 0x3B);
+  _branch(self, CC_NE, pc, true);
+  /* the object of the name is the data of its wrap */
+  _mem_op(self, true, RCX, REG_CACHES, cache + offsetof(candy_cache_t, key), 0x8B);
+  _mem_op(self, true, RCX, reg, disp, 0x3B);
+  _branch(self, CC_NE, pc, true);
+  _mem_op(self, true, RAX, REG_CACHES, cache + offsetof(candy_cache_t, val), 0x8B);
+}
+
+static void _gettabup(jit_emitter_t *self, candy_inst_t ins, uint32_t pc) {
+  _cached(self, ins.iabc.b, ins.iabc.c, pc);
+  _mem_op(self, true, RCX, RAX, 0, 0x8B);
+  _mem_op(self, true, RCX, REG_BASE, _r(ins.iabc.a), 0x89);
+  _mem_op(self, false, RCX, RAX, WRAP_TAGS, 0x0F, 0xB7);
+  _byte(self, 0x66);
+  _mem_op(self, false, RCX, REG_BASE, _r(ins.iabc.a) + WRAP_TAGS, 0x89);
+}
+
+/* a global that does not exist yet is left to the interpreter */
+static void _settabup(jit_emitter_t *self, candy_inst_t ins, uint32_t pc) {
+  uintptr_t null = (uintptr_t)&CANDY_WRAP_NULL;
+  uint8_t rc;
+  uint32_t dc;
+  _cached(self, ins.iabc.a - 1, ins.iabc.b, pc);
+  _emit(self, (uint8_t []) {0x48, 0xB9}, 2); /* mov rcx, imm64 */
+  _imm32(self, (uint32_t)null);
+  _imm32(self, (uint32_t)(null >> 32));
+  _emit(self, (uint8_t []) {0x48, 0x39, 0xC8}, 3); /* cmp rax, rcx */
+  _branch(self, CC_E, pc, true);
+  _emit(self, (uint8_t []) {0x48, 0x89, 0xC1}, 3); /* mov rcx, rax */
+  _rk(ins.iabc.c, &rc, &dc);
+  _copy(self, RCX, 0, rc, dc);
+}
+
+/**
+  * @brief  count the integer for loop at R(A) on, whichever way it goes,
+  *         and go to 'pc + 1' once it would pass the limit
+  */
+static void _forloop(jit_emitter_t *self, candy_inst_t ins, uint32_t pc, bool exit) {
+  uint32_t idx = _r(ins.iabx.a), limit = _r(ins.iabx.a + 1), step = _r(ins.iabx.a + 2);
+  /* the distance left, unsigned so that neither it nor the step overflows */
+  _mem_op(self, true, RCX, REG_BASE, limit, 0x8B);
+  _mem_op(self, true, RAX, REG_BASE, idx, 0x8B);
+  _mem_op(self, true, 7, REG_BASE, step, 0x83);
+  _byte(self, 0);
+  _emit(self, (uint8_t []) {0x0F, 0x80 | CC_L}, 2);
+  uint32_t down = _here(self);
+  _imm32(self, 0);
+  _emit(self, (uint8_t []) {0x48, 0x29, 0xC1}, 3); /* sub rcx, rax */
+  _mem_op(self, true, RCX, REG_BASE, step, 0x3B);
+  _byte(self, 0xE9);
+  uint32_t test = _here(self);
+  _imm32(self, 0);
+  _patch(self, down, _here(self));
+  _emit(self, (uint8_t []) {0x48, 0x29, 0xC8, 0x48, 0x89, 0xC1}, 6); /* sub rax, rcx; mov rcx, rax */
+  _mem_op(self, true, RAX, REG_BASE, step, 0x8B);
+  _emit(self, (uint8_t []) {0x48, 0xF7, 0xD8, 0x48, 0x39, 0xC1}, 6); /* neg rax; cmp rcx, rax */
+  _patch(self, test, _here(self));
+  _branch(self, CC_B, pc + 1, exit);
+  _mem_op(self, true, RAX, REG_BASE, idx, 0x8B);
+  _mem_op(self, true, RAX, REG_BASE, step, 0x03);
+  _mem_op(self, true, RAX, REG_BASE, idx, 0x89);
+  _mem_op(self, true, RAX, REG_BASE, _r(ins.iabx.a + 3), 0x89);
+  _tag(self, REG_BASE, _r(ins.iabx.a + 3), CANDY_TYPE_INTEGER);
+}
+
+/**
+  * @brief  emit the template of one instruction, whatever has none goes
+  *         back to the interpreter
+  * @retval false if the instruction has no template
+  */
+static bool _template(jit_emitter_t *self, const candy_inst_t *inst, uint32_t pc, uint32_t ninst) {
+  candy_inst_t ins = inst[pc];
+  /* the second half of a superinstruction has its own template */
+  switch (candy_peephole_first((candy_opcodes_t)ins.op)) {
+    case OP_MOVE:
+      _copy(self, REG_BASE, _r(ins.iabc.a), REG_BASE, _r(ins.iabc.b));
+      return true;
+    case OP_LOADK:
+      _copy(self, REG_BASE, _r(ins.iabx.a), REG_CNST, _r(ins.iabx.b));
+      return true;
+    case OP_LOADBOOL:
+      if (ins.iabc.c && pc + 2 >= ninst)
+        return false;
+      _mem_op(self, true, 0, REG_BASE, _r(ins.iabc.a), 0xC7);
+      _imm32(self, ins.iabc.b);
+      _tag(self, REG_BASE, _r(ins.iabc.a), CANDY_TYPE_BOOLEAN);
+      if (ins.iabc.c)
+        _jump(self, pc + 2, false);
+      return true;
+    case OP_LOADNONE:
+      for (uint32_t idx = 0; idx <= ins.iabc.b; ++idx)
+        _tag(self, REG_BASE, _r(ins.iabc.a + idx), CANDY_TYPE_NONE);
+      return true;
+    case OP_GETTABUP:
+      _gettabup(self, ins, pc);
+      return true;
+    case OP_SETTABUP:
+      if (!ins.iabc.a)
+        return false;
+      _settabup(self, ins, pc);
+      return true;
+    case OP_ADD:
+    case OP_ADDII:
+      _arith(self, ins, pc, (const uint8_t []) {0x03}, 1);
+      return true;
+    case OP_SUB:
+    case OP_SUBII:
+      _arith(self, ins, pc, (const uint8_t []) {0x2B}, 1);
+      return true;
+    case OP_MUL:
+    case OP_MULII:
+      _arith(self, ins, pc, (const uint8_t []) {0x0F, 0xAF}, 2);
+      return true;
+    case OP_EQ:
+    case OP_EQII:
+    case OP_LT:
+    case OP_LTII:
+    case OP_LE:
+    case OP_LEII: {
+      if (pc + 2 >= ninst)
+        return false;
+      candy_opcodes_t op = candy_peephole_first((candy_opcodes_t)ins.op);
+      _compare(self, ins, pc, op == OP_EQ || op == OP_EQII ? CC_E : op == OP_LT || op == OP_LTII ? CC_L : CC_LE);
+      return true;
+    }
+    case OP_JMP: {
+      int64_t target = (int64_t)pc + 1 + candy_inst_get_sbx(ins);
+      if (target < 0 || target >= ninst)
+        return false;
+      if (target <= pc)
+        _tick(self, (uint32_t)target);
+      _jump(self, (uint32_t)target, false);
+      return true;
+    }
+    case OP_FORLOOP:
+    case OP_JFORLOOP:
+    case OP_IFORLOOP: {
+      int64_t target = (int64_t)pc + 1 + candy_inst_get_sbx(ins);
+      if (target < 0 || target > pc || pc + 1 >= ninst)
+        return false;
+      /* a float loop is left to the interpreter */
+      for (uint32_t idx = 0; idx < 3; ++idx)
+        _guard(self, REG_BASE, _r(ins.iabx.a + idx), pc);
+      _forloop(self, ins, pc, false);
+      _tick(self, (uint32_t)target);
+      _jump(self, (uint32_t)target, false);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+/* leave at 'pc' unless the wrap has the given type and mask */
+static void _check(jit_emitter_t *self, uint8_t reg, uint32_t disp, uint16_t tags, uint32_t pc) {
+  _byte(self, 0x66);
+  _mem_op(self, false, 7, reg, disp + WRAP_TAGS, 0x81);
+  _imm16(self, tags);
+  _branch(self, CC_NE, pc, true);
+}
+
+/* 'op xmm, qword [base + disp]' of the scalar double instructions */
+static void _sse(jit_emitter_t *self, uint8_t prefix, uint8_t op, uint8_t xmm, uint8_t base, uint32_t disp) {
+  _byte(self, prefix);
+  _mem_op(self, false, xmm, base, disp, 0x0F, op);
+}
+
+static void _float(jit_emitter_t *self, const candy_trace_step_t *step) {
+  candy_inst_t ins = step->ins;
+  uint8_t rb, rc;
+  uint32_t db, dc;
+  _rk(ins.iabc.b, &rb, &db);
+  _rk(ins.iabc.c, &rc, &dc);
+  if (step->tags == CANDY_TYPE_INTEGER) {
+    /* cvtsi2sd xmm0, [b]; cvtsi2sd xmm1, [c]; divsd xmm0, xmm1 */
+    _byte(self, 0xF2);
+    _mem_op(self, true, 0, rb, db, 0x0F, 0x2A);
+    _byte(self, 0xF2);
+    _mem_op(self, true, 1, rc, dc, 0x0F, 0x2A);
+    _emit(self, (uint8_t []) {0xF2, 0x0F, 0x5E, 0xC1}, 4);
+  }
+  else {
+    _sse(self, 0xF2, 0x10, 0, rb, db);
+    switch (ins.op) {
+      case OP_ADD: _sse(self, 0xF2, 0x58, 0, rc, dc); break;
+      case OP_SUB: _sse(self, 0xF2, 0x5C, 0, rc, dc); break;
+      case OP_MUL: _sse(self, 0xF2, 0x59, 0, rc, dc); break;
+      default:     _sse(self, 0xF2, 0x5E, 0, rc, dc); break;
+    }
+  }
+  _sse(self, 0xF2, 0x11, 0, REG_BASE, _r(ins.iabc.a));
+  _tag(self, REG_BASE, _r(ins.iabc.a), CANDY_TYPE_FLOAT);
+}
+
+/**
+  * @brief  emit a step of a trace, its operand types are known so only the
+  *         direction of a comparison, the end of a for loop and the globals
+  *         are guarded
+  */
+static void _step(jit_emitter_t *self, const candy_trace_step_t *step, uint32_t loop) {
+  candy_inst_t ins = step->ins;
+  uint8_t rb, rc;
+  uint32_t db, dc;
+  switch (ins.op) {
+    case OP_MOVE:
+      _copy(self, REG_BASE, _r(ins.iabc.a), REG_BASE, _r(ins.iabc.b));
+      break;
+    case OP_LOADK:
+      _copy(self, REG_BASE, _r(ins.iabx.a), REG_CNST, _r(ins.iabx.b));
+      break;
+    case OP_LOADBOOL:
+      _mem_op(self, true, 0, REG_BASE, _r(ins.iabc.a), 0xC7);
+      _imm32(self, ins.iabc.b);
+      _tag(self, REG_BASE, _r(ins.iabc.a), CANDY_TYPE_BOOLEAN);
+      break;
+    case OP_LOADNONE:
+      for (uint32_t idx = 0; idx <= ins.iabc.b; ++idx)
+        _tag(self, REG_BASE, _r(ins.iabc.a + idx), CANDY_TYPE_NONE);
+      break;
+    case OP_GETTABUP:
+      _gettabup(self, ins, step->pc);
+      _check(self, REG_BASE, _r(ins.iabc.a), step->tags, step->pc + 1);
+      break;
+    case OP_SETTABUP:
+      _settabup(self, ins, step->pc);
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+      if (step->tags != CANDY_TYPE_INTEGER) {
+        _float(self, step);
+        break;
+      }
+      _rk(ins.iabc.b, &rb, &db);
+      _rk(ins.iabc.c, &rc, &dc);
+      _mem_op(self, true, RAX, rb, db, 0x8B);
+      if (ins.op == OP_MUL)
+        _mem_op(self, true, RAX, rc, dc, 0x0F, 0xAF);
+      else
+        _mem_op(self, true, RAX, rc, dc, ins.op == OP_ADD ? 0x03 : 0x2B);
+      _mem_op(self, true, RAX, REG_BASE, _r(ins.iabc.a), 0x89);
+      _tag(self, REG_BASE, _r(ins.iabc.a), CANDY_TYPE_INTEGER);
+      break;
+    case OP_DIV:
+      _float(self, step);
+      break;
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE: {
+      uint8_t cc;
+      _rk(ins.iabc.b, &rb, &db);
+      _rk(ins.iabc.c, &rc, &dc);
+      if (step->tags == CANDY_TYPE_INTEGER) {
+        _mem_op(self, true, RAX, rb, db, 0x8B);
+        _mem_op(self, true, RAX, rc, dc, 0x3B);
+        cc = ins.op == OP_EQ ? CC_E : ins.op == OP_LT ? CC_L : CC_LE;
+      }
+      else {
+        /* c > b and c >= b are false for unordered operands */
+        _sse(self, 0xF2, 0x10, 0, rc, dc);
+        _sse(self, 0x66, 0x2E, 0, rb, db);
+        cc = ins.op == OP_LT ? CC_A : CC_AE;
+      }
+      if (ins.iabc.a)
+        cc ^= 1;
+      /* the other way than recorded leaves the trace */
+      if (step->skip)
+        _branch(self, cc ^ 1, step->pc + 1, true);
+      else
+        _branch(self, cc, step->pc + 2, true);
+      break;
+    }
+    case OP_FORLOOP:
+      _forloop(self, ins, step->pc, true);
+      /* fall through */
+    default:
+      /* the jump that closes the loop */
+      _tick(self, (uint32_t)((int64_t)step->pc + 1 + candy_inst_get_sbx(step->ins)));
+      _byte(self, 0xE9);
+      _imm32(self, loop - (_here(self) + 4));
+      break;
+  }
+}
+
+static void _prologue(jit_emitter_t *self) {
+  static const uint8_t code[] = {
+    0x53,             /* push rbx */
+    0x41, 0x54,       /* push r12 */
+    0x41, 0x55,       /* push r13 */
+    0x41, 0x56,       /* push r14 */
+    0x41, 0x57,       /* push r15 */
+    0x48, 0x89, 0xFB, /* mov rbx, rdi */
+    0x49, 0x89, 0xF4, /* mov r12, rsi */
+    0x49, 0x89, 0xD5, /* mov r13, rdx */
+    0x49, 0x89, 0xCE, /* mov r14, rcx */
+    0x4D, 0x89, 0xC7, /* mov r15, r8 */
+    0x41, 0xFF, 0xE1, /* jmp r9 */
+  };
+  static const uint8_t epilogue[] = {
+    0x41, 0x5F,       /* pop r15 */
+    0x41, 0x5E,       /* pop r14 */
+    0x41, 0x5D,       /* pop r13 */
+    0x41, 0x5C,       /* pop r12 */
+    0x5B,             /* pop rbx */
+    0xC3,             /* ret */
+  };
+  _emit(self, code, sizeof(code));
+  self->epilogue = _here(self);
+  _emit(self, epilogue, sizeof(epilogue));
+}
+
+/* the stubs of the failed guards and the targets of the jumps */
+static void _link(jit_emitter_t *self, const uint32_t *entry) {
+  jit_fixup_t *fixups = (jit_fixup_t *)candy_vector_data(&self->fixups);
+  for (size_t idx = 0; idx < candy_vector_size(&self->fixups); ++idx) {
+    if (fixups[idx].exit) {
+      _patch(self, fixups[idx].pos, _here(self));
+      _leave(self, fixups[idx].target);
+    }
+    else
+      _patch(self, fixups[idx].pos, entry[fixups[idx].target]);
+  }
+}
+
+static bool _layout(void) {
+  candy_wrap_t wrap;
+  memset(&wrap, 0, sizeof(wrap));
+  candy_wrap_set_type(&wrap, CANDY_TYPE_INTEGER);
+  candy_wrap_set_mask(&wrap, MASK_ARRAY);
+  return ((uint8_t *)&wrap)[WRAP_TAGS] == CANDY_TYPE_INTEGER && ((uint8_t *)&wrap)[WRAP_TAGS + 1] == MASK_ARRAY;
+}
+
+static void _begin(jit_emitter_t *self, size_t nentry) {
+  self->jit = (candy_jit_t *)candy_memory_alloc(self->mem, self->ctx, sizeof(struct candy_jit));
+  self->entry = (uint32_t *)candy_memory_alloc(self->mem, self->ctx, nentry * sizeof(uint32_t));
+  self->nentry = nentry;
+  _prologue(self);
+}
+
+static void _compile(jit_emitter_t *self) {
+  const candy_inst_t *inst = candy_proto_get_inst((const candy_proto_t *)self->src);
+  uint32_t ninst = (uint32_t)candy_proto_get_size_inst((const candy_proto_t *)self->src);
+  _begin(self, ninst);
+  for (uint32_t pc = 0; pc < ninst; ++pc) {
+    self->entry[pc] = _here(self);
+    if (!_template(self, inst, pc, ninst))
+      _leave(self, pc);
+  }
+  _link(self, self->entry);
+}
+
+static void _trace(jit_emitter_t *self) {
+  const candy_trace_t *trace = (const candy_trace_t *)self->src;
+  _begin(self, 1);
+  self->entry[0] = _here(self);
+  const candy_trace_guard_t *guards = candy_trace_get_guards(trace);
+  for (size_t idx = 0; idx < candy_trace_get_size_guards(trace); ++idx)
+    _check(self, REG_BASE, _r(guards[idx].reg), guards[idx].tags, candy_trace_get_header(trace));
+  /* the types of a stable loop hold for every iteration once checked */
+  uint32_t loop = candy_trace_is_stable(trace) ? _here(self) : self->entry[0];
+  const candy_trace_step_t *steps = candy_trace_get_steps(trace);
+  for (size_t idx = 0; idx < candy_trace_get_size_steps(trace); ++idx)
+    _step(self, &steps[idx], loop);
+  _link(self, self->entry);
+}
+
+/**
+  * @brief  emit the code of 'src' with 'cb' and map it executable, nothing
+  *         the emitter allocated is left behind if that throws.
+  * @retval NULL if the code cannot be mapped
+  */
+static candy_jit_t *_translate(const void *src, candy_gc_t *gc, candy_exce_t *ctx, candy_exce_cb_t cb) {
+  jit_emitter_t emitter = {.mem = candy_gc_memory(gc), .ctx = ctx, .src = src};
+  candy_object_t *msg = NULL;
+  candy_vector_init(&emitter.code, sizeof(uint8_t));
+  candy_vector_init(&emitter.fixups, sizeof(jit_fixup_t));
+  candy_err_t err = candy_exce_try(ctx, cb, &emitter, &msg);
+  uint8_t *code = MAP_FAILED;
+  size_t size = candy_vector_size(&emitter.code);
+  if (err == EXCE_OK) {
+    code = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+      memcpy(code, candy_vector_data(&emitter.code), size);
+      if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        code = MAP_FAILED;
+      }
+    }
+  }
+  candy_vector_deinit(&emitter.code, emitter.mem);
+  candy_vector_deinit(&emitter.fixups, emitter.mem);
+  if (code == MAP_FAILED) {
+    candy_memory_free(emitter.mem, emitter.entry, emitter.nentry * sizeof(uint32_t));
+    candy_memory_free(emitter.mem, emitter.jit, emitter.jit ? sizeof(struct candy_jit) : 0);
+    if (err != EXCE_OK)
+      candy_exce_throw(ctx, err, msg);
+    return NULL;
+  }
+  emitter.jit->code = code;
+  emitter.jit->size = size;
+  emitter.jit->entry = emitter.entry;
+  emitter.jit->ninst = emitter.nentry;
+  return emitter.jit;
+}
+
+candy_jit_t *candy_jit_compile(const candy_proto_t *proto, candy_gc_t *gc, candy_exce_t *ctx) {
+  /* the templates write the type and mask of a wrap as one word */
+  if (!_layout() || candy_proto_get_size_inst(proto) == 0)
+    return NULL;
+  return _translate(proto, gc, ctx, (candy_exce_cb_t)_compile);
+}
+
+candy_jit_t *candy_jit_trace(const candy_trace_t *trace, candy_gc_t *gc, candy_exce_t *ctx) {
+  if (!_layout())
+    return NULL;
+  return _translate(trace, gc, ctx, (candy_exce_cb_t)_trace);
+}
+
+int candy_jit_delete(candy_jit_t *self, candy_gc_t *gc) {
+  munmap(self->code, self->size);
+  candy_memory_free(candy_gc_memory(gc), self->entry, self->ninst * sizeof(uint32_t));
+  candy_memory_free(candy_gc_memory(gc), self, sizeof(struct candy_jit));
+  return 0;
+}
+
+size_t candy_jit_run(const candy_jit_t *self, candy_wrap_t *base, const candy_wrap_t *cnst, candy_cache_t *caches, const candy_table_t *glb, int64_t *budget, size_t pc) {
+  candy_native_t native;
+  /* object pointers cannot be converted to functions in iso c */
+  void *code = self->code;
+  memcpy(&native, &code, sizeof(native));
+  return native(base, cnst, caches, glb, budget, self->code + self->entry[pc]);
+}
+
+#else /* CANDY_JIT_X64 */
+
+candy_jit_t *candy_jit_compile(const candy_proto_t *proto, candy_gc_t *gc, candy_exce_t *ctx) {
+  return NULL;
+}
+
+candy_jit_t *candy_jit_trace(const candy_trace_t *trace, candy_gc_t *gc, candy_exce_t *ctx) {
+  return NULL;
+}
+
+int candy_jit_delete(candy_jit_t *self, candy_gc_t *gc) {
+  return 0;
+}
+
+size_t candy_jit_run(const candy_jit_t *self, candy_wrap_t *base, const candy_wrap_t *cnst, candy_cache_t *caches, const candy_table_t *glb, int64_t *budget, size_t pc) {
+  return pc;
+}
+
+#endif /* CANDY_JIT_X64 */
@@ -0,0 +1,59 @@
+/**
+  * Copyright 2022-2024 ShunzDai
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+#ifndef CANDY_CORE_JIT_H
+#define CANDY_CORE_JIT_H
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include "core/candy_priv.h"
+#include "core/candy_proto.h"
+
+/* the only backend there is emits x86-64 for the system v abi */
+#if CANDY_JIT && defined(__x86_64__) && defined(__unix__)
+#define CANDY_JIT_X64 1
+#else
+#define CANDY_JIT_X64 0
+#endif
+
+/**
+  * @brief  translate the instructions of a prototype into native code, one
+  *         template per instruction working on the registers of the frame.
+  * @retval NULL if there is no backend or the code cannot be mapped
+  */
+candy_jit_t *candy_jit_compile(const candy_proto_t *proto, candy_gc_t *gc, candy_exce_t *ctx);
+
+/**
+  * @brief  translate a recorded loop into native code without type checks
+  *         or dispatch, every guard it keeps is a side exit.
+  * @retval NULL if there is no backend or the code cannot be mapped
+  */
+candy_jit_t *candy_jit_trace(const candy_trace_t *trace, candy_gc_t *gc, candy_exce_t *ctx);
+
+int candy_jit_delete(candy_jit_t *self, candy_gc_t *gc);
+
+/**
+  * @brief  run the native code from the instruction at 'pc' on, until an
+  *         instruction it has no template for, whose guard fails or that
+  *         finds the 'budget' used up.
+  * @retval index of the instruction the interpreter resumes at
+  */
+size_t candy_jit_run(const candy_jit_t *self, candy_wrap_t *base, const candy_wrap_t *cnst, candy_cache_t *caches, const candy_table_t *glb, int64_t *budget, size_t pc);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* CANDY_CORE_JIT_H */
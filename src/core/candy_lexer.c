@@ -19,24 +19,35 @@
 #include "core/candy_gc.h"
 #include "core/candy_array.h"
 #include "core/candy_print.h"
+#include "core/candy_reader.h"
+#include "core/candy_scan.h"
 #include <string.h>
 
 #define lex_assert(_condition, _format, ...) \
 candy_assert(self->ctx, self->gc, _condition, EXCE_ERR_LEXICAL, _format, ##__VA_ARGS__)
 
 static const char *_head(candy_lexer_t *self) {
+  if (self->span.data && !self->span.copied)
+    return self->span.data + self->span.start;
   return candy_buffer_head(&self->buff);
 }
 
 static size_t _size(candy_lexer_t *self) {
+  if (self->span.data && !self->span.copied)
+    return self->span.len;
   return candy_buffer_size(&self->buff);
 }
 
 static void _reset(candy_lexer_t *self) {
+  self->span.len = 0;
+  self->span.copied = false;
   candy_buffer_reset(&self->buff);
 }
 
+/* the byte 'ahead' of the next one, zero at the end of the source */
 static char _view(candy_lexer_t *self, size_t ahead) {
+  if (self->span.data)
+    return self->span.pos + ahead < self->span.size ? self->span.data[self->span.pos + ahead] : '\0';
   char ch = 0;
   int res = candy_buffer_view(&self->buff, candy_gc_memory(self->gc), self->ctx, &ch, sizeof(char), ahead);
   lex_assert(res >= 0, "abnormal input stream");
@@ -44,6 +55,14 @@ static char _view(candy_lexer_t *self, size_t ahead) {
 }
 
 static void _readn(candy_lexer_t *self, char str[], size_t size) {
+  if (self->span.data) {
+    lex_assert(self->span.pos + size <= self->span.size, "abnormal input stream");
+    if (str)
+      memcpy(str, self->span.data + self->span.pos, size);
+    self->span.pos += size;
+    self->dbg.column += size;
+    return;
+  }
   int res = candy_buffer_read(&self->buff, candy_gc_memory(self->gc), self->ctx, str, size);
   lex_assert(res >= 0, "abnormal input stream");
   self->dbg.column += size;
@@ -63,12 +82,51 @@ static void _skip(candy_lexer_t *self) {
   _skipn(self, 1);
 }
 
+/* the bytes from the next one on that can be looked at without reading, at
+   least the one @ref _view just returned */
+static const char *_window(candy_lexer_t *self, size_t *size) {
+  if (self->span.data) {
+    *size = self->span.size - self->span.pos;
+    return self->span.data + self->span.pos;
+  }
+  return candy_buffer_window(&self->buff, size);
+}
+
+static void _save_str(candy_lexer_t *self, const char *str, size_t size) {
+  if (self->span.data && !self->span.copied) {
+    candy_buffer_write(&self->buff, candy_gc_memory(self->gc), self->ctx, self->span.data + self->span.start, self->span.len);
+    self->span.copied = true;
+  }
+  candy_buffer_write(&self->buff, candy_gc_memory(self->gc), self->ctx, str, size);
+}
+
 static void _save_char(candy_lexer_t *self, char ch) {
-  candy_buffer_write(&self->buff, &ch, 1);
+  _save_str(self, &ch, 1);
+}
+
+/* the next 'n' bytes right after the slice only make it longer */
+static bool _extend(candy_lexer_t *self, size_t n) {
+  if (!self->span.data || self->span.copied || (self->span.len && self->span.start + self->span.len != self->span.pos))
+    return false;
+  if (self->span.len == 0)
+    self->span.start = self->span.pos;
+  self->span.len += n;
+  _skipn(self, n);
+  return true;
 }
 
 static void _save(candy_lexer_t *self) {
-  _save_char(self, _read(self));
+  if (!_extend(self, 1))
+    _save_char(self, _read(self));
+}
+
+/* save the next 'n' bytes, all of them in the window */
+static void _saven(candy_lexer_t *self, size_t n) {
+  size_t size;
+  if (n == 0 || _extend(self, n))
+    return;
+  _save_str(self, _window(self, &size), n);
+  _skipn(self, n);
 }
 
 /**
@@ -116,6 +174,8 @@ static void _handle_newline(candy_lexer_t *self, void (*pred)(candy_lexer_t *))
 }
 
 static void _skip_line(candy_lexer_t *self) {
+  const char *str;
+  size_t size;
   while (1) {
     switch (_view(self, 0)) {
       case '\r': case '\n':
@@ -123,7 +183,8 @@ static void _skip_line(candy_lexer_t *self) {
       case '\0':
         return;
       default:
-        _skip(self);
+        str = _window(self, &size);
+        _skipn(self, candy_scan_line(str, size));
         break;
     }
   }
@@ -155,18 +216,20 @@ static void _save_hex(candy_lexer_t *self) {
 static candy_tokens_t _get_number(candy_lexer_t *self, candy_meta_t *meta) {
   candy_tokens_t token = TK_INTEGER;
   bool(*check)(char) = is_dec;
-  char first = _read(self);
-  _save_char(self, first);
-  if (first == '0') {
-    if (_check_dual(self, "Xx", _skip)) {
-      lex_assert(is_hex(_view(self, 0)), "invalid hexadecimal number");
-      check = is_hex;
-    }
-    else if (_check_dual(self, "Bb", _skip)) {
-      lex_assert(is_bin(_view(self, 0)), "invalid binary number");
-      check = is_bin;
-    }
+  char first = _view(self, 0);
+  /* the prefix is left out of the text, the digits alone are converted */
+  if (first == '0' && (_view(self, 1) == 'X' || _view(self, 1) == 'x')) {
+    _skipn(self, 2);
+    lex_assert(is_hex(_view(self, 0)), "invalid hexadecimal number");
+    check = is_hex;
+  }
+  else if (first == '0' && (_view(self, 1) == 'B' || _view(self, 1) == 'b')) {
+    _skipn(self, 2);
+    lex_assert(is_bin(_view(self, 0)), "invalid binary number");
+    check = is_bin;
   }
+  else
+    _save(self);
   while (1) {
     if (check(_view(self, 0)))
       _save(self);
@@ -206,6 +269,8 @@ static candy_tokens_t _get_number(candy_lexer_t *self, candy_meta_t *meta) {
   */
 static candy_tokens_t _get_string(candy_lexer_t *self, candy_meta_t *meta, const bool multiline) {
   const char del = _view(self, 0);
+  const char *str;
+  size_t size;
   /* skip first " or ' */
   _skipn(self, multiline ? 3 : 1);
   while (1) {
@@ -250,6 +315,8 @@ static candy_tokens_t _get_string(candy_lexer_t *self, candy_meta_t *meta, const
         if (_view(self, 0) == del && (!multiline || (_view(self, 1) == del && _view(self, 2) == del)))
           goto exit;
         _save(self);
+        str = _window(self, &size);
+        _saven(self, candy_scan_string(str, size, del));
         break;
     }
   }
@@ -257,15 +324,19 @@ static candy_tokens_t _get_string(candy_lexer_t *self, candy_meta_t *meta, const
   _skipn(self, multiline ? 3 : 1);
   meta->s = candy_array_create(self->gc, self->ctx, CANDY_TYPE_CHAR, MASK_NONE);
   candy_array_append(meta->s, self->gc, self->ctx, _head(self), _size(self));
-  printf("string <%.*s>\n", (int)_size(self), _head(self));
   return TK_STRING;
 }
 
 static candy_tokens_t _get_ident_or_keyword(candy_lexer_t *self, candy_meta_t *meta) {
+  const char *str;
+  size_t size;
   /* save alpha */
   _save(self);
-  /* save alpha or number */
-  while (_check_next(self, is_alnum, _save));
+  /* save alpha or number, a run at a time while the window lasts */
+  do {
+    str = _window(self, &size);
+    _saven(self, candy_scan_alnum(str, size));
+  } while (_check_next(self, is_alnum, _save));
   /* check keyword */
   switch (djb_hash(_head(self), _size(self))) {
     #define CANDY_KW_MATCH
@@ -273,12 +344,13 @@ static candy_tokens_t _get_ident_or_keyword(candy_lexer_t *self, candy_meta_t *m
     default:
       meta->s = candy_array_create(self->gc, self->ctx, CANDY_TYPE_CHAR, MASK_NONE);
       candy_array_append(meta->s, self->gc, self->ctx, _head(self), _size(self));
-      printf("ident <%.*s>\n", (int)_size(self), _head(self));
       return TK_IDENT;
   }
 }
 
 static candy_tokens_t _lexer(candy_lexer_t *self, candy_meta_t *meta) {
+  const char *str;
+  size_t size;
   _reset(self);
   while (1) {
     switch (_view(self, 0)) {
@@ -288,7 +360,8 @@ static candy_tokens_t _lexer(candy_lexer_t *self, candy_meta_t *meta) {
         _handle_newline(self, _skip);
         break;
       case ' ': case '\f': case '\t': case '\v':
-        _skip(self);
+        str = _window(self, &size);
+        _skipn(self, candy_scan_space(str, size));
         break;
       case '!':
         lex_assert(_view(self, 1) == '=', "unknown character '%c'(0x%02X)", _view(self, 1), _view(self, 1));
@@ -347,6 +420,12 @@ static candy_tokens_t _lexer(candy_lexer_t *self, candy_meta_t *meta) {
 int candy_lexer_init(candy_lexer_t *self, candy_gc_t *gc, candy_exce_t *ctx, candy_reader_t reader, void *arg) {
   memset(self, 0, sizeof(struct candy_lexer));
   candy_buffer_init(&self->buff, reader, arg);
+  /* the whole source is already in memory */
+  if (reader == string_reader) {
+    struct str_info *info = (struct str_info *)arg;
+    self->span.data = info->exp + info->offset;
+    self->span.size = info->size - info->offset;
+  }
   self->dbg.line = 1;
   self->dbg.column = 1;
   self->lookahead.token = TK_EOS;
@@ -373,3 +452,18 @@ const candy_meta_t *candy_lexer_next(candy_lexer_t *self) {
   self->lookahead.token = TK_EOS;
   return &self->lookahead.meta;
 }
+
+bool candy_lexer_record(candy_lexer_t *self, candy_vector_t *vec) {
+  if (vec && self->lookahead.token != TK_EOS)
+    return false;
+  /* a slice of the source is appended at once when the recording stops */
+  if (self->span.data) {
+    if (!vec && self->span.record)
+      candy_vector_append(self->span.record, candy_gc_memory(self->gc), self->ctx, self->span.data + self->span.from, self->span.pos - self->span.from);
+    self->span.record = vec;
+    self->span.from = self->span.pos;
+    return true;
+  }
+  candy_buffer_record(&self->buff, vec);
+  return true;
+}
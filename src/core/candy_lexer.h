@@ -50,6 +50,22 @@ union candy_meta {
 
 struct candy_lexer {
   candy_buffer_t buff;
+  /**
+    * the source of a string reader is read in place instead of through
+    * 'buff', the text of a token is a slice of it until an escape makes
+    * it differ, then it is copied to the text of 'buff'
+    */
+  struct {
+    const char *data;
+    size_t size;
+    size_t pos;
+    size_t start;
+    size_t len;
+    bool copied;
+    /* see @ref candy_lexer_record */
+    candy_vector_t *record;
+    size_t from;
+  } span;
   struct {
     size_t line;
     size_t column;
@@ -85,6 +101,13 @@ int candy_lexer_deinit(candy_lexer_t *self);
 candy_tokens_t candy_lexer_lookahead(candy_lexer_t *self);
 const candy_meta_t *candy_lexer_next(candy_lexer_t *self);
 
+/**
+  * @brief  append the source from the next token on to 'vec', NULL stops
+  *         recording
+  * @retval false if the next token has already been looked ahead
+  */
+bool candy_lexer_record(candy_lexer_t *self, candy_vector_t *vec);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
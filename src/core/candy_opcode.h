@@ -21,6 +21,10 @@
 #undef CANDY_OP
 #endif /* CANDY_OP */
 
+#ifdef CANDY_FUSE
+#undef CANDY_FUSE
+#endif /* CANDY_FUSE */
+
 #if defined(CANDY_OP_ENUM)
 #undef CANDY_OP_ENUM
 #define CANDY_OP(_opcode, ...) OP_##_opcode,
@@ -33,7 +37,31 @@
 }
 #endif /* CANDY_OP_CASE */
 
+#if defined(CANDY_OP_LABEL)
+#undef CANDY_OP_LABEL
+#define CANDY_OP(_opcode, ...) &&_op_##_opcode,
+#endif /* CANDY_OP_LABEL */
+
+#if defined(CANDY_OP_GOTO)
+#undef CANDY_OP_GOTO
+#define CANDY_OP(_opcode, ...) _op_##_opcode: { \
+  __VA_ARGS__ \
+}
+#endif /* CANDY_OP_GOTO */
+
 #ifdef CANDY_OP_STR
 #undef CANDY_OP_STR
 #define CANDY_OP(_opcode, ...) #_opcode,
 #endif /* CANDY_OP_STR */
+
+/* {first, second, superinstruction} of each fused pair */
+#ifdef CANDY_OP_FUSE
+#undef CANDY_OP_FUSE
+#define CANDY_OP(_opcode, ...)
+#define CANDY_FUSE(_opcode, _first, _second, ...) {OP_##_first, OP_##_second, OP_##_opcode},
+#endif /* CANDY_OP_FUSE */
+
+/* a superinstruction is an ordinary opcode in every other mode */
+#if defined(CANDY_OP) && !defined(CANDY_FUSE)
+#define CANDY_FUSE(_opcode, _first, _second, ...) CANDY_OP(_opcode, __VA_ARGS__)
+#endif
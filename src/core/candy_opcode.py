@@ -0,0 +1,93 @@
+import os
+import re
+import sys
+
+# usage: python3 candy_opcode.py <profile> [count]
+#
+# reads the 'first second count' lines dumped by candy_vm_profile of a
+# CANDY_PROFILE build and rewrites the superinstructions of candy_opcode.list
+# with the most frequent pairs, each one runs both bodies in one dispatch.
+# a pair may start with a quickened instruction, the vm fuses it when it
+# quickens the first one.
+
+begin = "/* superinstructions generated by candy_opcode.py, do not edit by hand */\n"
+end = "/* end of superinstructions */\n"
+
+# these leave the frame or always move the pc, nothing can follow them, a
+# loop only goes on at the next instruction once it is done
+barriers = ["JMP", "JLOOP", "FORPREP", "FORLOOP", "JFORLOOP", "IFORLOOP", "JMPTAB", "CALL", "TAILCALL", "RETURN"]
+
+path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "candy_opcode.list")
+
+def parse(text):
+  ops = {}
+  for name, body in re.findall(r"^CANDY_OP\((\w+),\n(.*?)\n\)$", text, re.M | re.S):
+    ops[name] = body.split("\n")
+  return ops
+
+def generic(ops, name):
+  # quickened forms count as the instruction the compiler emitted
+  for suffix in ["II", "FF"]:
+    if name.endswith(suffix) and name[:-len(suffix)] in ops:
+      return name[:-len(suffix)]
+  return name
+
+def skips(ops, name):
+  return any("vm_jump" in line for line in ops[name])
+
+def fusible(ops, first, second):
+  if first in barriers or first not in ops or second not in ops:
+    return False
+  # a conditional skip is always emitted in front of a jump
+  if skips(ops, first):
+    return second == "JMP"
+  return True
+
+def strip(body):
+  # the first one is quickened in place of the superinstruction, the
+  # opcode of the second one is only seen by a jump into it
+  return [line for line in body if not re.match(r"\s*(vm)?_quicken\(", line)]
+
+def fuse(ops, first, second):
+  head = ops[first]
+  assert head[-1].strip() == "vm_next();"
+  skip = skips(ops, first)
+  out = ["/* %s; %s */" % (first, second)]
+  out.append("CANDY_FUSE(%s_%s, %s, %s," % (first, second, first, second))
+  if skip:
+    out.append("  const candy_inst_t *second = pc;")
+  out.append("  {")
+  out += ["  " + line for line in head[:-1]]
+  out.append("  }")
+  if skip:
+    out.append("  if (pc != second)")
+    out.append("    vm_next();")
+  out.append("  ins = *pc++;")
+  out.append("  {")
+  out += ["  " + line for line in strip(ops[second])]
+  out.append("  }")
+  out.append(")")
+  return "\n".join(out) + "\n"
+
+text = open(path).read()
+ops = parse(text)
+count = int(sys.argv[2]) if len(sys.argv) > 2 else 6
+
+pairs = {}
+for line in open(sys.argv[1]):
+  first, second, num = line.split()
+  key = (first, generic(ops, second))
+  # whichever way a conditional skip goes, the static successor is its jump
+  if key[0] in ops and key[0] not in barriers and skips(ops, key[0]):
+    key = (key[0], "JMP")
+  pairs[key] = pairs.get(key, 0) + int(num)
+
+ranked = sorted([key for key in pairs if fusible(ops, *key)], key = lambda key : -pairs[key])
+
+for key in ranked[:count]:
+  print("%10s %-10s %d" % (key[0], key[1], pairs[key]))
+
+section = "\n".join([fuse(ops, *key) for key in ranked[:count]])
+head, rest = text.split(begin)
+rest = rest.split(end)[1]
+open(path, "w").write(head + begin + section + end + rest)
@@ -19,125 +19,1792 @@
 #include "core/candy_proto.h"
 #include "core/candy_closure.h"
 #include "core/candy_array.h"
+#include "core/candy_table.h"
 #include "core/candy_print.h"
 #include "core/candy_lexer.h"
+#include "core/candy_peephole.h"
+#include "core/candy_wrap.h"
+#include "core/candy_vm.h"
+#include "core/candy_vector.h"
+#include "core/candy_memory.h"
+#include "core/candy_lib.h"
+#include "core/candy_reader.h"
+#include <string.h>
 
 #define par_assert(_condition, _format, ...) \
 candy_assert(self->ls.ctx, self->ls.gc, _condition, EXCE_ERR_SYNTAX, _format, ##__VA_ARGS__)
 
+/* end of a jump list, see @ref _concat */
+#define NO_JUMP (-1)
+/* registers a frame can address through the 8-bit 'a' operand */
+#define MAX_REGS CANDY_INST_RK_MAX
+/* upvalues a closure can have, see @ref candy_upvaldesc */
+#define MAX_UPVALS 0xFF
+/* priority of the unary operators, higher than any binary one */
+#define UNARY_PRIORITY 8
+/* instructions of the largest function a call is replaced with */
+#define MAX_INLINE 12
+/* tests of an if chain on one local it takes to build a jump table */
+#define MIN_CASES 4
+/* cases a jump table can have, through the 9-bit 'b' operand */
+#define MAX_CASES 0x1FF
+/* caches a SETTABUP can name, through its 8-bit 'a' operand less the uncached zero */
+#define MAX_SETCACHES 0xFF
+
+typedef struct candy_vardesc candy_vardesc_t;
+typedef struct candy_blockcnt candy_blockcnt_t;
 typedef struct candy_funcstate candy_funcstate_t;
 typedef struct candy_parser candy_parser_t;
 typedef struct candy_expdesc candy_expdesc_t;
+typedef struct candy_inline candy_inline_t;
+
+typedef enum candy_expkind {
+  /* no value, like the results of a call statement */
+  EXP_VOID,
+  EXP_NONE,
+  EXP_TRUE,
+  EXP_FALSE,
+  /* numbers stay out of the constant pool until an operand needs them */
+  EXP_INTEGER,
+  EXP_FLOAT,
+  /* info is the index of a constant */
+  EXP_CONST,
+  /* info is the register of a local */
+  EXP_LOCAL,
+  /* info is the index of an upvalue */
+  EXP_UPVAL,
+  /* s is the name, it becomes a constant once it is accessed */
+  EXP_GLOBAL,
+  /* info is the register the value has been put in */
+  EXP_REG,
+  /* info is the instruction whose 'a' is still to be chosen */
+  EXP_RELOC,
+  /* info is the call instruction, the number of results is still open */
+  EXP_CALL,
+  /* info is the jump that follows a comparison, taken if it holds */
+  EXP_JMP,
+} candy_expkind_t;
+
+/* what the instruction producing a value guarantees about its type */
+typedef enum candy_exphint {
+  HINT_ANY,
+  HINT_NUMBER,
+  HINT_INTEGER,
+} candy_exphint_t;
+
+typedef enum candy_binopr {
+  /* same order as the arithmetic opcodes, see @ref _arith */
+  OPR_ADD, OPR_SUB, OPR_MUL, OPR_DIV, OPR_MOD,
+  OPR_BAND, OPR_BOR, OPR_BXOR, OPR_SHL, OPR_SHR,
+  OPR_EQ, OPR_NE, OPR_LT, OPR_LE, OPR_GT, OPR_GE,
+  OPR_NOBINOPR,
+} candy_binopr_t;
 
+typedef enum candy_unopr {
+  OPR_MINUS, OPR_PLUS, OPR_BNOT,
+  OPR_NOUNOPR,
+} candy_unopr_t;
+
+/**
+  * @brief  operand descriptor, where the value of an expression parsed so
+  *         far lives, nothing is emitted until its user decides where it goes
+  */
 struct candy_expdesc {
+  candy_expkind_t kind;
+  candy_exphint_t hint;
+  union {
+    uint32_t info;
+    candy_integer_t i;
+    candy_float_t f;
+    candy_array_t *s;
+  };
+};
+
+struct candy_vardesc {
+  /* NULL until the assignment declaring it is complete */
+  candy_array_t *name;
+  /* first instruction of the statement declaring it */
+  int startpc;
+  /* block it is declared in, see @ref candy_blockcnt */
+  uint32_t block;
+  /* read where its assignment may not have run, it keeps a slot of its own */
+  bool pinned;
+  /* read at all, see @ref _frame_closures */
+  bool read;
+  /* read other than to be called, its value may outlive the frame */
+  bool escapes;
+};
 
+/* a function of the chunk, bound to a global assigned nowhere else */
+struct candy_inline {
+  candy_array_t *name;
+  /* NULL once the global is assigned again or if it cannot be inlined */
+  candy_proto_t *proto;
+};
+
+/* the nesting of the blocks being compiled, each with a unique id */
+struct candy_blockcnt {
+  candy_blockcnt_t *prev;
+  uint32_t id;
 };
 
 struct candy_funcstate {
   candy_funcstate_t *prev;
   candy_proto_t *proto;
+  /**
+    * parameters and locals, each one is given the virtual register of its
+    * index, @ref _regalloc maps them onto the slots of the frame
+    */
+  candy_vardesc_t actvar[MAX_REGS];
+  uint32_t nactvar;
+  /* first register not taken by a local or a pending temporary */
+  uint32_t freereg;
+  /* most temporaries pending at once */
+  uint32_t maxtemp;
+  candy_blockcnt_t *bl;
+  uint32_t nblock;
+  /* names of the upvalues, in the order of their descriptors */
+  candy_array_t *upval[MAX_UPVALS];
+  uint32_t nupval;
+  /* where its constants start in the pool of the parser */
+  uint32_t firstk;
 };
 
 struct candy_parser {
   /* lexical state */
   candy_lexer_t ls;
   candy_funcstate_t *fs;
+  /* see @ref candy_peephole */
+  int level;
+  /* bodies of the functions of the chunk are skimmed, see @ref _skim */
+  bool lazy;
+  /* text of the body being skimmed */
+  candy_vector_t record;
+  /* constants of the functions being compiled, the innermost one at the end */
+  candy_vector_t cnst;
+  /**
+    * open addressing from the value of a constant to its index in 'cnst'
+    * plus one, what closed functions leave behind fails @ref _constant
+    */
+  uint32_t *kmap;
+  uint32_t sizekmap;
+  uint32_t nkmap;
+  /* the inline cache of each name in 'cnst' plus one, see @ref _cache */
+  candy_vector_t kcache;
+  /* the functions of the chunk by name, see @ref candy_inline */
+  candy_vector_t inlines;
+  /* the call emitted last and the function it may be replaced with */
+  int callpc;
+  candy_proto_t *callee;
+  /* the tests of the if chains being compiled, see @ref _jmptab */
+  candy_vector_t cases;
 };
 
-static void expr(candy_parser_t *self, candy_expdesc_t *e) {
-  while (1) {
-    switch (candy_lexer_lookahead(&self->ls)) {
-      case ')':
-        return;
-      case TK_STRING:
-      case TK_INTEGER:
-      case TK_FLOAT:
+/* left and right priority of each binary operator */
+static const struct {
+  uint8_t left;
+  uint8_t right;
+} _priority[] = {
+  {6, 6}, {6, 6}, {7, 7}, {7, 7}, {7, 7},
+  {4, 4}, {2, 2}, {3, 3}, {5, 5}, {5, 5},
+  {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1},
+};
+
+static void expr(candy_parser_t *self, candy_expdesc_t *e);
+static void _block(candy_parser_t *self);
+
+static candy_tokens_t _lookahead(candy_parser_t *self) {
+  return candy_lexer_lookahead(&self->ls);
+}
+
+static const candy_meta_t *_next(candy_parser_t *self) {
+  return candy_lexer_next(&self->ls);
+}
+
+static void _expect(candy_parser_t *self, candy_tokens_t token) {
+  par_assert(_lookahead(self) == token, "line %zu: '%s' expected near '%s'",
+    self->ls.dbg.line, candy_token_str(token), candy_token_str(_lookahead(self))
+  );
+  _next(self);
+}
+
+static void _init_exp(candy_expdesc_t *e, candy_expkind_t kind, uint32_t info) {
+  e->kind = kind;
+  e->hint = HINT_ANY;
+  e->info = info;
+}
+
+static candy_inst_t *_inst(candy_parser_t *self, int pc) {
+  return &candy_proto_get_inst(self->fs->proto)[pc];
+}
+
+static int _pc(candy_parser_t *self) {
+  return (int)candy_proto_get_size_inst(self->fs->proto);
+}
+
+static int _abc(candy_parser_t *self, candy_opcodes_t op, uint32_t a, uint32_t b, uint32_t c) {
+  return candy_proto_add_iabc(self->fs->proto, self->ls.gc, self->ls.ctx, op, a, b, c);
+}
+
+static int _abx(candy_parser_t *self, candy_opcodes_t op, uint32_t a, uint32_t b) {
+  return candy_proto_add_iabx(self->fs->proto, self->ls.gc, self->ls.ctx, op, a, b);
+}
+
+static bool _same_name(const candy_array_t *a, const candy_array_t *b) {
+  return a && candy_array_size(a) == candy_array_size(b) && memcmp(candy_array_data(a), candy_array_data(b), candy_array_size(a)) == 0;
+}
+
+static candy_array_t *_kstring(const candy_wrap_t *wrap) {
+  return (candy_array_t *)candy_wrap_get_object(wrap);
+}
+
+static uint32_t _khash(const candy_wrap_t *wrap) {
+  uint64_t bits = 0;
+  if (candy_wrap_is_string(wrap))
+    return djb_hash(candy_array_data(_kstring(wrap)), candy_array_size(_kstring(wrap)));
+  switch (candy_wrap_get_type(wrap)) {
+    case CANDY_TYPE_INTEGER: {
+      candy_integer_t i = candy_wrap_get_integer(wrap);
+      memcpy(&bits, &i, sizeof(i));
+      break;
+    }
+    case CANDY_TYPE_FLOAT: {
+      candy_float_t f = candy_wrap_get_float(wrap);
+      memcpy(&bits, &f, sizeof(f));
+      break;
+    }
+    case CANDY_TYPE_BOOLEAN:
+      bits = candy_wrap_get_boolean(wrap);
+      break;
+    default:
+      break;
+  }
+  bits = (bits ^ candy_wrap_get_type(wrap)) * 0x9E3779B97F4A7C15ULL;
+  return (uint32_t)(bits >> 32);
+}
+
+/* the same constant, '1' is not '1.0' and '0.0' is not '-0.0' */
+static bool _ksame(const candy_wrap_t *a, const candy_wrap_t *b) {
+  if (candy_wrap_get_type(a) != candy_wrap_get_type(b) || candy_wrap_is_string(a) != candy_wrap_is_string(b))
+    return false;
+  if (candy_wrap_is_string(a))
+    return _same_name(_kstring(a), _kstring(b));
+  switch (candy_wrap_get_type(a)) {
+    case CANDY_TYPE_INTEGER:
+      return candy_wrap_get_integer(a) == candy_wrap_get_integer(b);
+    case CANDY_TYPE_FLOAT: {
+      candy_float_t fa = candy_wrap_get_float(a), fb = candy_wrap_get_float(b);
+      return memcmp(&fa, &fb, sizeof(candy_float_t)) == 0;
+    }
+    case CANDY_TYPE_BOOLEAN:
+      return candy_wrap_get_boolean(a) == candy_wrap_get_boolean(b);
+    default:
+      return true;
+  }
+}
+
+static void _kmap_insert(candy_parser_t *self, uint32_t hash, uint32_t idx) {
+  uint32_t mask = self->sizekmap - 1;
+  uint32_t pos = hash & mask;
+  for (; self->kmap[pos]; pos = (pos + 1) & mask);
+  self->kmap[pos] = idx + 1;
+  ++self->nkmap;
+}
+
+/* twice as large, without the entries of the functions already closed */
+static void _kmap_grow(candy_parser_t *self) {
+  candy_memory_t *mem = candy_gc_memory(self->ls.gc);
+  const candy_wrap_t *k = (const candy_wrap_t *)candy_vector_data(&self->cnst);
+  uint32_t size = (uint32_t)candy_vector_size(&self->cnst);
+  uint32_t *prev = self->kmap, prevsize = self->sizekmap;
+  self->sizekmap = prevsize ? prevsize * 2 : 64;
+  self->kmap = (uint32_t *)candy_memory_alloc(mem, self->ls.ctx, self->sizekmap * sizeof(uint32_t));
+  memset(self->kmap, 0, self->sizekmap * sizeof(uint32_t));
+  self->nkmap = 0;
+  for (uint32_t pos = 0; pos < prevsize; ++pos)
+    if (prev[pos] && prev[pos] - 1 < size)
+      _kmap_insert(self, _khash(&k[prev[pos] - 1]), prev[pos] - 1);
+  candy_memory_free(mem, prev, prevsize * sizeof(uint32_t));
+}
+
+/**
+  * @brief  the index of a constant of the function being compiled, equal
+  *         values share one slot
+  */
+static uint32_t _constant(candy_parser_t *self, const candy_wrap_t *wrap) {
+  candy_funcstate_t *fs = self->fs;
+  uint32_t hash = _khash(wrap);
+  uint32_t size = (uint32_t)candy_vector_size(&self->cnst);
+  if (self->sizekmap) {
+    const candy_wrap_t *k = (const candy_wrap_t *)candy_vector_data(&self->cnst);
+    uint32_t mask = self->sizekmap - 1;
+    for (uint32_t pos = hash & mask; self->kmap[pos]; pos = (pos + 1) & mask) {
+      uint32_t idx = self->kmap[pos] - 1;
+      if (idx >= fs->firstk && idx < size && _ksame(&k[idx], wrap))
+        return idx - fs->firstk;
+    }
+  }
+  if (self->nkmap * 2 >= self->sizekmap)
+    _kmap_grow(self);
+  if (size == candy_vector_capacity(&self->cnst))
+    candy_vector_reserve(&self->cnst, candy_gc_memory(self->ls.gc), self->ls.ctx, size ? size * 2 : 16);
+  candy_vector_append(&self->cnst, candy_gc_memory(self->ls.gc), self->ls.ctx, wrap, 1);
+  _kmap_insert(self, hash, size);
+  return size - fs->firstk;
+}
+
+static uint32_t _string(candy_parser_t *self, candy_array_t *str) {
+  candy_wrap_t wrap;
+  candy_wrap_set_object(&wrap, (candy_object_t *)str);
+  return _constant(self, &wrap);
+}
+
+/* the inline cache of the global named by constant 'k', every read of a name shares one */
+static uint32_t _cache(candy_parser_t *self, uint32_t k) {
+  candy_funcstate_t *fs = self->fs;
+  size_t idx = fs->firstk + k;
+  if (idx >= candy_vector_size(&self->kcache))
+    candy_vector_resize(&self->kcache, candy_gc_memory(self->ls.gc), self->ls.ctx, candy_vector_size(&self->cnst));
+  uint32_t *cache = (uint32_t *)candy_vector_data(&self->kcache) + idx;
+  if (*cache == 0)
+    *cache = (uint32_t)candy_proto_add_cache(fs->proto, self->ls.gc, self->ls.ctx) + 1;
+  return *cache - 1;
+}
+
+/* the 'a' operand of a SETTABUP of the global named by constant 'k', zero if it has no cache */
+static uint32_t _setcache(candy_parser_t *self, uint32_t k) {
+  uint32_t cache = _cache(self, k);
+  return cache < MAX_SETCACHES ? cache + 1 : 0;
+}
+
+/* the constant a literal descriptor stands for */
+static uint32_t _exp2k(candy_parser_t *self, candy_expdesc_t *e) {
+  candy_wrap_t wrap;
+  switch (e->kind) {
+    case EXP_NONE:    candy_wrap_set_none(&wrap);              break;
+    case EXP_TRUE:    candy_wrap_set_boolean(&wrap, true);     break;
+    case EXP_FALSE:   candy_wrap_set_boolean(&wrap, false);    break;
+    case EXP_INTEGER: candy_wrap_set_integer(&wrap, e->i);     break;
+    case EXP_FLOAT:   candy_wrap_set_float(&wrap, e->f);       break;
+    default:          return e->info;
+  }
+  return _constant(self, &wrap);
+}
+
+/**
+  * @brief  jumps waiting for the same target are chained through their sBx,
+  *         each one holds the offset to the next one until it is patched
+  */
+static int _get_jump(candy_parser_t *self, int pc) {
+  int32_t offset = candy_inst_get_sbx(*_inst(self, pc));
+  return offset == NO_JUMP ? NO_JUMP : pc + 1 + offset;
+}
+
+static void _fix_jump(candy_parser_t *self, int pc, int target) {
+  int32_t offset = target - (pc + 1);
+  par_assert(offset >= -CANDY_INST_SBX_BIAS && offset <= CANDY_INST_SBX_BIAS, "control structure too long");
+  _inst(self, pc)->iabx.b = (uint32_t)(offset + CANDY_INST_SBX_BIAS);
+}
+
+static int _jump(candy_parser_t *self) {
+  return candy_proto_add_iasbx(self->fs->proto, self->ls.gc, self->ls.ctx, OP_JMP, 0, NO_JUMP);
+}
+
+static void _concat(candy_parser_t *self, int *list, int jmp) {
+  if (jmp == NO_JUMP)
+    return;
+  if (*list == NO_JUMP) {
+    *list = jmp;
+    return;
+  }
+  int pc = *list;
+  for (int next; (next = _get_jump(self, pc)) != NO_JUMP; pc = next);
+  _fix_jump(self, pc, jmp);
+}
+
+static void _patch(candy_parser_t *self, int list, int target) {
+  while (list != NO_JUMP) {
+    int next = _get_jump(self, list);
+    _fix_jump(self, list, target);
+    list = next;
+  }
+}
+
+static void _patch_here(candy_parser_t *self, int list) {
+  _patch(self, list, _pc(self));
+}
+
+static uint32_t _reserve(candy_parser_t *self, uint32_t n) {
+  candy_funcstate_t *fs = self->fs;
+  uint32_t reg = fs->freereg;
+  fs->freereg += n;
+  par_assert(fs->freereg <= MAX_REGS, "function or expression needs too many registers");
+  if (fs->freereg - fs->nactvar > fs->maxtemp)
+    fs->maxtemp = fs->freereg - fs->nactvar;
+  return reg;
+}
+
+/* temporaries are freed in the reverse order of their reservation */
+static void _free_reg(candy_parser_t *self, uint32_t reg) {
+  if (!candy_inst_is_k(reg) && reg >= self->fs->nactvar) {
+    --self->fs->freereg;
+    par_assert(reg == self->fs->freereg, "register %u freed out of order", reg);
+  }
+}
+
+static void _free_exp(candy_parser_t *self, candy_expdesc_t *e) {
+  if (e->kind == EXP_REG)
+    _free_reg(self, e->info);
+}
+
+static void _free_exps(candy_parser_t *self, candy_expdesc_t *e1, candy_expdesc_t *e2) {
+  uint32_t r1 = e1->kind == EXP_REG ? e1->info : 0;
+  uint32_t r2 = e2->kind == EXP_REG ? e2->info : 0;
+  if (r1 > r2) {
+    _free_exp(self, e1);
+    _free_exp(self, e2);
+  }
+  else {
+    _free_exp(self, e2);
+    _free_exp(self, e1);
+  }
+}
+
+static candy_inline_t *_search_inline(candy_parser_t *self, const candy_array_t *name) {
+  candy_inline_t *inl = (candy_inline_t *)candy_vector_data(&self->inlines);
+  for (size_t idx = 0; idx < candy_vector_size(&self->inlines); ++idx)
+    if (_same_name(inl[idx].name, name))
+      return &inl[idx];
+  return NULL;
+}
+
+/**
+  * @brief  whether a call of 'proto' can be replaced with its body, a
+  *         small leaf that only jumps forward and returns exactly one value
+  */
+static bool _inlinable(const candy_proto_t *proto) {
+  const candy_inst_t *inst = candy_proto_get_inst(proto);
+  size_t size = candy_proto_get_size_inst(proto);
+  if (candy_proto_get_source(proto) || size > MAX_INLINE)
+    return false;
+  for (size_t pc = 0; pc < size; ++pc) {
+    switch (candy_peephole_first((candy_opcodes_t)inst[pc].op)) {
+      case OP_MOVE: case OP_LOADK: case OP_LOADNONE:
+      case OP_UNM: case OP_BNOT: case OP_NOT:
+        break;
+      /* a key loaded into a register names no cache of the caller */
+      case OP_GETTABUP:
+        if (!candy_inst_is_k(inst[pc].iabc.c))
+          return false;
+        break;
+      case OP_SETTABUP:
+        if (!candy_inst_is_k(inst[pc].iabc.b))
+          return false;
+        break;
+      case OP_LOADBOOL: case OP_EQ: case OP_LT: case OP_LE: case OP_TEST:
+        /* what it skips has to stay one instruction */
+        if (pc + 1 < size && inst[pc + 1].op == OP_RETURN)
+          return false;
+        break;
+      case OP_JMP:
+        if (candy_inst_get_sbx(inst[pc]) < 0)
+          return false;
+        break;
+      case OP_RETURN:
+        if (inst[pc].iabc.b != 2)
+          return false;
         break;
       default:
-        par_assert(false, "unknown token %d", candy_lexer_lookahead(&self->ls));
+        if (inst[pc].op < OP_ADD || inst[pc].op > OP_SHR)
+          return false;
         break;
     }
   }
+  return true;
 }
 
-/* lambda '(' expr ')' */
-static void expr_lambda(candy_parser_t *self) {
-  candy_expdesc_t e;
-  // candy_proto_t *b = NULL;
+/* the constants of 'proto' in the pool of the caller, false if one does not fit */
+static bool _inline_cnst(candy_parser_t *self, const candy_proto_t *proto, uint32_t k[]) {
+  const candy_wrap_t *cnst = candy_proto_get_cnst(proto);
+  for (size_t idx = 0; idx < candy_proto_get_size_cnst(proto); ++idx)
+    if ((k[idx] = _constant(self, &cnst[idx])) > CANDY_INST_RK_MAX)
+      return false;
+  return true;
+}
+
+static uint32_t _inline_rk(uint32_t rk, uint32_t base, const uint32_t k[]) {
+  return candy_inst_is_k(rk) ? candy_inst_rk(k[candy_inst_get_k(rk)]) : rk + base;
+}
+
+/**
+  * @brief  replace the call at 'pc', the last instruction, with the body
+  *         of the callee renamed onto the registers above the function,
+  *         as long as the global still holds a closure of the callee:
+  *         'TESTPROTO F P; JMP call; body; JMP done; call: CALL F'
+  * @retval where the call has moved to, 'pc' if it stays
+  */
+static int _inline(candy_parser_t *self, int pc) {
+  candy_funcstate_t *fs = self->fs;
+  const candy_proto_t *proto = self->callee;
+  const candy_inst_t *inst = candy_proto_get_inst(proto);
+  int size = (int)candy_proto_get_size_inst(proto);
+  candy_inst_t call = *_inst(self, pc);
+  uint32_t func = call.iabc.a, base = func + 1;
+  uint32_t nregs = candy_proto_get_maxstack(proto);
+  uint32_t k[MAX_INLINE * 2];
+  int pos[MAX_INLINE + 1], done = NO_JUMP;
+  self->callee = NULL;
+  if (candy_proto_get_size_cnst(proto) > sizeof(k) / sizeof(k[0]) || base + nregs > MAX_REGS || !_inline_cnst(self, proto, k))
+    return pc;
+  /* a return moves the value down and jumps over the call */
+  pos[0] = 0;
+  for (int idx = 0; idx < size; ++idx)
+    pos[idx + 1] = pos[idx] + (inst[idx].op == OP_RETURN ? 2 : 1);
+  size_t child = 0;
+  for (; child < candy_proto_get_size_proto(fs->proto) && candy_proto_get_proto(fs->proto, child) != proto; ++child);
+  if (child == candy_proto_get_size_proto(fs->proto))
+    candy_proto_add_proto(fs->proto, self->ls.gc, self->ls.ctx, (candy_proto_t *)proto);
+  candy_proto_set_size_inst(fs->proto, (size_t)pc);
+  _reserve(self, nregs);
+  _abx(self, OP_TESTPROTO, func, (uint32_t)child);
+  int slow = _jump(self);
+  for (int idx = 0; idx < size; ++idx) {
+    candy_inst_t ins = inst[idx];
+    ins.op = candy_peephole_first((candy_opcodes_t)ins.op);
+    switch (ins.op) {
+      case OP_RETURN:
+        _abc(self, OP_MOVE, func, base + ins.iabc.a, 0);
+        _concat(self, &done, _jump(self));
+        continue;
+      case OP_JMP:
+        candy_proto_add_iasbx(fs->proto, self->ls.gc, self->ls.ctx, OP_JMP, ins.iabx.a, pos[idx + 1 + candy_inst_get_sbx(ins)] - pos[idx] - 1);
+        continue;
+      case OP_LOADK:
+        ins.iabx.a += base;
+        ins.iabx.b = k[ins.iabx.b];
+        candy_proto_add_inst(fs->proto, self->ls.gc, self->ls.ctx, ins);
+        continue;
+      /* the keys are constants, see @ref _inlinable */
+      case OP_GETTABUP:
+        ins.iabc.b = _cache(self, k[candy_inst_get_k(ins.iabc.c)]);
+        break;
+      case OP_SETTABUP:
+        ins.iabc.a = _setcache(self, k[candy_inst_get_k(ins.iabc.b)]);
+        break;
+      default:
+        break;
+    }
+    int mode = candy_peephole_operands(ins);
+    if (mode & CANDY_REG_A)
+      ins.iabc.a += base;
+    if (mode & CANDY_REG_B)
+      ins.iabc.b = _inline_rk(ins.iabc.b, base, k);
+    if (mode & CANDY_REG_C)
+      ins.iabc.c = _inline_rk(ins.iabc.c, base, k);
+    candy_proto_add_inst(fs->proto, self->ls.gc, self->ls.ctx, ins);
+  }
+  _patch_here(self, slow);
+  pc = _abc(self, OP_CALL, func, call.iabc.b, call.iabc.c);
+  _patch_here(self, done);
+  fs->freereg = base;
+  return pc;
+}
+
+/* a call returning at most one value may be replaced with the body of its callee */
+static void _setreturns(candy_parser_t *self, candy_expdesc_t *e, int nresults) {
+  if (self->callee && nresults >= 0 && self->callpc == (int)e->info && _pc(self) == self->callpc + 1)
+    e->info = (uint32_t)_inline(self, (int)e->info);
+  _inst(self, e->info)->iabc.c = (uint32_t)(nresults + 1);
+}
+
+/* load a global and keep only the first result of a call */
+static void _discharge_vars(candy_parser_t *self, candy_expdesc_t *e) {
+  switch (e->kind) {
+    case EXP_LOCAL:
+      e->kind = EXP_REG;
+      break;
+    case EXP_UPVAL:
+      _init_exp(e, EXP_RELOC, (uint32_t)_abc(self, OP_GETUPVAL, 0, e->info, 0));
+      break;
+    case EXP_GLOBAL: {
+      uint32_t k = _string(self, e->s);
+      uint32_t cache = _cache(self, k);
+      if (k <= CANDY_INST_RK_MAX) {
+        _init_exp(e, EXP_RELOC, (uint32_t)_abc(self, OP_GETTABUP, 0, cache, candy_inst_rk(k)));
+        break;
+      }
+      /* the key does not fit into an rk operand */
+      uint32_t reg = _reserve(self, 1);
+      _abx(self, OP_LOADK, reg, k);
+      _abc(self, OP_GETTABUP, reg, cache, reg);
+      _init_exp(e, EXP_REG, reg);
+      break;
+    }
+    case EXP_CALL:
+      _setreturns(self, e, 1);
+      _init_exp(e, EXP_REG, _inst(self, e->info)->iabc.a);
+      break;
+    default:
+      break;
+  }
+}
+
+static void _discharge2reg(candy_parser_t *self, candy_expdesc_t *e, uint32_t reg) {
+  _discharge_vars(self, e);
+  switch (e->kind) {
+    case EXP_NONE:
+      _abc(self, OP_LOADNONE, reg, 0, 0);
+      break;
+    case EXP_TRUE:
+    case EXP_FALSE:
+      _abc(self, OP_LOADBOOL, reg, e->kind == EXP_TRUE, 0);
+      break;
+    case EXP_INTEGER:
+    case EXP_FLOAT:
+    case EXP_CONST:
+      _abx(self, OP_LOADK, reg, _exp2k(self, e));
+      break;
+    case EXP_RELOC:
+      _inst(self, e->info)->iabc.a = reg;
+      break;
+    case EXP_REG:
+      if (e->info != reg)
+        _abc(self, OP_MOVE, reg, e->info, 0);
+      break;
+    default:
+      par_assert(false, "expression has no value");
+  }
+  /* still the same value, the hint holds */
+  e->kind = EXP_REG;
+  e->info = reg;
+}
+
+static void _exp2reg(candy_parser_t *self, candy_expdesc_t *e, uint32_t reg) {
+  if (e->kind != EXP_JMP) {
+    _discharge2reg(self, e, reg);
+    return;
+  }
+  /* the comparison jumps over the false one if it holds */
+  _abc(self, OP_LOADBOOL, reg, false, 1);
+  _patch(self, (int)e->info, _abc(self, OP_LOADBOOL, reg, true, 0));
+  _init_exp(e, EXP_REG, reg);
+}
+
+static void _exp2nextreg(candy_parser_t *self, candy_expdesc_t *e) {
+  _discharge_vars(self, e);
+  _free_exp(self, e);
+  _exp2reg(self, e, _reserve(self, 1));
+}
+
+static uint32_t _exp2anyreg(candy_parser_t *self, candy_expdesc_t *e) {
+  _discharge_vars(self, e);
+  if (e->kind != EXP_REG)
+    _exp2nextreg(self, e);
+  return e->info;
+}
+
+/* an operand that is either a register or a constant */
+static uint32_t _exp2rk(candy_parser_t *self, candy_expdesc_t *e) {
+  switch (e->kind) {
+    case EXP_NONE:
+    case EXP_TRUE:
+    case EXP_FALSE:
+    case EXP_INTEGER:
+    case EXP_FLOAT:
+    case EXP_CONST: {
+      e->info = _exp2k(self, e);
+      e->kind = EXP_CONST;
+      uint32_t k = e->info;
+      if (k <= CANDY_INST_RK_MAX)
+        return candy_inst_rk(k);
+      break;
+    }
+    default:
+      break;
+  }
+  return _exp2anyreg(self, e);
+}
+
+/**
+  * @brief  the jump taken if the condition is false, comparisons are turned
+  *         around and any other value is tested for truth
+  */
+static int _cond(candy_parser_t *self, candy_expdesc_t *e) {
+  switch (e->kind) {
+    case EXP_JMP:
+      _inst(self, (int)e->info - 1)->iabc.a ^= 1;
+      return (int)e->info;
+    case EXP_TRUE:
+    case EXP_INTEGER:
+    case EXP_FLOAT:
+      return NO_JUMP;
+    case EXP_NONE:
+    case EXP_FALSE:
+      return _jump(self);
+    default: {
+      uint32_t reg = _exp2anyreg(self, e);
+      _free_exp(self, e);
+      _abc(self, OP_TEST, reg, 0, 0);
+      return _jump(self);
+    }
+  }
+}
+
+static bool _numeral(const candy_expdesc_t *e) {
+  return e->kind == EXP_INTEGER || e->kind == EXP_FLOAT;
+}
+
+static bool _is_integer(const candy_expdesc_t *e, candy_integer_t val) {
+  return e->kind == EXP_INTEGER && e->i == val;
+}
+
+/**
+  * @brief  evaluate an operator on two numeric literals at compile time,
+  *         with the semantics of the interpreter
+  * @retval false if it is left to run time, 'e1' is then untouched
+  */
+static bool _fold(candy_opcodes_t op, candy_expdesc_t *e1, const candy_expdesc_t *e2) {
+  candy_wrap_t l, r, res;
+  if (!_numeral(e1) || !_numeral(e2))
+    return false;
+  e1->kind == EXP_INTEGER ? candy_wrap_set_integer(&l, e1->i) : candy_wrap_set_float(&l, e1->f);
+  e2->kind == EXP_INTEGER ? candy_wrap_set_integer(&r, e2->i) : candy_wrap_set_float(&r, e2->f);
+  if (!candy_vm_fold(op, &res, &l, &r))
+    return false;
+  switch (candy_wrap_get_type(&res)) {
+    case CANDY_TYPE_INTEGER:
+      e1->kind = EXP_INTEGER;
+      e1->hint = HINT_INTEGER;
+      e1->i = candy_wrap_get_integer(&res);
+      break;
+    case CANDY_TYPE_FLOAT:
+      e1->kind = EXP_FLOAT;
+      e1->hint = HINT_NUMBER;
+      e1->f = candy_wrap_get_float(&res);
+      break;
+    default:
+      _init_exp(e1, candy_wrap_get_boolean(&res) ? EXP_TRUE : EXP_FALSE, 0);
+      break;
+  }
+  return true;
+}
+
+/**
+  * @brief  the operand left by an identity like 'x * 1', only taken if the
+  *         hint of 'x' proves the instruction could neither raise nor
+  *         change the type or sign of zero
+  */
+static candy_expdesc_t *_identity(candy_binopr_t op, candy_expdesc_t *e1, candy_expdesc_t *e2) {
+  switch (op) {
+    case OPR_MUL:
+      if (_is_integer(e2, 1) && e1->hint >= HINT_NUMBER)
+        return e1;
+      if (_is_integer(e1, 1) && e2->hint >= HINT_NUMBER)
+        return e2;
+      return NULL;
+    case OPR_SUB:
+      return _is_integer(e2, 0) && e1->hint >= HINT_NUMBER ? e1 : NULL;
+    /* '-0.0 + 0' is '0.0' */
+    case OPR_ADD:
+    case OPR_BOR:
+    case OPR_BXOR:
+      if (_is_integer(e2, 0) && e1->hint == HINT_INTEGER)
+        return e1;
+      if (_is_integer(e1, 0) && e2->hint == HINT_INTEGER)
+        return e2;
+      return NULL;
+    case OPR_SHL:
+    case OPR_SHR:
+      return _is_integer(e2, 0) && e1->hint == HINT_INTEGER ? e1 : NULL;
+    case OPR_BAND:
+      if (_is_integer(e2, -1) && e1->hint == HINT_INTEGER)
+        return e1;
+      if (_is_integer(e1, -1) && e2->hint == HINT_INTEGER)
+        return e2;
+      return NULL;
+    default:
+      return NULL;
+  }
+}
+
+/* bitwise results are integers, the others numbers unless 'add' joins strings */
+static candy_exphint_t _arith_hint(candy_binopr_t op, const candy_expdesc_t *e1, const candy_expdesc_t *e2) {
+  switch (op) {
+    case OPR_BAND:
+    case OPR_BOR:
+    case OPR_BXOR:
+    case OPR_SHL:
+    case OPR_SHR:
+      return HINT_INTEGER;
+    case OPR_DIV:
+      return HINT_NUMBER;
+    case OPR_ADD:
+      if (e1->hint == HINT_ANY || e2->hint == HINT_ANY)
+        return HINT_ANY;
+      /* fall through */
+    default:
+      return e1->hint == HINT_INTEGER && e2->hint == HINT_INTEGER ? HINT_INTEGER : HINT_NUMBER;
+  }
+}
+
+static void _arith(candy_parser_t *self, candy_binopr_t op, candy_expdesc_t *e1, candy_expdesc_t *e2) {
+  if (_fold((candy_opcodes_t)(OP_ADD + op), e1, e2))
+    return;
+  candy_expdesc_t *same = _identity(op, e1, e2);
+  if (same) {
+    *e1 = *same;
+    return;
+  }
+  candy_exphint_t hint = _arith_hint(op, e1, e2);
+  uint32_t rk2 = _exp2rk(self, e2);
+  uint32_t rk1 = _exp2rk(self, e1);
+  _free_exps(self, e1, e2);
+  _init_exp(e1, EXP_RELOC, (uint32_t)_abc(self, (candy_opcodes_t)(OP_ADD + op), 0, rk1, rk2));
+  e1->hint = hint;
+}
+
+/* 'a > b' is 'b < a' and 'a != b' is 'a == b' expected to fail */
+static void _compare(candy_parser_t *self, candy_binopr_t op, candy_expdesc_t *e1, candy_expdesc_t *e2) {
+  bool swap = op == OPR_GT || op == OPR_GE;
+  candy_opcodes_t code = op == OPR_EQ || op == OPR_NE ? OP_EQ : op == OPR_LT || op == OPR_GT ? OP_LT : OP_LE;
+  candy_expdesc_t *l = swap ? e2 : e1, *r = swap ? e1 : e2;
+  if (_fold(code, l, r)) {
+    *e1 = *l;
+    if (op == OPR_NE)
+      e1->kind = e1->kind == EXP_TRUE ? EXP_FALSE : EXP_TRUE;
+    return;
+  }
+  uint32_t rk1 = _exp2rk(self, e1);
+  uint32_t rk2 = _exp2rk(self, e2);
+  _free_exps(self, e1, e2);
+  _abc(self, code, op != OPR_NE, swap ? rk2 : rk1, swap ? rk1 : rk2);
+  _init_exp(e1, EXP_JMP, (uint32_t)_jump(self));
+}
+
+static void _prefix(candy_parser_t *self, candy_unopr_t op, candy_expdesc_t *e) {
+  candy_opcodes_t code = op == OPR_MINUS ? OP_UNM : OP_BNOT;
+  if (op == OPR_PLUS || _fold(code, e, e))
+    return;
+  candy_exphint_t hint = op == OPR_BNOT ? HINT_INTEGER : e->hint == HINT_INTEGER ? HINT_INTEGER : HINT_NUMBER;
+  uint32_t reg = _exp2anyreg(self, e);
+  _free_exp(self, e);
+  _init_exp(e, EXP_RELOC, (uint32_t)_abc(self, code, 0, reg, 0));
+  e->hint = hint;
+}
+
+/* the left operand is settled before the right one emits anything */
+static void _infix(candy_parser_t *self, candy_binopr_t op, candy_expdesc_t *e) {
+  if (e->kind != EXP_INTEGER && e->kind != EXP_FLOAT)
+    _exp2rk(self, e);
+}
+
+static void _postfix(candy_parser_t *self, candy_binopr_t op, candy_expdesc_t *e1, candy_expdesc_t *e2) {
+  if (op <= OPR_SHR)
+    _arith(self, op, e1, e2);
+  else
+    _compare(self, op, e1, e2);
+}
+
+static candy_binopr_t _binopr(candy_tokens_t token) {
+  switch (token) {
+    case TK_PLUS:    return OPR_ADD;
+    case TK_MINUS:   return OPR_SUB;
+    case TK_ASTE:    return OPR_MUL;
+    case TK_SLASH:   return OPR_DIV;
+    case TK_PERCENT: return OPR_MOD;
+    case TK_AMPER:   return OPR_BAND;
+    case TK_VERT:    return OPR_BOR;
+    case TK_CARET:   return OPR_BXOR;
+    case TK_LSHIFT:  return OPR_SHL;
+    case TK_RSHIFT:  return OPR_SHR;
+    case TK_EQUAL:   return OPR_EQ;
+    case TK_NEQUAL:  return OPR_NE;
+    case TK_LESS:    return OPR_LT;
+    case TK_LEQUAL:  return OPR_LE;
+    case TK_GREATER: return OPR_GT;
+    case TK_GEQUAL:  return OPR_GE;
+    default:         return OPR_NOBINOPR;
+  }
+}
+
+/* the operator of a compound assignment like '+=' */
+static candy_binopr_t _assignopr(candy_tokens_t token) {
+  switch (token) {
+    case TK_ADDASS: return OPR_ADD;
+    case TK_SUBASS: return OPR_SUB;
+    case TK_MULASS: return OPR_MUL;
+    case TK_DIVASS: return OPR_DIV;
+    case TK_MODASS: return OPR_MOD;
+    case TK_AMPASS: return OPR_BAND;
+    case TK_VERASS: return OPR_BOR;
+    case TK_CARASS: return OPR_BXOR;
+    default:        return OPR_NOBINOPR;
+  }
+}
+
+static candy_unopr_t _unopr(candy_tokens_t token) {
+  switch (token) {
+    case TK_MINUS: return OPR_MINUS;
+    case TK_PLUS:  return OPR_PLUS;
+    case TK_TILDE: return OPR_BNOT;
+    default:       return OPR_NOUNOPR;
+  }
+}
+
+static bool _block_follow(candy_parser_t *self) {
+  switch (_lookahead(self)) {
+    case TK_EOS:
+    case TK_end:
+    case TK_elif:
+    case TK_else:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool _in_block(const candy_funcstate_t *fs, uint32_t block) {
+  for (const candy_blockcnt_t *bl = fs->bl; bl; bl = bl->prev)
+    if (bl->id == block)
+      return true;
+  return false;
+}
+
+static int _search_var(const candy_funcstate_t *fs, const candy_array_t *name) {
+  for (uint32_t idx = fs->nactvar; idx-- > 0;)
+    if (_same_name(fs->actvar[idx].name, name))
+      return (int)idx;
+  return -1;
+}
+
+static int _search_upval(const candy_funcstate_t *fs, const candy_array_t *name) {
+  for (uint32_t idx = 0; idx < fs->nupval; ++idx)
+    if (_same_name(fs->upval[idx], name))
+      return (int)idx;
+  return -1;
+}
+
+/* 'e' is a local or an upvalue of the function enclosing 'fs' */
+static uint32_t _new_upval(candy_parser_t *self, candy_funcstate_t *fs, candy_array_t *name, const candy_expdesc_t *e) {
+  par_assert(fs->nupval < MAX_UPVALS, "too many upvalues");
+  candy_proto_add_upval(fs->proto, self->ls.gc, self->ls.ctx, e->kind == EXP_LOCAL, (uint8_t)e->info);
+  fs->upval[fs->nupval] = name;
+  return fs->nupval++;
+}
+
+/**
+  * @brief  resolve 'name' from 'fs' outwards, a local of an enclosing
+  *         function becomes an upvalue of every function in between
+  */
+static void _singlevaraux(candy_parser_t *self, candy_funcstate_t *fs, candy_array_t *name, candy_expdesc_t *e, bool base) {
+  int idx = _search_var(fs, name);
+  if (idx >= 0) {
+    candy_vardesc_t *var = &fs->actvar[idx];
+    /* captured, or read like 'x' after 'if c x = 1 end' */
+    if (!base || !_in_block(fs, var->block))
+      var->pinned = true;
+    if (!base)
+      var->read = var->escapes = true;
+    _init_exp(e, EXP_LOCAL, (uint32_t)idx);
+    return;
+  }
+  idx = _search_upval(fs, name);
+  if (idx < 0) {
+    /* the chunk has no locals, what it cannot resolve is a global */
+    if (fs->prev == NULL) {
+      e->kind = EXP_GLOBAL;
+      e->hint = HINT_ANY;
+      e->s = name;
+      return;
+    }
+    _singlevaraux(self, fs->prev, name, e, false);
+    if (e->kind == EXP_GLOBAL)
+      return;
+    idx = (int)_new_upval(self, fs, name, e);
+  }
+  _init_exp(e, EXP_UPVAL, (uint32_t)idx);
+}
+
+/* a local of the function being compiled, an upvalue or else a global */
+static void _singlevar(candy_parser_t *self, candy_expdesc_t *e, candy_array_t *name) {
+  _singlevaraux(self, self->fs, name, e, true);
+}
+
+/* reserve the register of a local, its name is not visible yet */
+static uint32_t _new_local(candy_parser_t *self, candy_array_t *name) {
+  candy_funcstate_t *fs = self->fs;
+  par_assert(fs->nactvar < MAX_REGS, "too many local variables");
+  fs->actvar[fs->nactvar] = (candy_vardesc_t) {
+    .name = NULL,
+    .startpc = _pc(self),
+    .block = fs->bl->id,
+    .pinned = false,
+    .read = false,
+    .escapes = false,
+  };
+  ++fs->nactvar;
+  return _reserve(self, 1);
+}
+
+static candy_array_t *_name(candy_parser_t *self) {
+  par_assert(_lookahead(self) == TK_IDENT, "line %zu: name expected near '%s'", self->ls.dbg.line, candy_token_str(_lookahead(self)));
+  return _next(self)->s;
+}
+
+/* the register operands of 'inst', MAX_REGS for the others */
+static void _registers(candy_inst_t inst, uint32_t reg[3]) {
+  int mode = candy_peephole_operands(inst);
+  reg[0] = mode & CANDY_REG_A ? inst.iabc.a : MAX_REGS;
+  reg[1] = mode & CANDY_REG_B && !candy_inst_is_k(inst.iabc.b) ? inst.iabc.b : MAX_REGS;
+  reg[2] = mode & CANDY_REG_C && !candy_inst_is_k(inst.iabc.c) ? inst.iabc.c : MAX_REGS;
+}
+
+/**
+  * @brief  linear scan over the live intervals of the locals, in the order
+  *         they start each one takes the lowest slot whose previous holder is
+  *         dead by then and the temporaries of a statement are moved right
+  *         above the highest slot, so the frame is no larger than needed.
+  */
+static void _regalloc(candy_parser_t *self) {
+  candy_funcstate_t *fs = self->fs;
+  candy_inst_t *inst = candy_proto_get_inst(fs->proto);
+  int size = (int)candy_proto_get_size_inst(fs->proto);
+  uint32_t nparams = candy_proto_get_nparams(fs->proto);
+  int start[MAX_REGS], end[MAX_REGS], busy[MAX_REGS];
+  uint32_t slot[MAX_REGS], order[MAX_REGS], reg[3], vbase;
+  /* a local is live from the statement declaring it to its last use */
+  for (uint32_t idx = nparams; idx < fs->nactvar; ++idx) {
+    start[idx] = fs->actvar[idx].pinned ? 0 : fs->actvar[idx].startpc;
+    end[idx] = fs->actvar[idx].pinned ? size : start[idx];
+  }
+  /* registers from 'vbase' on hold temporaries */
+  vbase = nparams;
+  for (int pc = 0; pc < size; ++pc) {
+    for (; vbase < fs->nactvar && fs->actvar[vbase].startpc <= pc; ++vbase);
+    _registers(inst[pc], reg);
+    for (int idx = 0; idx < 3; ++idx)
+      if (reg[idx] >= nparams && reg[idx] < vbase && end[reg[idx]] < pc)
+        end[reg[idx]] = pc;
+  }
+  /* a local live when a loop begins stays live until it jumps back */
+  for (bool grown = true; grown;) {
+    grown = false;
+    for (int pc = 0; pc < size; ++pc) {
+      int loop = pc + 1 + candy_inst_get_sbx(inst[pc]);
+      /* the jumps of a table go back to the blocks of an if chain */
+      if ((inst[pc].op != OP_JMP && inst[pc].op != OP_FORLOOP) || (inst[pc].op == OP_JMP && inst[pc].iabx.a) || loop > pc)
+        continue;
+      for (uint32_t idx = nparams; idx < fs->nactvar; ++idx) {
+        if (start[idx] < loop && end[idx] >= loop && end[idx] < pc) {
+          end[idx] = pc;
+          grown = true;
+        }
+      }
+    }
+  }
+  uint32_t n = 0;
+  for (uint32_t idx = nparams; idx < fs->nactvar; ++idx) {
+    uint32_t pos = n++;
+    for (; pos > 0 && start[order[pos - 1]] > start[idx]; --pos)
+      order[pos] = order[pos - 1];
+    order[pos] = idx;
+  }
+  uint32_t top = nparams;
+  for (uint32_t pos = 0; pos < n; ++pos) {
+    uint32_t idx = order[pos], s = nparams;
+    for (; s < top && busy[s] >= start[idx]; ++s);
+    if (s == top)
+      ++top;
+    busy[s] = end[idx];
+    slot[idx] = s;
+  }
+  par_assert(top + fs->maxtemp <= MAX_REGS, "function needs too many registers");
+  for (uint32_t idx = 0; idx < nparams; ++idx)
+    slot[idx] = idx;
+  /* the closures of nested functions capture the slots, not the locals */
+  for (size_t idx = 0; idx < candy_proto_get_size_proto(fs->proto); ++idx) {
+    candy_proto_t *proto = candy_proto_get_proto(fs->proto, idx);
+    candy_upvaldesc_t *desc = candy_proto_get_upval(proto);
+    for (size_t up = 0; up < candy_proto_get_size_upval(proto); ++up)
+      if (desc[up].instack)
+        desc[up].idx = (uint8_t)slot[desc[up].idx];
+  }
+  vbase = nparams;
+  for (int pc = 0; pc < size; ++pc) {
+    for (; vbase < fs->nactvar && fs->actvar[vbase].startpc <= pc; ++vbase);
+    _registers(inst[pc], reg);
+    for (int idx = 0; idx < 3; ++idx)
+      if (reg[idx] != MAX_REGS)
+        reg[idx] = reg[idx] < vbase ? slot[reg[idx]] : reg[idx] - vbase + top;
+    if (reg[0] != MAX_REGS)
+      inst[pc].iabc.a = reg[0];
+    if (reg[1] != MAX_REGS)
+      inst[pc].iabc.b = reg[1];
+    if (reg[2] != MAX_REGS)
+      inst[pc].iabc.c = reg[2];
+  }
+  candy_proto_set_maxstack(fs->proto, (uint8_t)(top + fs->maxtemp));
+}
+
+/**
+  * @brief  the closures stored in locals, one never read is not created at
+  *         all and the prototype of one only ever called is framed, see
+  *         @ref candy_proto_is_framed
+  */
+static void _frame_closures(candy_parser_t *self) {
+  candy_funcstate_t *fs = self->fs;
+  candy_inst_t *inst = candy_proto_get_inst(fs->proto);
+  int size = (int)candy_proto_get_size_inst(fs->proto);
+  uint32_t vbase = candy_proto_get_nparams(fs->proto);
+  for (int pc = 0; pc < size; ++pc) {
+    for (; vbase < fs->nactvar && fs->actvar[vbase].startpc <= pc; ++vbase);
+    if (inst[pc].op == OP_CLOSURE && inst[pc].iabx.a < vbase) {
+      const candy_vardesc_t *var = &fs->actvar[inst[pc].iabx.a];
+      /* the prototype has no other CLOSURE than this one */
+      if (!var->escapes)
+        candy_proto_set_framed(candy_proto_get_proto(fs->proto, inst[pc].iabx.b), true);
+      if (!var->read) {
+        inst[pc].op = OP_LOADNONE;
+        inst[pc].iabc.b = 0;
+        inst[pc].iabc.c = 0;
+      }
+    }
+  }
+}
+
+static void _open_func(candy_parser_t *self, candy_funcstate_t *fs, candy_proto_t *proto) {
+  fs->prev = self->fs;
+  fs->proto = proto;
+  fs->nactvar = 0;
+  fs->freereg = 0;
+  fs->maxtemp = 0;
+  fs->bl = NULL;
+  fs->nblock = 0;
+  fs->nupval = 0;
+  fs->firstk = (uint32_t)candy_vector_size(&self->cnst);
+  self->fs = fs;
+}
+
+static void _close_func(candy_parser_t *self) {
+  _abc(self, OP_RETURN, 0, 1, 0);
+  candy_funcstate_t *fs = self->fs;
+  candy_proto_set_cnst(fs->proto, self->ls.gc, self->ls.ctx,
+    (const candy_wrap_t *)candy_vector_data(&self->cnst) + fs->firstk, candy_vector_size(&self->cnst) - fs->firstk
+  );
+  candy_vector_resize(&self->cnst, NULL, NULL, fs->firstk);
+  if (candy_vector_size(&self->kcache) > fs->firstk)
+    candy_vector_resize(&self->kcache, NULL, NULL, fs->firstk);
+  _frame_closures(self);
+  _regalloc(self);
+  candy_peephole(fs->proto, self->ls.gc, self->ls.ctx, self->level);
+  self->fs = self->fs->prev;
+}
+
+/* R(A), ... = args, the last argument may hand over all of its results */
+static int _explist(candy_parser_t *self, candy_expdesc_t *e) {
+  int n = 1;
+  expr(self, e);
+  while (_lookahead(self) == TK_COMMA) {
+    _next(self);
+    _exp2nextreg(self, e);
+    expr(self, e);
+    ++n;
+  }
+  return n;
+}
+
+static void expr_call(candy_parser_t *self, candy_expdesc_t *f, candy_proto_t *callee) {
+  candy_expdesc_t args;
+  uint32_t base = f->info;
+  uint32_t nargs = 0;
   /* skip '(' */
-  candy_lexer_next(&self->ls);
-  expr(self, &e);
-  /* skip ')' */
-  candy_lexer_next(&self->ls);
+  _next(self);
+  if (_lookahead(self) == TK_RPAREN)
+    args.kind = EXP_VOID;
+  else
+    _explist(self, &args);
+  _expect(self, TK_RPAREN);
+  if (args.kind == EXP_CALL)
+    _setreturns(self, &args, -1);
+  else {
+    if (args.kind != EXP_VOID)
+      _exp2nextreg(self, &args);
+    nargs = self->fs->freereg - base;
+  }
+  _init_exp(f, EXP_CALL, (uint32_t)_abc(self, OP_CALL, base, nargs, 2));
+  /* the call leaves its first result in place of the function */
+  self->fs->freereg = base + 1;
+  /* see @ref _setreturns */
+  self->callpc = (int)f->info;
+  self->callee = callee && args.kind != EXP_CALL && nargs == candy_proto_get_nparams(callee) + 1U ? callee : NULL;
 }
 
-/*  */
-static void stat_def(candy_parser_t *self) {
-  /* skip def */
-  candy_lexer_next(&self->ls);
-  switch (candy_lexer_lookahead(&self->ls)) {
+/* name | '(' expr ')' */
+static void expr_primary(candy_parser_t *self, candy_expdesc_t *e) {
+  switch (_lookahead(self)) {
     case TK_IDENT:
-      candy_lexer_next(&self->ls);
-      par_assert(candy_lexer_lookahead(&self->ls) == '(', "unknown token %d", candy_lexer_lookahead(&self->ls));
-      expr_lambda(self);
+      _singlevar(self, e, _name(self));
       break;
-    /* lambda expression */
-    case '(':
-      expr_lambda(self);
+    case TK_LPAREN:
+      _next(self);
+      expr(self, e);
+      _expect(self, TK_RPAREN);
+      _discharge_vars(self, e);
       break;
     default:
-      par_assert(false, "unknown token %d", candy_lexer_lookahead(&self->ls));
+      par_assert(false, "line %zu: unexpected symbol near '%s'", self->ls.dbg.line, candy_token_str(_lookahead(self)));
   }
 }
 
-// /**
-//   * @brief  if '(' expr ')' block { elif '(' expr ')' block } [ else block ] end
-//   * @param  self  parser handle.
-//   */
-// static void stat_if(candy_parser_t *self) {
-//   /* if '(' expr ')' block */
-//   /* { elif '(' expr ')' block } */
-//   /* [ else block ] end */
-// }
+/* primary { '(' args ')' } */
+static void expr_suffixed(candy_parser_t *self, candy_expdesc_t *e) {
+  expr_primary(self, e);
+  /* a local only called hands its value to nobody */
+  if (e->kind == EXP_LOCAL) {
+    candy_vardesc_t *var = &self->fs->actvar[e->info];
+    var->read = true;
+    if (_lookahead(self) != TK_LPAREN)
+      var->escapes = true;
+  }
+  while (_lookahead(self) == TK_LPAREN) {
+    const candy_inline_t *inl = e->kind == EXP_GLOBAL && self->level > 0 ? _search_inline(self, e->s) : NULL;
+    _exp2nextreg(self, e);
+    expr_call(self, e, inl ? inl->proto : NULL);
+  }
+}
 
-/** @ref https://blog.csdn.net/initphp/article/details/105247775 */
-static void _statement(candy_parser_t *self) {
-  while (candy_lexer_lookahead(&self->ls) != TK_EOS) {
-    switch (candy_lexer_lookahead(&self->ls)) {
-      case TK_def:
-          stat_def(self);
-          break;
-      // case TK_if:
-      //   // _stat_if(self);
-      //   break;
-      // case TK_while:
-      //   break;
-      // case TK_for:
-      //   break;
-      // case TK_break:
-      //   break;
+/* '(' params ')' */
+static void _params(candy_parser_t *self) {
+  candy_funcstate_t *fs = self->fs;
+  _expect(self, TK_LPAREN);
+  while (_lookahead(self) != TK_RPAREN) {
+    par_assert(fs->nactvar < MAX_REGS, "too many parameters");
+    fs->actvar[fs->nactvar++] = (candy_vardesc_t) {
+      .name = _name(self),
+    };
+    if (_lookahead(self) != TK_COMMA)
+      break;
+    _next(self);
+  }
+  _expect(self, TK_RPAREN);
+  candy_proto_set_nparams(fs->proto, (uint8_t)fs->nactvar);
+}
+
+/* params block end */
+static void _body(candy_parser_t *self) {
+  _params(self);
+  _reserve(self, self->fs->nactvar);
+  _block(self);
+  _expect(self, TK_end);
+  _close_func(self);
+}
+
+/**
+  * @brief  params, then the tokens up to the matching end are only counted,
+  *         the text is kept for @ref candy_parse_body to compile it
+  */
+static void _skim(candy_parser_t *self) {
+  candy_funcstate_t *fs = self->fs;
+  uint32_t line = (uint32_t)self->ls.dbg.line;
+  size_t depth = 1;
+  candy_vector_resize(&self->record, NULL, NULL, 0);
+  _params(self);
+  while (depth) {
+    switch (_lookahead(self)) {
+      case TK_def: case TK_if: case TK_while: case TK_for:
+        ++depth;
+        break;
+      case TK_end:
+        --depth;
+        break;
+      case TK_EOS:
+        par_assert(false, "line %zu: 'end' expected near 'EOS'", self->ls.dbg.line);
       default:
-        // par_assert(false, "unknown token %d", candy_lexer_lookahead(&self->lex));
-        // printf("%s line %zu col %zu\n", candy_token_str(candy_lexer_lookahead(&self->ls)), self->ls.dbg.line, self->ls.dbg.column);
-        candy_lexer_next(&self->ls);
         break;
     }
+    _next(self);
   }
+  candy_lexer_record(&self->ls, NULL);
+  candy_array_t *source = candy_array_create(self->ls.gc, self->ls.ctx, CANDY_TYPE_CHAR, MASK_NONE);
+  candy_array_append(source, self->ls.gc, self->ls.ctx, candy_vector_data(&self->record), candy_vector_size(&self->record));
+  candy_proto_set_source(fs->proto, source, line, self->level);
+  self->fs = fs->prev;
 }
 
-candy_object_t *candy_parse(candy_gc_t *gc, candy_exce_t *ctx, candy_reader_t reader, void *arg) {
-  candy_funcstate_t fs = {
-    .prev = NULL,
-    .proto = candy_proto_create(gc, ctx),
-  };
-  candy_parser_t parser = {
-    .fs = &fs,
+/* lambda '(' params ')' block end */
+static void expr_lambda(candy_parser_t *self, candy_expdesc_t *e) {
+  candy_funcstate_t fs;
+  _open_func(self, &fs, candy_proto_create(self->ls.gc, self->ls.ctx));
+  /* only a function of the chunk, nothing it refers to can be a local */
+  if (self->lazy && fs.prev->prev == NULL && candy_lexer_record(&self->ls, &self->record))
+    _skim(self);
+  else
+    _body(self);
+  uint32_t idx = (uint32_t)candy_proto_add_proto(self->fs->proto, self->ls.gc, self->ls.ctx, fs.proto);
+  _init_exp(e, EXP_RELOC, (uint32_t)_abx(self, OP_CLOSURE, 0, idx));
+}
+
+static void expr_simple(candy_parser_t *self, candy_expdesc_t *e) {
+  switch (_lookahead(self)) {
+    case TK_INTEGER:
+      e->kind = EXP_INTEGER;
+      e->hint = HINT_INTEGER;
+      e->i = _next(self)->i;
+      break;
+    case TK_FLOAT:
+      e->kind = EXP_FLOAT;
+      e->hint = HINT_NUMBER;
+      e->f = _next(self)->f;
+      break;
+    case TK_STRING:
+      _init_exp(e, EXP_CONST, _string(self, _next(self)->s));
+      break;
+    case TK_true:
+      _next(self);
+      _init_exp(e, EXP_TRUE, 0);
+      break;
+    case TK_false:
+      _next(self);
+      _init_exp(e, EXP_FALSE, 0);
+      break;
+    case TK_none:
+      _next(self);
+      _init_exp(e, EXP_NONE, 0);
+      break;
+    case TK_def:
+      _next(self);
+      expr_lambda(self, e);
+      break;
+    default:
+      expr_suffixed(self, e);
+      break;
+  }
+}
+
+/**
+  * @brief  precedence climbing, operators that bind tighter than 'limit'
+  *         are folded into 'e' as they come
+  * @retval the first operator left to the caller
+  */
+static candy_binopr_t expr_sub(candy_parser_t *self, candy_expdesc_t *e, uint8_t limit) {
+  candy_unopr_t uop = _unopr(_lookahead(self));
+  if (uop != OPR_NOUNOPR) {
+    _next(self);
+    expr_sub(self, e, UNARY_PRIORITY);
+    _prefix(self, uop, e);
+  }
+  else
+    expr_simple(self, e);
+  candy_binopr_t op = _binopr(_lookahead(self));
+  while (op != OPR_NOBINOPR && _priority[op].left > limit) {
+    candy_expdesc_t e2;
+    _next(self);
+    _infix(self, op, e);
+    candy_binopr_t next = expr_sub(self, &e2, _priority[op].right);
+    _postfix(self, op, e, &e2);
+    op = next;
+  }
+  return op;
+}
+
+static void expr(candy_parser_t *self, candy_expdesc_t *e) {
+  expr_sub(self, e, 0);
+}
+
+static void _store(candy_parser_t *self, candy_expdesc_t *var, candy_expdesc_t *e) {
+  if (var->kind == EXP_LOCAL) {
+    _free_exp(self, e);
+    _exp2reg(self, e, var->info);
+    return;
+  }
+  if (var->kind == EXP_UPVAL) {
+    uint32_t reg = _exp2anyreg(self, e);
+    _abc(self, OP_SETUPVAL, reg, var->info, 0);
+    _free_exp(self, e);
+    return;
+  }
+  /* a global assigned again is no longer inlined */
+  candy_inline_t *inl = _search_inline(self, var->s);
+  if (inl)
+    inl->proto = NULL;
+  uint32_t val = _exp2rk(self, e);
+  uint32_t k = _string(self, var->s);
+  uint32_t cache = _setcache(self, k);
+  candy_expdesc_t key;
+  _init_exp(&key, EXP_CONST, k);
+  _abc(self, OP_SETTABUP, cache, _exp2rk(self, &key), val);
+  _free_exps(self, &key, e);
+}
+
+/* def name '(' params ')' block end */
+static void stat_def(candy_parser_t *self) {
+  candy_expdesc_t var, e;
+  /* skip def */
+  _next(self);
+  if (_lookahead(self) == TK_LPAREN) {
+    expr_lambda(self, &e);
+    return;
+  }
+  candy_array_t *name = _name(self);
+  _singlevar(self, &var, name);
+  /* inside a function a new name is a local, its own body can see it */
+  if (var.kind == EXP_GLOBAL && self->fs->prev) {
+    _init_exp(&var, EXP_LOCAL, _new_local(self, name));
+    self->fs->actvar[var.info].name = name;
+  }
+  expr_lambda(self, &e);
+  _store(self, &var, &e);
+  if (var.kind == EXP_GLOBAL && _search_inline(self, name) == NULL) {
+    candy_proto_t *proto = candy_proto_get_proto(self->fs->proto, candy_proto_get_size_proto(self->fs->proto) - 1);
+    candy_inline_t inl = {
+      .name = name,
+      .proto = _inlinable(proto) ? proto : NULL,
+    };
+    candy_vector_append(&self->inlines, candy_gc_memory(self->ls.gc), self->ls.ctx, &inl, 1);
+  }
+}
+
+/* return [ exprlist ] */
+static void stat_return(candy_parser_t *self) {
+  candy_expdesc_t e;
+  uint32_t first = self->fs->nactvar;
+  int nret = 0;
+  /* skip return */
+  _next(self);
+  if (!_block_follow(self)) {
+    nret = _explist(self, &e);
+    if (e.kind == EXP_CALL) {
+      _setreturns(self, &e, -1);
+      /* the callee takes over the frame */
+      if (nret == 1)
+        _inst(self, e.info)->op = OP_TAILCALL;
+      nret = -1;
+    }
+    else if (nret == 1)
+      first = _exp2anyreg(self, &e);
+    else
+      _exp2nextreg(self, &e);
+  }
+  _abc(self, OP_RETURN, first, (uint32_t)(nret + 1), 0);
+}
+
+/**
+  * @brief  the local tested by the instruction at 'pc' if it is 'local ==
+  *         constant' with an integer or a string, MAX_REGS for any other
+  */
+static uint32_t _case(candy_parser_t *self, int pc) {
+  candy_funcstate_t *fs = self->fs;
+  candy_inst_t inst = *_inst(self, pc);
+  if (inst.op != OP_EQ || inst.iabc.a != 0 || candy_inst_is_k(inst.iabc.b) == candy_inst_is_k(inst.iabc.c))
+    return MAX_REGS;
+  uint32_t reg = candy_inst_is_k(inst.iabc.b) ? inst.iabc.c : inst.iabc.b;
+  uint32_t k = candy_inst_get_k(candy_inst_is_k(inst.iabc.b) ? inst.iabc.b : inst.iabc.c);
+  const candy_wrap_t *wrap = (const candy_wrap_t *)candy_vector_data(&self->cnst) + fs->firstk + k;
+  if (reg >= fs->nactvar || (candy_wrap_get_type(wrap) != CANDY_TYPE_INTEGER && !candy_wrap_is_string(wrap)))
+    return MAX_REGS;
+  return reg;
+}
+
+/**
+  * @brief  an if chain whose tests all compare one local with a constant
+  *         dispatches through a table from the constants to their blocks,
+  *         the first test jumps to it and the others are left dead:
+  *         'JMPTAB R K; JMP default; JMP block 0; ...; JMP block n - 1'.
+  *         the first of equal constants wins as it would in the chain.
+  * @retval false if the chain is left as it is
+  */
+static bool _jmptab(candy_parser_t *self, size_t first, int dflt, int *escape) {
+  candy_funcstate_t *fs = self->fs;
+  const int *cases = (const int *)candy_vector_data(&self->cases) + first;
+  size_t n = candy_vector_size(&self->cases) - first;
+  size_t k = candy_vector_size(&self->cnst) - fs->firstk;
+  if (self->level <= 0 || n < MIN_CASES || n > MAX_CASES || k > MAX_CASES)
+    return false;
+  uint32_t reg = cases[0] == NO_JUMP ? MAX_REGS : _case(self, cases[0]);
+  for (size_t idx = 0; idx < n; ++idx)
+    if (reg == MAX_REGS || cases[idx] == NO_JUMP || _case(self, cases[idx]) != reg)
+      return false;
+  candy_table_t *tab = candy_table_create(self->ls.gc, self->ls.ctx);
+  const candy_wrap_t *cnst = (const candy_wrap_t *)candy_vector_data(&self->cnst) + fs->firstk;
+  for (size_t idx = 0; idx < n; ++idx) {
+    candy_inst_t inst = *_inst(self, cases[idx]);
+    const candy_wrap_t *key = &cnst[candy_inst_get_k(candy_inst_is_k(inst.iabc.b) ? inst.iabc.b : inst.iabc.c)];
+    candy_wrap_t val;
+    candy_wrap_set_integer(&val, (candy_integer_t)idx);
+    if (candy_wrap_get_type(candy_table_get(tab, key)) == CANDY_TYPE_NULL)
+      candy_table_set(tab, self->ls.gc, self->ls.ctx, key, &val);
+  }
+  /* a table is never shared, it stays out of the map of the constants */
+  candy_wrap_t wrap;
+  candy_wrap_set_object(&wrap, (candy_object_t *)tab);
+  candy_vector_append(&self->cnst, candy_gc_memory(self->ls.gc), self->ls.ctx, &wrap, 1);
+  /* the last block falls through to the table otherwise */
+  _concat(self, escape, _jump(self));
+  _inst(self, cases[0])->op = OP_JMP;
+  _inst(self, cases[0])->iabx.a = 0;
+  _fix_jump(self, cases[0], _pc(self));
+  _abc(self, OP_JMPTAB, reg, (uint32_t)n, (uint32_t)k);
+  _fix_jump(self, _jump(self), dflt);
+  /* 'a' keeps the jumps back to the blocks from being taken for loops */
+  for (size_t idx = 0; idx < n; ++idx) {
+    int pc = _jump(self);
+    _inst(self, pc)->iabx.a = 1;
+    _fix_jump(self, pc, cases[idx] + 2);
+  }
+  return true;
+}
+
+/**
+  * @brief  cond block, where the jumps of the other branches are collected,
+  *         the test is added to the cases of the chain if it is a single one
+  */
+static void _test_then(candy_parser_t *self, int *escape) {
+  candy_expdesc_t e;
+  int pc = _pc(self);
+  /* skip if or elif */
+  _next(self);
+  expr(self, &e);
+  int jf = _cond(self, &e);
+  int test = jf == pc + 1 ? pc : NO_JUMP;
+  candy_vector_append(&self->cases, candy_gc_memory(self->ls.gc), self->ls.ctx, &test, 1);
+  self->fs->freereg = self->fs->nactvar;
+  _block(self);
+  if (_lookahead(self) == TK_elif || _lookahead(self) == TK_else)
+    _concat(self, escape, _jump(self));
+  _patch_here(self, jf);
+}
+
+/* if cond block { elif cond block } [ else block ] end */
+static void stat_if(candy_parser_t *self) {
+  int escape = NO_JUMP;
+  size_t first = candy_vector_size(&self->cases);
+  _test_then(self, &escape);
+  while (_lookahead(self) == TK_elif)
+    _test_then(self, &escape);
+  int dflt = _pc(self);
+  if (_lookahead(self) == TK_else) {
+    _next(self);
+    _block(self);
+  }
+  _expect(self, TK_end);
+  _jmptab(self, first, dflt, &escape);
+  candy_vector_resize(&self->cases, NULL, NULL, first);
+  _patch_here(self, escape);
+}
+
+/* while cond block end */
+static void stat_while(candy_parser_t *self) {
+  candy_expdesc_t e;
+  int start = _pc(self);
+  /* skip while */
+  _next(self);
+  expr(self, &e);
+  int exit = _cond(self, &e);
+  self->fs->freereg = self->fs->nactvar;
+  _block(self);
+  _fix_jump(self, _jump(self), start);
+  _expect(self, TK_end);
+  _patch_here(self, exit);
+}
+
+/* R(reg) = expr */
+static void _for_exp(candy_parser_t *self, uint32_t reg) {
+  candy_expdesc_t e;
+  expr(self, &e);
+  _free_exp(self, &e);
+  _exp2reg(self, &e, reg);
+  self->fs->freereg = self->fs->nactvar;
+}
+
+/* for name '=' expr ',' expr [ ',' expr ] block end */
+static void stat_for(candy_parser_t *self) {
+  candy_funcstate_t *fs = self->fs;
+  /* skip for */
+  _next(self);
+  candy_array_t *name = _name(self);
+  _expect(self, TK_ASSIGN);
+  /* the counter, the limit, the step and the variable, adjacent for good */
+  uint32_t base = fs->nactvar;
+  for (uint32_t idx = 0; idx < 4; ++idx) {
+    _new_local(self, NULL);
+    fs->actvar[base + idx].pinned = true;
+  }
+  fs->freereg = fs->nactvar;
+  _for_exp(self, base);
+  _expect(self, TK_COMMA);
+  _for_exp(self, base + 1);
+  if (_lookahead(self) == TK_COMMA) {
+    _next(self);
+    _for_exp(self, base + 2);
+  }
+  else {
+    candy_expdesc_t step = {.kind = EXP_INTEGER, .hint = HINT_INTEGER, .i = 1};
+    _exp2reg(self, &step, base + 2);
+  }
+  int prep = candy_proto_add_iasbx(fs->proto, self->ls.gc, self->ls.ctx, OP_FORPREP, base, NO_JUMP);
+  int start = _pc(self);
+  /* the chunk has no locals, its variable is a global */
+  if (fs->prev)
+    fs->actvar[base + 3].name = name;
+  else {
+    candy_expdesc_t var, e;
+    _init_exp(&var, EXP_GLOBAL, 0);
+    var.s = name;
+    _init_exp(&e, EXP_LOCAL, base + 3);
+    _store(self, &var, &e);
+  }
+  _block(self);
+  int loop = candy_proto_add_iasbx(fs->proto, self->ls.gc, self->ls.ctx, OP_FORLOOP, base, NO_JUMP);
+  _fix_jump(self, loop, start);
+  _fix_jump(self, prep, loop + 1);
+  _expect(self, TK_end);
+}
+
+/* call | name '=' expr | name 'op=' expr */
+static void stat_expr(candy_parser_t *self) {
+  candy_expdesc_t var, e;
+  expr_suffixed(self, &var);
+  candy_tokens_t token = _lookahead(self);
+  if (token != TK_ASSIGN && _assignopr(token) == OPR_NOBINOPR) {
+    par_assert(var.kind == EXP_CALL, "line %zu: syntax error near '%s'", self->ls.dbg.line, candy_token_str(token));
+    _setreturns(self, &var, 0);
+    return;
+  }
+  par_assert(var.kind == EXP_LOCAL || var.kind == EXP_UPVAL || var.kind == EXP_GLOBAL, "line %zu: cannot assign to expression", self->ls.dbg.line);
+  _next(self);
+  /* inside a function a new name is a local from its first assignment on */
+  if (token == TK_ASSIGN && var.kind == EXP_GLOBAL && self->fs->prev) {
+    candy_array_t *name = var.s;
+    _init_exp(&var, EXP_LOCAL, _new_local(self, name));
+    expr(self, &e);
+    _store(self, &var, &e);
+    self->fs->actvar[var.info].name = name;
+    return;
+  }
+  if (token == TK_ASSIGN)
+    expr(self, &e);
+  else {
+    candy_expdesc_t rhs;
+    e = var;
+    _infix(self, _assignopr(token), &e);
+    expr(self, &rhs);
+    _postfix(self, _assignopr(token), &e, &rhs);
+  }
+  _store(self, &var, &e);
+}
+
+static void _statement(candy_parser_t *self) {
+  switch (_lookahead(self)) {
+    case TK_def:
+      stat_def(self);
+      break;
+    case TK_return:
+      stat_return(self);
+      break;
+    case TK_if:
+      stat_if(self);
+      break;
+    case TK_while:
+      stat_while(self);
+      break;
+    case TK_for:
+      stat_for(self);
+      break;
+    default:
+      stat_expr(self);
+      break;
+  }
+  /* temporaries do not outlive their statement */
+  self->fs->freereg = self->fs->nactvar;
+}
+
+static void _block(candy_parser_t *self) {
+  candy_funcstate_t *fs = self->fs;
+  candy_blockcnt_t bl = {
+    .prev = fs->bl,
+    .id = fs->nblock++,
   };
+  fs->bl = &bl;
+  while (!_block_follow(self))
+    _statement(self);
+  fs->bl = bl.prev;
+}
+
+static void _chunk(candy_parser_t *self) {
+  _block(self);
+  par_assert(_lookahead(self) == TK_EOS, "line %zu: '%s' unexpected", self->ls.dbg.line, candy_token_str(_lookahead(self)));
+  _close_func(self);
+}
+
+/* the function of a skimmed body, alone in a chunk without locals */
+static void _lazy(candy_parser_t *self) {
+  _body(self);
+  par_assert(_lookahead(self) == TK_EOS, "line %zu: '%s' unexpected", self->ls.dbg.line, candy_token_str(_lookahead(self)));
+}
+
+static void _parser_init(candy_parser_t *self, candy_gc_t *gc, candy_exce_t *ctx, int level, bool lazy, candy_reader_t reader, void *arg) {
+  self->fs = NULL;
+  self->level = level;
+  self->lazy = lazy;
+  self->kmap = NULL;
+  self->sizekmap = 0;
+  self->nkmap = 0;
+  self->callpc = NO_JUMP;
+  self->callee = NULL;
+  candy_vector_init(&self->cnst, sizeof(struct candy_wrap));
+  candy_vector_init(&self->kcache, sizeof(uint32_t));
+  candy_vector_init(&self->inlines, sizeof(candy_inline_t));
+  candy_vector_init(&self->record, sizeof(char));
+  candy_vector_init(&self->cases, sizeof(int));
+  candy_lexer_init(&self->ls, gc, ctx, reader, arg);
+}
+
+static void _parser_deinit(candy_parser_t *self) {
+  candy_memory_t *mem = candy_gc_memory(self->ls.gc);
+  candy_vector_deinit(&self->cnst, mem);
+  candy_vector_deinit(&self->kcache, mem);
+  candy_vector_deinit(&self->record, mem);
+  candy_vector_deinit(&self->inlines, mem);
+  candy_vector_deinit(&self->cases, mem);
+  candy_memory_free(mem, self->kmap, self->sizekmap * sizeof(uint32_t));
+  candy_lexer_deinit(&self->ls);
+}
+
+candy_object_t *candy_parse(candy_gc_t *gc, candy_exce_t *ctx, int level, bool lazy, candy_reader_t reader, void *arg) {
+  candy_parser_t parser;
+  candy_funcstate_t fs;
   candy_object_t *msg = NULL;
-  candy_lexer_init(&parser.ls, gc, ctx, reader, arg);
-  candy_err_t err = candy_exce_try(ctx, (candy_exce_cb_t)_statement, &parser, &msg);
-  candy_lexer_deinit(&parser.ls);
+  _parser_init(&parser, gc, ctx, level, lazy, reader, arg);
+  _open_func(&parser, &fs, candy_proto_create(gc, ctx));
+  candy_err_t err = candy_exce_try(ctx, (candy_exce_cb_t)_chunk, &parser, &msg);
+  _parser_deinit(&parser);
   if (err != EXCE_OK)
     return msg;
   return (candy_object_t *)candy_sclosure_create(gc, ctx, fs.proto);
 }
+
+void candy_parse_body(candy_proto_t *proto, candy_gc_t *gc, candy_exce_t *ctx) {
+  candy_array_t *source = candy_proto_get_source(proto);
+  struct str_info info = {
+    .exp = (const char *)candy_array_data(source),
+    .size = candy_array_size(source),
+    .offset = 0,
+  };
+  candy_parser_t parser;
+  candy_funcstate_t chunk, fs;
+  candy_object_t *msg = NULL;
+  _parser_init(&parser, gc, ctx, candy_proto_get_level(proto), false, string_reader, &info);
+  parser.ls.dbg.line = candy_proto_get_line(proto);
+  /* the chunk has no prototype of its own, nothing is added to it */
+  _open_func(&parser, &chunk, NULL);
+  _open_func(&parser, &fs, candy_proto_create(gc, ctx));
+  candy_err_t err = candy_exce_try(ctx, (candy_exce_cb_t)_lazy, &parser, &msg);
+  /* the function is left as it is if its body fails, every call reports it */
+  if (err == EXCE_OK) {
+    candy_proto_swap_body(proto, fs.proto);
+    candy_proto_set_source(proto, NULL, 0, 0);
+  }
+  _parser_deinit(&parser);
+  if (err != EXCE_OK)
+    candy_exce_throw(ctx, err, msg);
+}
@@ -21,7 +21,20 @@ extern "C" {
 
 #include "core/candy_priv.h"
 
-candy_object_t *candy_parse(candy_gc_t *gc, candy_exce_t *ctx, candy_reader_t reader, void *arg);
+/**
+  * @brief  compile a chunk, 'level' is the optimization level handed to
+  *         @ref candy_peephole for each function, above 0 calls of small
+  *         functions of the chunk are inlined too. with 'lazy' the bodies of
+  *         the functions defined by the chunk are only skimmed
+  * @retval the closure of the chunk, or the message of a syntax error
+  */
+candy_object_t *candy_parse(candy_gc_t *gc, candy_exce_t *ctx, int level, bool lazy, candy_reader_t reader, void *arg);
+
+/**
+  * @brief  compile the body @ref candy_parse has only skimmed, a syntax
+  *         error is thrown on 'ctx' and the prototype stays as it was
+  */
+void candy_parse_body(candy_proto_t *proto, candy_gc_t *gc, candy_exce_t *ctx);
 
 #ifdef __cplusplus
 }
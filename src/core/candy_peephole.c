@@ -0,0 +1,375 @@
+/**
+  * Copyright 2022-2024 ShunzDai
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+#include "core/candy_peephole.h"
+#include "core/candy_proto.h"
+#include "core/candy_memory.h"
+#include "core/candy_gc.h"
+#include <string.h>
+
+/* what is known about each instruction while the pass runs */
+enum {
+  PH_REACHED = 1 << 0,
+  /* a jump or a skip may land on it */
+  PH_TARGET  = 1 << 1,
+  PH_DEAD    = 1 << 2,
+};
+
+typedef struct candy_fuse {
+  uint8_t first;
+  uint8_t second;
+  uint8_t fused;
+} candy_fuse_t;
+
+static const candy_fuse_t _fuse[] = {
+  #define CANDY_OP_FUSE
+  #include "core/candy_opcode.list"
+  {OP_NUM, OP_NUM, OP_NUM},
+};
+
+/**
+  * @brief  the first instruction of a known pair becomes the superinstruction,
+  *         the second one stays in place so jumps into it keep working.
+  */
+static void _fuse_pairs(candy_proto_t *proto) {
+  candy_inst_t *inst = candy_proto_get_inst(proto);
+  size_t size = candy_proto_get_size_inst(proto);
+  for (size_t idx = 0; idx + 1 < size; ++idx)
+    inst[idx].op = candy_peephole_fuse((candy_opcodes_t)inst[idx].op, (candy_opcodes_t)inst[idx + 1].op);
+}
+
+/* whether the instruction may go on at the one after the next */
+static bool _skips(candy_inst_t inst) {
+  switch (inst.op) {
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE:
+    case OP_TEST:
+    case OP_TESTPROTO:
+      return true;
+    case OP_LOADBOOL:
+      return inst.iabc.c != 0;
+    default:
+      return false;
+  }
+}
+
+/* whether the instruction has an sBx target, the loop ones go on at the next one otherwise */
+static bool _branches(candy_inst_t inst) {
+  return inst.op == OP_JMP || inst.op == OP_FORPREP || inst.op == OP_FORLOOP;
+}
+
+static int _target(const candy_inst_t *inst, int pc) {
+  return pc + 1 + candy_inst_get_sbx(inst[pc]);
+}
+
+static bool _set_target(candy_inst_t *inst, int pc, int target) {
+  int offset = target - (pc + 1);
+  if (offset < -CANDY_INST_SBX_BIAS || offset > CANDY_INST_SBX_BIAS)
+    return false;
+  inst[pc].iabx.b = (uint32_t)(offset + CANDY_INST_SBX_BIAS);
+  return true;
+}
+
+/* a jump onto a jump goes straight to where the last one leads */
+static void _thread(candy_inst_t *inst, int size) {
+  for (int pc = 0; pc < size; ++pc) {
+    if (inst[pc].op != OP_JMP)
+      continue;
+    int target = _target(inst, pc);
+    /* bounded, a cycle of jumps has no end to go to */
+    for (int hops = 0; hops < size && target < size && inst[target].op == OP_JMP; ++hops)
+      target = _target(inst, target);
+    _set_target(inst, pc, target);
+  }
+}
+
+static void _reach(int flag[], int pc, bool *again, int from) {
+  if (flag[pc] & PH_REACHED)
+    return;
+  flag[pc] |= PH_REACHED;
+  /* only a backward edge needs another sweep */
+  if (pc < from)
+    *again = true;
+}
+
+/* mark what a path from the entry gets to, the rest is dead */
+static void _reachable(const candy_inst_t *inst, int size, int flag[]) {
+  bool again = true;
+  flag[0] |= PH_REACHED;
+  while (again) {
+    again = false;
+    for (int pc = 0; pc < size; ++pc) {
+      if (!(flag[pc] & PH_REACHED))
+        continue;
+      switch (inst[pc].op) {
+        case OP_RETURN:
+        case OP_TAILCALL:
+          break;
+        case OP_JMP:
+          _reach(flag, _target(inst, pc), &again, pc);
+          flag[_target(inst, pc)] |= PH_TARGET;
+          break;
+        case OP_FORPREP:
+        case OP_FORLOOP:
+          _reach(flag, pc + 1, &again, pc);
+          _reach(flag, _target(inst, pc), &again, pc);
+          flag[_target(inst, pc)] |= PH_TARGET;
+          break;
+        /* the default jump and the one of each case */
+        case OP_JMPTAB:
+          for (int idx = pc + 1; idx <= pc + 1 + (int)inst[pc].iabc.b; ++idx) {
+            _reach(flag, idx, &again, pc);
+            flag[idx] |= PH_TARGET;
+          }
+          break;
+        case OP_LOADBOOL:
+          if (!inst[pc].iabc.c) {
+            _reach(flag, pc + 1, &again, pc);
+            break;
+          }
+          _reach(flag, pc + 2, &again, pc);
+          flag[pc + 2] |= PH_TARGET;
+          break;
+        default:
+          _reach(flag, pc + 1, &again, pc);
+          if (_skips(inst[pc])) {
+            _reach(flag, pc + 2, &again, pc);
+            flag[pc + 2] |= PH_TARGET;
+          }
+          break;
+      }
+    }
+  }
+  for (int pc = 0; pc < size; ++pc)
+    if (!(flag[pc] & PH_REACHED))
+      flag[pc] |= PH_DEAD;
+}
+
+/* an instruction writing R(A) and nothing else */
+static bool _produces(candy_inst_t inst) {
+  switch (inst.op) {
+    case OP_MOVE:
+    case OP_LOADK:
+    case OP_GETTABUP:
+    case OP_GETUPVAL:
+    case OP_UNM:
+    case OP_BNOT:
+    case OP_NOT:
+    case OP_CLOSURE:
+      return true;
+    case OP_LOADBOOL:
+      return inst.iabc.c == 0;
+    case OP_LOADNONE:
+      return inst.iabc.b == 0;
+    default:
+      return inst.op >= OP_ADD && inst.op <= OP_SHR;
+  }
+}
+
+/**
+  * @brief  whether R(reg) is overwritten before it is read again on the
+  *         path from 'pc' on, a branch counts as a read
+  */
+static bool _dead_from(const candy_inst_t *inst, int size, int pc, uint32_t reg) {
+  for (int steps = 0; steps < size && pc < size; ++steps, ++pc) {
+    candy_inst_t ins = inst[pc];
+    uint32_t a = ins.iabc.a, b = ins.iabc.b;
+    switch (ins.op) {
+      case OP_RETURN:
+        return b == 1 || reg < a || (b != 0 && reg >= a + b - 1);
+      case OP_TAILCALL:
+        return reg < a || (b != 0 && reg >= a + b);
+      /* a c-function may leave anything above its arguments */
+      case OP_CALL:
+        if (reg >= a)
+          return false;
+        continue;
+      case OP_JMP:
+        pc = _target(inst, pc) - 1;
+        continue;
+      case OP_TEST:
+      case OP_TESTPROTO:
+      case OP_FORPREP:
+      case OP_FORLOOP:
+      case OP_JMPTAB:
+        return false;
+      /* it reads R(A) instead of writing it */
+      case OP_SETUPVAL:
+        if (a == reg)
+          return false;
+        continue;
+      default:
+        break;
+    }
+    int mode = candy_peephole_operands(ins);
+    if ((mode & CANDY_REG_B && b == reg) || (mode & CANDY_REG_C && ins.iabc.c == reg))
+      return false;
+    if (mode & CANDY_REG_A && a == reg)
+      return true;
+    if (_skips(ins))
+      return false;
+  }
+  return false;
+}
+
+/* the registers the closures created by 'proto' share, any call may read them */
+static void _captured(const candy_proto_t *proto, bool captured[]) {
+  const candy_inst_t *inst = candy_proto_get_inst(proto);
+  memset(captured, 0, (CANDY_INST_RK_MAX + 1) * sizeof(bool));
+  for (size_t pc = 0; pc < candy_proto_get_size_inst(proto); ++pc) {
+    if (inst[pc].op != OP_CLOSURE)
+      continue;
+    const candy_proto_t *child = candy_proto_get_proto(proto, inst[pc].iabx.b);
+    const candy_upvaldesc_t *desc = candy_proto_get_upval(child);
+    for (size_t idx = 0; idx < candy_proto_get_size_upval(child); ++idx)
+      if (desc[idx].instack)
+        captured[desc[idx].idx] = true;
+  }
+}
+
+/**
+  * @brief  the local rewrites, each one drops an instruction:
+  *         'LT; JMP +1; JMP L' turns into 'LT with A flipped; JMP L',
+  *         a jump to the next instruction and 'MOVE A A' are no-ops,
+  *         'LOADK T K; MOVE A T' loads A directly once T is dead.
+  */
+static void _rewrite(candy_inst_t *inst, int size, int flag[], const bool captured[]) {
+  for (int pc = 0; pc < size; ++pc) {
+    candy_inst_t ins = inst[pc];
+    /* the skip of the previous one has to keep its distance */
+    bool guarded = pc > 0 && !(flag[pc - 1] & PH_DEAD) && _skips(inst[pc - 1]);
+    if (flag[pc] & PH_DEAD)
+      continue;
+    /* the jumps of a table are found by their distance to it */
+    if (ins.op == OP_JMPTAB) {
+      pc += 1 + (int)ins.iabc.b;
+      continue;
+    }
+    if (pc + 2 < size && (ins.op == OP_EQ || ins.op == OP_LT || ins.op == OP_LE || ins.op == OP_TEST)
+      && inst[pc + 1].op == OP_JMP && _target(inst, pc + 1) == pc + 3 && !(flag[pc + 1] & PH_TARGET)
+      && inst[pc + 2].op == OP_JMP) {
+      if (ins.op == OP_TEST)
+        inst[pc].iabc.c ^= 1;
+      else
+        inst[pc].iabc.a ^= 1;
+      flag[pc + 1] |= PH_DEAD;
+      ++pc;
+      continue;
+    }
+    if (guarded)
+      continue;
+    if ((ins.op == OP_JMP && _target(inst, pc) == pc + 1) || (ins.op == OP_MOVE && ins.iabc.a == ins.iabc.b)) {
+      flag[pc] |= PH_DEAD;
+      continue;
+    }
+    if (pc + 1 < size && _produces(ins) && inst[pc + 1].op == OP_MOVE && inst[pc + 1].iabc.b == ins.iabc.a
+      && inst[pc + 1].iabc.a != ins.iabc.a && !(flag[pc + 1] & PH_TARGET)
+      && !captured[ins.iabc.a] && _dead_from(inst, size, pc + 2, ins.iabc.a)) {
+      inst[pc].iabc.a = inst[pc + 1].iabc.a;
+      flag[pc + 1] |= PH_DEAD;
+      ++pc;
+    }
+  }
+}
+
+/* close the gaps of the dropped instructions, a jump to one of them lands on what follows */
+static int _compact(candy_inst_t *inst, int size, int map[]) {
+  int n = 0;
+  for (int pc = 0; pc < size; ++pc) {
+    bool dead = map[pc] & PH_DEAD;
+    map[pc] = n;
+    n += !dead;
+  }
+  map[size] = n;
+  for (int pc = 0; pc < size; ++pc)
+    if (_branches(inst[pc]) && map[pc] != map[pc + 1])
+      _set_target(inst, pc, map[_target(inst, pc)] - map[pc] + pc);
+  for (int pc = 0; pc < size; ++pc)
+    if (map[pc] != map[pc + 1])
+      inst[map[pc]] = inst[pc];
+  return n;
+}
+
+int candy_peephole(candy_proto_t *proto, candy_gc_t *gc, candy_exce_t *ctx, int level) {
+  candy_inst_t *inst = candy_proto_get_inst(proto);
+  int size = (int)candy_proto_get_size_inst(proto);
+  bool captured[CANDY_INST_RK_MAX + 1];
+  if (level <= 0)
+    return 0;
+  _captured(proto, captured);
+  int *flag = (int *)candy_memory_alloc(candy_gc_memory(gc), ctx, (size + 1) * sizeof(int));
+  memset(flag, 0, (size + 1) * sizeof(int));
+  _thread(inst, size);
+  _reachable(inst, size, flag);
+  _rewrite(inst, size, flag, captured);
+  candy_proto_set_size_inst(proto, (size_t)_compact(inst, size, flag));
+  candy_memory_free(candy_gc_memory(gc), flag, (size + 1) * sizeof(int));
+  /* a profile has to see the plain pairs */
+  if (!CANDY_PROFILE)
+    _fuse_pairs(proto);
+  return 0;
+}
+
+candy_opcodes_t candy_peephole_fuse(candy_opcodes_t first, candy_opcodes_t second) {
+  for (const candy_fuse_t *it = _fuse; it->fused != OP_NUM; ++it)
+    if (first == it->first && second == it->second)
+      return (candy_opcodes_t)it->fused;
+  return first;
+}
+
+candy_opcodes_t candy_peephole_first(candy_opcodes_t op) {
+  for (const candy_fuse_t *it = _fuse; it->fused != OP_NUM; ++it)
+    if (op == it->fused)
+      return (candy_opcodes_t)it->first;
+  return op;
+}
+
+int candy_peephole_operands(candy_inst_t inst) {
+  switch (inst.op) {
+    case OP_MOVE:
+    case OP_UNM:
+    case OP_BNOT:
+    case OP_NOT:
+      return CANDY_REG_A | CANDY_REG_B;
+    case OP_LOADK:
+    case OP_LOADBOOL:
+    case OP_LOADNONE:
+    case OP_TEST:
+    case OP_TESTPROTO:
+    case OP_CALL:
+    case OP_TAILCALL:
+    case OP_CLOSURE:
+    case OP_GETUPVAL:
+    case OP_SETUPVAL:
+    case OP_JMPTAB:
+    /* R(A + 1) to R(A + 3) follow the slot R(A) is given */
+    case OP_FORPREP:
+    case OP_FORLOOP:
+      return CANDY_REG_A;
+    /* a return without values names no register */
+    case OP_RETURN:
+      return inst.iabc.b != 1 ? CANDY_REG_A : 0;
+    case OP_GETTABUP:
+      return CANDY_REG_A | CANDY_REG_C;
+    case OP_SETTABUP:
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE:
+      return CANDY_REG_B | CANDY_REG_C;
+    default:
+      return inst.op >= OP_ADD && inst.op <= OP_SHR ? CANDY_REG_A | CANDY_REG_B | CANDY_REG_C : 0;
+  }
+}
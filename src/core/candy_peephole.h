@@ -0,0 +1,61 @@
+/**
+  * Copyright 2022-2024 ShunzDai
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+#ifndef CANDY_CORE_PEEPHOLE_H
+#define CANDY_CORE_PEEPHOLE_H
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include "core/candy_priv.h"
+#include "core/candy_proto.h"
+
+/* operands that name registers, see @ref candy_peephole_operands */
+#define CANDY_REG_A (1 << 0)
+#define CANDY_REG_B (1 << 1)
+#define CANDY_REG_C (1 << 2)
+
+/**
+  * @brief  rewrite the instructions of a finished prototype, nested
+  *         prototypes are left to their own call. level 0 keeps them as the
+  *         compiler emitted them, level 1 cleans up jumps, moves and dead
+  *         code and fuses the known pairs.
+  */
+int candy_peephole(candy_proto_t *proto, candy_gc_t *gc, candy_exce_t *ctx, int level);
+
+/**
+  * @brief  which operands of an instruction the compiler emits name
+  *         registers, a 'b' or 'c' one may still select a constant.
+  * @retval mask of CANDY_REG_A, CANDY_REG_B and CANDY_REG_C
+  */
+int candy_peephole_operands(candy_inst_t inst);
+
+/**
+  * @brief  the superinstruction of 'first' followed by 'second', 'first'
+  *         itself if the pair is not fused. a quickened first one is fused
+  *         by the vm, the compiler only emits the generic ones.
+  */
+candy_opcodes_t candy_peephole_fuse(candy_opcodes_t first, candy_opcodes_t second);
+
+/**
+  * @brief  the instruction a superinstruction starts with, any other
+  *         opcode is returned as it is.
+  */
+candy_opcodes_t candy_peephole_first(candy_opcodes_t op);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* CANDY_CORE_PEEPHOLE_H */
@@ -49,13 +49,18 @@ typedef struct candy_vector candy_vector_t;
 typedef struct candy_array candy_array_t;
 typedef struct candy_table candy_table_t;
 typedef struct candy_proto candy_proto_t;
+typedef struct candy_jit candy_jit_t;
+typedef struct candy_trace candy_trace_t;
 typedef struct candy_userdef candy_userdef_t;
 /* c-closure */
 typedef struct candy_cclosure candy_cclosure_t;
 /* script-closure */
 typedef struct candy_sclosure candy_sclosure_t;
+/* variable of an enclosing function captured by a closure */
+typedef struct candy_upval candy_upval_t;
 
 typedef struct candy_exce candy_exce_t;
+typedef struct candy_vm candy_vm_t;
 
 #ifdef __cplusplus
 }
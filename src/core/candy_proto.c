@@ -14,39 +14,270 @@
   * limitations under the License.
   */
 #include "core/candy_proto.h"
+#include "core/candy_jit.h"
+#include "core/candy_trace.h"
 #include "core/candy_object.h"
 #include "core/candy_vector.h"
+#include "core/candy_wrap.h"
 #include "core/candy_gc.h"
+#include "core/candy_print.h"
+#include "core/candy_exception.h"
 
 struct candy_proto {
   candy_object_t header;
-  size_t size_inst;
-  candy_inst_t *inst;
+  candy_object_t *gray;
+  uint8_t nparams;
+  uint8_t maxstack;
+  candy_vector_t inst;
+  candy_vector_t cnst;
+  candy_vector_t proto;
+  candy_vector_t upval;
+  candy_vector_t cache;
+  /* calls counted towards @ref CANDY_JIT_THRESHOLD */
+  uint32_t calls;
+  /* its closures never leave the frame creating them, see @ref candy_proto_is_framed */
+  bool framed;
+  /* the one closure of a framed prototype without upvalues */
+  candy_sclosure_t *closure;
+  candy_jit_t *jit;
+  candy_vector_t trace;
+  /* text of a body still to be compiled, see @ref candy_proto_set_source */
+  candy_array_t *source;
+  uint32_t line;
+  int level;
 };
 
 candy_proto_t *candy_proto_create(candy_gc_t *gc, candy_exce_t *ctx) {
   candy_proto_t *self = (candy_proto_t *)candy_gc_add(gc, ctx, CANDY_TYPE_PROTO, sizeof(struct candy_proto));
-  self->size_inst = 0;
-  // self->inst = (candy_inst_t *)candy_vector_data(cfg->inst);
-  self->inst = NULL;
+  self->gray = NULL;
+  self->nparams = 0;
+  self->maxstack = 0;
+  candy_vector_init(&self->inst, sizeof(candy_inst_t));
+  candy_vector_init(&self->cnst, sizeof(struct candy_wrap));
+  candy_vector_init(&self->proto, sizeof(candy_proto_t *));
+  candy_vector_init(&self->upval, sizeof(candy_upvaldesc_t));
+  candy_vector_init(&self->cache, sizeof(candy_cache_t));
+  self->calls = 0;
+  self->framed = false;
+  self->closure = NULL;
+  self->jit = NULL;
+  candy_vector_init(&self->trace, sizeof(candy_trace_t *));
+  self->source = NULL;
+  self->line = 0;
+  self->level = 0;
   return self;
 }
 
 int candy_proto_delete(candy_proto_t *self, candy_gc_t *gc) {
-  candy_gc_free(gc, self->inst, self->size_inst);
+  candy_vector_deinit(&self->inst, candy_gc_memory(gc));
+  candy_vector_deinit(&self->cnst, candy_gc_memory(gc));
+  candy_vector_deinit(&self->proto, candy_gc_memory(gc));
+  candy_vector_deinit(&self->upval, candy_gc_memory(gc));
+  candy_vector_deinit(&self->cache, candy_gc_memory(gc));
+  if (self->jit)
+    candy_jit_delete(self->jit, gc);
+  for (size_t idx = 0; idx < candy_vector_size(&self->trace); ++idx)
+    candy_trace_delete(candy_proto_get_trace(self, idx), gc);
+  candy_vector_deinit(&self->trace, candy_gc_memory(gc));
   candy_gc_free(gc, self, sizeof(struct candy_proto));
   return 0;
 }
 
 int candy_proto_colouring(candy_proto_t *self, candy_gc_t *gc) {
-  candy_object_set_mark((candy_object_t *)self, MARK_DARK);
+  self->gray = candy_gc_gray_swap(gc, (candy_object_t *)self);
+  candy_object_set_mark((candy_object_t *)self, MARK_GRAY);
   return 0;
 }
 
 int candy_proto_diffusion(candy_proto_t *self, candy_gc_t *gc) {
+  candy_gc_gray_swap(gc, self->gray);
+  candy_object_set_mark((candy_object_t *)self, MARK_DARK);
+  const candy_wrap_t *cnst = candy_proto_get_cnst(self);
+  for (size_t idx = 0; idx < candy_proto_get_size_cnst(self); ++idx)
+    candy_wrap_colouring(&cnst[idx], gc);
+  for (size_t idx = 0; idx < candy_proto_get_size_proto(self); ++idx)
+    candy_gc_colouring(gc, (candy_object_t *)candy_proto_get_proto(self, idx));
+  candy_gc_colouring(gc, (candy_object_t *)self->closure);
+  candy_gc_colouring(gc, (candy_object_t *)self->source);
   return 0;
 }
 
-candy_inst_t *candy_proto_get_inst(candy_proto_t *self) {
-  return self->inst;
+int candy_proto_add_inst(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, candy_inst_t inst) {
+  candy_vector_append(&self->inst, candy_gc_memory(gc), ctx, &inst, 1);
+  return (int)candy_vector_size(&self->inst) - 1;
+}
+
+int candy_proto_add_cnst(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, const candy_wrap_t *cnst) {
+  candy_vector_append(&self->cnst, candy_gc_memory(gc), ctx, cnst, 1);
+  return (int)candy_vector_size(&self->cnst) - 1;
+}
+
+void candy_proto_set_cnst(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, const candy_wrap_t *cnst, size_t size) {
+  candy_vector_resize(&self->cnst, NULL, NULL, 0);
+  candy_vector_reserve(&self->cnst, candy_gc_memory(gc), ctx, size);
+  candy_vector_append(&self->cnst, candy_gc_memory(gc), ctx, cnst, size);
+}
+
+int candy_proto_add_proto(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, candy_proto_t *proto) {
+  candy_vector_append(&self->proto, candy_gc_memory(gc), ctx, &proto, 1);
+  return (int)candy_vector_size(&self->proto) - 1;
+}
+
+int candy_proto_add_upval(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, bool instack, uint8_t idx) {
+  candy_upvaldesc_t desc = {
+    .instack = instack,
+    .idx = idx,
+  };
+  candy_vector_append(&self->upval, candy_gc_memory(gc), ctx, &desc, 1);
+  return (int)candy_vector_size(&self->upval) - 1;
+}
+
+int candy_proto_add_cache(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx) {
+  /* past the limit a cache index no longer fits its operand */
+  candy_assert(ctx, gc, candy_vector_size(&self->cache) < CANDY_CACHE_MAX, EXCE_ERR_SYNTAX, "too many globals in one function");
+  candy_vector_append(&self->cache, candy_gc_memory(gc), ctx, NULL, 1);
+  return (int)candy_vector_size(&self->cache) - 1;
+}
+
+int candy_proto_add_trace(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, candy_trace_t *trace) {
+  candy_vector_append(&self->trace, candy_gc_memory(gc), ctx, &trace, 1);
+  return (int)candy_vector_size(&self->trace) - 1;
+}
+
+candy_inst_t *candy_proto_get_inst(const candy_proto_t *self) {
+  return (candy_inst_t *)candy_vector_data(&self->inst);
+}
+
+size_t candy_proto_get_size_inst(const candy_proto_t *self) {
+  return candy_vector_size(&self->inst);
+}
+
+void candy_proto_set_size_inst(candy_proto_t *self, size_t size) {
+  candy_vector_resize(&self->inst, NULL, NULL, size);
+}
+
+const candy_wrap_t *candy_proto_get_cnst(const candy_proto_t *self) {
+  return (const candy_wrap_t *)candy_vector_data(&self->cnst);
+}
+
+size_t candy_proto_get_size_cnst(const candy_proto_t *self) {
+  return candy_vector_size(&self->cnst);
+}
+
+candy_proto_t *candy_proto_get_proto(const candy_proto_t *self, size_t idx) {
+  return ((candy_proto_t **)candy_vector_data(&self->proto))[idx];
+}
+
+size_t candy_proto_get_size_proto(const candy_proto_t *self) {
+  return candy_vector_size(&self->proto);
+}
+
+candy_upvaldesc_t *candy_proto_get_upval(const candy_proto_t *self) {
+  return (candy_upvaldesc_t *)candy_vector_data(&self->upval);
+}
+
+size_t candy_proto_get_size_upval(const candy_proto_t *self) {
+  return candy_vector_size(&self->upval);
+}
+
+candy_cache_t *candy_proto_get_cache(const candy_proto_t *self) {
+  return (candy_cache_t *)candy_vector_data(&self->cache);
+}
+
+size_t candy_proto_get_size_cache(const candy_proto_t *self) {
+  return candy_vector_size(&self->cache);
+}
+
+candy_trace_t *candy_proto_get_trace(const candy_proto_t *self, size_t idx) {
+  return ((candy_trace_t **)candy_vector_data(&self->trace))[idx];
+}
+
+size_t candy_proto_get_size_trace(const candy_proto_t *self) {
+  return candy_vector_size(&self->trace);
+}
+
+uint8_t candy_proto_get_nparams(const candy_proto_t *self) {
+  return self->nparams;
+}
+
+void candy_proto_set_nparams(candy_proto_t *self, uint8_t nparams) {
+  self->nparams = nparams;
+}
+
+uint8_t candy_proto_get_maxstack(const candy_proto_t *self) {
+  return self->maxstack;
+}
+
+void candy_proto_set_maxstack(candy_proto_t *self, uint8_t maxstack) {
+  self->maxstack = maxstack;
+}
+
+bool candy_proto_heat(candy_proto_t *self, uint32_t threshold) {
+  if (self->calls >= threshold)
+    return false;
+  return ++self->calls == threshold;
+}
+
+uint32_t candy_proto_get_calls(const candy_proto_t *self) {
+  return self->calls;
+}
+
+bool candy_proto_is_framed(const candy_proto_t *self) {
+  return self->framed;
+}
+
+void candy_proto_set_framed(candy_proto_t *self, bool framed) {
+  self->framed = framed;
+}
+
+candy_sclosure_t *candy_proto_get_closure(const candy_proto_t *self) {
+  return self->closure;
+}
+
+void candy_proto_set_closure(candy_proto_t *self, candy_sclosure_t *closure) {
+  self->closure = closure;
+}
+
+candy_jit_t *candy_proto_get_jit(const candy_proto_t *self) {
+  return self->jit;
+}
+
+void candy_proto_set_jit(candy_proto_t *self, candy_jit_t *jit) {
+  self->jit = jit;
+}
+
+candy_array_t *candy_proto_get_source(const candy_proto_t *self) {
+  return self->source;
+}
+
+uint32_t candy_proto_get_line(const candy_proto_t *self) {
+  return self->line;
+}
+
+int candy_proto_get_level(const candy_proto_t *self) {
+  return self->level;
+}
+
+void candy_proto_set_source(candy_proto_t *self, candy_array_t *source, uint32_t line, int level) {
+  self->source = source;
+  self->line = line;
+  self->level = level;
+}
+
+void candy_proto_swap_body(candy_proto_t *self, candy_proto_t *other) {
+  struct candy_proto tmp = *self;
+  self->nparams = other->nparams;
+  self->maxstack = other->maxstack;
+  self->inst = other->inst;
+  self->cnst = other->cnst;
+  self->proto = other->proto;
+  self->upval = other->upval;
+  self->cache = other->cache;
+  other->nparams = tmp.nparams;
+  other->maxstack = tmp.maxstack;
+  other->inst = tmp.inst;
+  other->cnst = tmp.cnst;
+  other->proto = tmp.proto;
+  other->upval = tmp.upval;
+  other->cache = tmp.cache;
 }
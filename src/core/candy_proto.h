@@ -24,8 +24,12 @@ extern "C" {
 typedef enum candy_opcodes {
   #define CANDY_OP_ENUM
   #include "core/candy_opcode.list"
+  OP_NUM,
 } candy_opcodes_t;
 
+/* number of opcodes the 6-bit 'op' field can hold */
+#define CANDY_OPCODE_MAX 64
+
 typedef union candy_inst {
   struct {
     uint32_t op :  6;
@@ -48,11 +52,57 @@ typedef union candy_inst {
   } iabc;
 } candy_inst_t;
 
-typedef struct candy_proto_config candy_proto_config_t;
+/**
+  * @brief  the highest bit of a 9-bit 'b'/'c' operand selects the constant
+  *         pool instead of the register window, see @ref candy_inst_rk
+  */
+#define CANDY_INST_RK_BIT   0x100U
+#define CANDY_INST_RK_MAX   0x0FFU
+#define CANDY_INST_SBX_BIAS 0x1FFFF
+
+static inline bool candy_inst_is_k(uint32_t rk) {
+  return rk & CANDY_INST_RK_BIT;
+}
+
+static inline uint32_t candy_inst_get_k(uint32_t rk) {
+  return rk & ~CANDY_INST_RK_BIT;
+}
 
-struct candy_proto_config {
-  const candy_vector_t *inst;
-};
+static inline uint32_t candy_inst_rk(uint32_t idx) {
+  return idx | CANDY_INST_RK_BIT;
+}
+
+static inline int32_t candy_inst_get_sbx(candy_inst_t inst) {
+  return (int32_t)inst.iabx.b - CANDY_INST_SBX_BIAS;
+}
+
+static inline const char *candy_opcode_str(candy_opcodes_t op) {
+  return (const char *[]) {
+    #define CANDY_OP_STR
+    #include "core/candy_opcode.list"
+  }[op];
+}
+
+/**
+  * @brief  inline cache of a global lookup, the value is valid while the
+  *         version of the globals table is unchanged and the name is the
+  *         one it was looked up with
+  */
+typedef struct candy_cache {
+  const candy_wrap_t *val;
+  const candy_object_t *key;
+  uint32_t version;
+} candy_cache_t;
+
+/* caches a prototype can have, the 9-bit 'b' operand of GETTABUP addresses them */
+#define CANDY_CACHE_MAX 0x200U
+
+/* where a new closure takes one of its upvalues from */
+typedef struct candy_upvaldesc {
+  /* a register of the enclosing frame, or else an upvalue of its closure */
+  bool instack;
+  uint8_t idx;
+} candy_upvaldesc_t;
 
 candy_proto_t *candy_proto_create(candy_gc_t *gc, candy_exce_t *ctx);
 
@@ -62,9 +112,10 @@ int candy_proto_colouring(candy_proto_t *self, candy_gc_t *gc);
 
 int candy_proto_diffusion(candy_proto_t *self, candy_gc_t *gc);
 
-static inline void candy_proto_add_iax(candy_proto_t *self, candy_opcodes_t op, uint32_t a) {
-  int candy_proto_add_inst(candy_proto_t *self, candy_inst_t inst);
-  candy_proto_add_inst(self, (candy_inst_t) {
+int candy_proto_add_inst(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, candy_inst_t inst);
+
+static inline int candy_proto_add_iax(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, candy_opcodes_t op, uint32_t a) {
+  return candy_proto_add_inst(self, gc, ctx, (candy_inst_t) {
     .iax = {
       .op = (uint32_t)op,
       .a = a,
@@ -72,9 +123,8 @@ static inline void candy_proto_add_iax(candy_proto_t *self, candy_opcodes_t op,
   });
 }
 
-static inline void candy_proto_add_iabx(candy_proto_t *self, candy_opcodes_t op, uint32_t a, uint32_t b) {
-  int candy_proto_add_inst(candy_proto_t *self, candy_inst_t inst);
-  candy_proto_add_inst(self, (candy_inst_t) {
+static inline int candy_proto_add_iabx(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, candy_opcodes_t op, uint32_t a, uint32_t b) {
+  return candy_proto_add_inst(self, gc, ctx, (candy_inst_t) {
     .iabx = {
       .op = (uint32_t)op,
       .a = a,
@@ -83,9 +133,12 @@ static inline void candy_proto_add_iabx(candy_proto_t *self, candy_opcodes_t op,
   });
 }
 
-static inline void candy_proto_add_iabc(candy_proto_t *self, candy_opcodes_t op, uint32_t a, uint32_t b, uint32_t c) {
-  int candy_proto_add_inst(candy_proto_t *self, candy_inst_t inst);
-  candy_proto_add_inst(self, (candy_inst_t) {
+static inline int candy_proto_add_iasbx(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, candy_opcodes_t op, uint32_t a, int32_t b) {
+  return candy_proto_add_iabx(self, gc, ctx, op, a, (uint32_t)(b + CANDY_INST_SBX_BIAS));
+}
+
+static inline int candy_proto_add_iabc(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, candy_opcodes_t op, uint32_t a, uint32_t b, uint32_t c) {
+  return candy_proto_add_inst(self, gc, ctx, (candy_inst_t) {
     .iabc = {
       .op = (uint32_t)op,
       .a = a,
@@ -95,7 +148,121 @@ static inline void candy_proto_add_iabc(candy_proto_t *self, candy_opcodes_t op,
   });
 }
 
-candy_inst_t *candy_proto_get_inst(candy_proto_t *self);
+/**
+  * @brief  append a constant to the pool
+  * @retval index of the constant
+  */
+int candy_proto_add_cnst(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, const candy_wrap_t *cnst);
+
+/* replace the constant pool, allocated once and exactly 'size' long */
+void candy_proto_set_cnst(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, const candy_wrap_t *cnst, size_t size);
+
+/**
+  * @brief  append a nested function prototype
+  * @retval index of the prototype
+  */
+int candy_proto_add_proto(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, candy_proto_t *proto);
+
+/**
+  * @brief  append the descriptor of an upvalue
+  * @retval index of the upvalue
+  */
+int candy_proto_add_upval(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, bool instack, uint8_t idx);
+
+/**
+  * @brief  append an empty inline cache
+  * @retval index of the cache
+  */
+int candy_proto_add_cache(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx);
+
+/**
+  * @brief  append the compiled trace of a loop
+  * @retval index of the trace
+  */
+int candy_proto_add_trace(candy_proto_t *self, candy_gc_t *gc, candy_exce_t *ctx, candy_trace_t *trace);
+
+candy_inst_t *candy_proto_get_inst(const candy_proto_t *self);
+
+size_t candy_proto_get_size_inst(const candy_proto_t *self);
+
+/* drop the instructions from 'size' on, the storage is kept */
+void candy_proto_set_size_inst(candy_proto_t *self, size_t size);
+
+const candy_wrap_t *candy_proto_get_cnst(const candy_proto_t *self);
+
+size_t candy_proto_get_size_cnst(const candy_proto_t *self);
+
+candy_proto_t *candy_proto_get_proto(const candy_proto_t *self, size_t idx);
+
+size_t candy_proto_get_size_proto(const candy_proto_t *self);
+
+candy_upvaldesc_t *candy_proto_get_upval(const candy_proto_t *self);
+
+size_t candy_proto_get_size_upval(const candy_proto_t *self);
+
+candy_cache_t *candy_proto_get_cache(const candy_proto_t *self);
+
+size_t candy_proto_get_size_cache(const candy_proto_t *self);
+
+candy_trace_t *candy_proto_get_trace(const candy_proto_t *self, size_t idx);
+
+size_t candy_proto_get_size_trace(const candy_proto_t *self);
+
+uint8_t candy_proto_get_nparams(const candy_proto_t *self);
+
+void candy_proto_set_nparams(candy_proto_t *self, uint8_t nparams);
+
+uint8_t candy_proto_get_maxstack(const candy_proto_t *self);
+
+void candy_proto_set_maxstack(candy_proto_t *self, uint8_t maxstack);
+
+/**
+  * @brief  count a call of the prototype
+  * @retval true only for the call that reaches the threshold
+  */
+bool candy_proto_heat(candy_proto_t *self, uint32_t threshold);
+
+/* calls of the prototype so far */
+uint32_t candy_proto_get_calls(const candy_proto_t *self);
+
+/**
+  * @brief  whether the parser has proven that no closure of the prototype
+  *         is ever stored, returned, captured or compared, so it is only
+  *         called while the frame creating it runs and its identity is
+  *         never seen
+  */
+bool candy_proto_is_framed(const candy_proto_t *self);
+
+void candy_proto_set_framed(candy_proto_t *self, bool framed);
+
+/* the closure every frame shares if the prototype is framed and has no upvalues */
+candy_sclosure_t *candy_proto_get_closure(const candy_proto_t *self);
+
+void candy_proto_set_closure(candy_proto_t *self, candy_sclosure_t *closure);
+
+candy_jit_t *candy_proto_get_jit(const candy_proto_t *self);
+
+void candy_proto_set_jit(candy_proto_t *self, candy_jit_t *jit);
+
+/**
+  * @brief  the text of a body that is only compiled on the first call,
+  *         from '(' to its 'end', NULL once it has been compiled
+  */
+candy_array_t *candy_proto_get_source(const candy_proto_t *self);
+
+/* line the source starts at */
+uint32_t candy_proto_get_line(const candy_proto_t *self);
+
+/* optimization level the source is compiled with, see @ref candy_peephole */
+int candy_proto_get_level(const candy_proto_t *self);
+
+void candy_proto_set_source(candy_proto_t *self, candy_array_t *source, uint32_t line, int level);
+
+/**
+  * @brief  exchange the parameters, instructions, constants, nested
+  *         prototypes, upvalues and caches, the identity stays in place
+  */
+void candy_proto_swap_body(candy_proto_t *self, candy_proto_t *other);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,214 @@
+/**
+  * Copyright 2022-2024 ShunzDai
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+#include "core/candy_scan.h"
+#include "core/candy_lib.h"
+
+#if CANDY_SCAN_X64
+#include <immintrin.h>
+#endif
+
+typedef struct candy_scan_ops {
+  size_t (*space)(const char *, size_t);
+  size_t (*alnum)(const char *, size_t);
+  size_t (*line)(const char *, size_t);
+  size_t (*string)(const char *, size_t, char);
+} candy_scan_ops_t;
+
+static size_t _scalar_space(const char *str, size_t size) {
+  size_t n = 0;
+  while (n < size && (str[n] == ' ' || str[n] == '\t' || str[n] == '\v' || str[n] == '\f'))
+    ++n;
+  return n;
+}
+
+static size_t _scalar_alnum(const char *str, size_t size) {
+  size_t n = 0;
+  while (n < size && is_alnum(str[n]))
+    ++n;
+  return n;
+}
+
+static size_t _scalar_line(const char *str, size_t size) {
+  size_t n = 0;
+  while (n < size && str[n] != '\r' && str[n] != '\n' && str[n] != '\0')
+    ++n;
+  return n;
+}
+
+static size_t _scalar_string(const char *str, size_t size, char del) {
+  size_t n = 0;
+  while (n < size && str[n] != del && str[n] != '\\' && str[n] != '\r' && str[n] != '\n' && str[n] != '\0')
+    ++n;
+  return n;
+}
+
+static const candy_scan_ops_t _scalar = {_scalar_space, _scalar_alnum, _scalar_line, _scalar_string};
+
+#if CANDY_SCAN_X64
+/**
+  * @brief  the loop every vector kernel shares, '_stop' is the mask of the
+  *         bytes in 'v' the run ends at, the tail shorter than a vector is
+  *         left to '_tail' so that nothing past 'size' is loaded.
+  */
+#define SCAN_VECTORS(_type, _load, _stop, _tail) \
+  const char *p = str, *end = str + size; \
+  for (; p + sizeof(_type) <= end; p += sizeof(_type)) { \
+    _type v = _load((const _type *)p); \
+    uint32_t mask = (uint32_t)(_stop); \
+    if (mask) \
+      return p - str + __builtin_ctz(mask); \
+  } \
+  return p - str + (_tail)
+
+/* bytes of 'v' from 'lo' to 'lo + n' */
+static inline __m128i _sse2_range(__m128i v, char lo, char n) {
+  __m128i x = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+  return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(n)), x);
+}
+
+static inline __m128i _sse2_is(__m128i v, char ch) {
+  return _mm_cmpeq_epi8(v, _mm_set1_epi8(ch));
+}
+
+static inline __m128i _sse2_eol(__m128i v) {
+  return _mm_or_si128(_mm_or_si128(_sse2_is(v, '\r'), _sse2_is(v, '\n')), _sse2_is(v, '\0'));
+}
+
+static size_t _sse2_space(const char *str, size_t size) {
+  SCAN_VECTORS(__m128i, _mm_loadu_si128,
+    ~_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_sse2_is(v, ' '), _sse2_is(v, '\t')), _sse2_range(v, '\v', '\f' - '\v'))) & 0xFFFF,
+    _scalar_space(p, end - p)
+  );
+}
+
+static size_t _sse2_alnum(const char *str, size_t size) {
+  /* setting 0x20 folds the upper case letters onto the lower */
+  SCAN_VECTORS(__m128i, _mm_loadu_si128,
+    ~_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_sse2_range(v, '0', 9), _sse2_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 25)), _sse2_is(v, '_'))) & 0xFFFF,
+    _scalar_alnum(p, end - p)
+  );
+}
+
+static size_t _sse2_line(const char *str, size_t size) {
+  SCAN_VECTORS(__m128i, _mm_loadu_si128,
+    _mm_movemask_epi8(_sse2_eol(v)),
+    _scalar_line(p, end - p)
+  );
+}
+
+static size_t _sse2_string(const char *str, size_t size, char del) {
+  SCAN_VECTORS(__m128i, _mm_loadu_si128,
+    _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_sse2_is(v, del), _sse2_is(v, '\\')), _sse2_eol(v))),
+    _scalar_string(p, end - p, del)
+  );
+}
+
+static const candy_scan_ops_t _sse2 = {_sse2_space, _sse2_alnum, _sse2_line, _sse2_string};
+
+/* the same kernels 32 bytes at a time, only called once the cpu says it has avx2 */
+#define CANDY_AVX2 __attribute__((target("avx2")))
+
+CANDY_AVX2 static inline __m256i _avx2_range(__m256i v, char lo, char n) {
+  __m256i x = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(n)), x);
+}
+
+CANDY_AVX2 static inline __m256i _avx2_is(__m256i v, char ch) {
+  return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(ch));
+}
+
+CANDY_AVX2 static inline __m256i _avx2_eol(__m256i v) {
+  return _mm256_or_si256(_mm256_or_si256(_avx2_is(v, '\r'), _avx2_is(v, '\n')), _avx2_is(v, '\0'));
+}
+
+CANDY_AVX2 static size_t _avx2_space(const char *str, size_t size) {
+  SCAN_VECTORS(__m256i, _mm256_loadu_si256,
+    ~_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_avx2_is(v, ' '), _avx2_is(v, '\t')), _avx2_range(v, '\v', '\f' - '\v'))),
+    _sse2_space(p, end - p)
+  );
+}
+
+CANDY_AVX2 static size_t _avx2_alnum(const char *str, size_t size) {
+  SCAN_VECTORS(__m256i, _mm256_loadu_si256,
+    ~_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_avx2_range(v, '0', 9), _avx2_range(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 25)), _avx2_is(v, '_'))),
+    _sse2_alnum(p, end - p)
+  );
+}
+
+CANDY_AVX2 static size_t _avx2_line(const char *str, size_t size) {
+  SCAN_VECTORS(__m256i, _mm256_loadu_si256,
+    _mm256_movemask_epi8(_avx2_eol(v)),
+    _sse2_line(p, end - p)
+  );
+}
+
+CANDY_AVX2 static size_t _avx2_string(const char *str, size_t size, char del) {
+  SCAN_VECTORS(__m256i, _mm256_loadu_si256,
+    _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_avx2_is(v, del), _avx2_is(v, '\\')), _avx2_eol(v))),
+    _sse2_string(p, end - p, del)
+  );
+}
+
+static const candy_scan_ops_t _avx2 = {_avx2_space, _avx2_alnum, _avx2_line, _avx2_string};
+#endif /* CANDY_SCAN_X64 */
+
+/* chosen on the first scan, sse2 is part of every x86-64 */
+static const candy_scan_ops_t *_ops = NULL;
+
+static const candy_scan_ops_t *_select(candy_scan_isa_t isa) {
+  switch (isa) {
+#if CANDY_SCAN_X64
+    case SCAN_AVX2:
+      return __builtin_cpu_supports("avx2") ? &_avx2 : NULL;
+    case SCAN_SSE2:
+      return &_sse2;
+#endif /* CANDY_SCAN_X64 */
+    case SCAN_SCALAR:
+      return &_scalar;
+    default:
+      return NULL;
+  }
+}
+
+static inline const candy_scan_ops_t *_kernels(void) {
+  /* the widest the cpu runs, the scalar ones are always there */
+  for (int isa = SCAN_AVX2; _ops == NULL; --isa)
+    _ops = _select(isa);
+  return _ops;
+}
+
+bool candy_scan_use(candy_scan_isa_t isa) {
+  const candy_scan_ops_t *ops = _select(isa);
+  if (ops)
+    _ops = ops;
+  return ops != NULL;
+}
+
+size_t candy_scan_space(const char *str, size_t size) {
+  return _kernels()->space(str, size);
+}
+
+size_t candy_scan_alnum(const char *str, size_t size) {
+  return _kernels()->alnum(str, size);
+}
+
+size_t candy_scan_line(const char *str, size_t size) {
+  return _kernels()->line(str, size);
+}
+
+size_t candy_scan_string(const char *str, size_t size, char del) {
+  return _kernels()->string(str, size, del);
+}
@@ -0,0 +1,59 @@
+/**
+  * Copyright 2022-2024 ShunzDai
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+#ifndef CANDY_CORE_SCAN_H
+#define CANDY_CORE_SCAN_H
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include "core/candy_priv.h"
+
+/* vector kernels need the intrinsics of gcc or clang on x86-64 */
+#if CANDY_SIMD && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CANDY_SCAN_X64 1
+#else
+#define CANDY_SCAN_X64 0
+#endif
+
+typedef enum candy_scan_isa {
+  SCAN_SCALAR,
+  SCAN_SSE2,
+  SCAN_AVX2,
+} candy_scan_isa_t;
+
+/**
+  * @brief  pick the kernels of 'isa' instead of the best the cpu runs,
+  *         meant for tests and benchmarks.
+  * @retval false if the cpu or the build lacks them, nothing changes then
+  */
+bool candy_scan_use(candy_scan_isa_t isa);
+
+/* length of the run of ' ', '\t', '\v' and '\f' at the start of 'str' */
+size_t candy_scan_space(const char *str, size_t size);
+
+/* length of the run of letters, digits and '_' at the start of 'str' */
+size_t candy_scan_alnum(const char *str, size_t size);
+
+/* bytes before the first '\r', '\n' or '\0' */
+size_t candy_scan_line(const char *str, size_t size);
+
+/* bytes before the first 'del', '\\', '\r', '\n' or '\0' */
+size_t candy_scan_string(const char *str, size_t size, char del);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* CANDY_CORE_SCAN_H */
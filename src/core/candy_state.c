@@ -18,6 +18,8 @@
 #include "core/candy_exception.h"
 #include "core/candy_gc.h"
 #include "core/candy_array.h"
+#include "core/candy_table.h"
+#include "core/candy_closure.h"
 #include "core/candy_parser.h"
 #include "core/candy_vm.h"
 #include <string.h>
@@ -30,6 +32,12 @@ struct candy_state {
   candy_vm_t vm;
   candy_gc_t *gc;
   candy_object_t *gray;
+  /* what scripts are compiled with, see @ref candy_peephole */
+  int optimize;
+  /* see @ref candy_set_lazy */
+  bool lazy;
+  /* memory in use after the last collection, see @ref _collect */
+  size_t collected;
 };
 
 struct candy_primary {
@@ -48,15 +56,20 @@ static size_t candy_state_size(candy_state_t *self) {
   return candy_state_is_main(self) ? sizeof(struct candy_primary) : sizeof(struct candy_state);
 }
 
-static int candy_state_init(candy_state_t *self, candy_gc_t *gc) {
+static int candy_state_init(candy_state_t *self, candy_gc_t *gc, candy_table_t *glb) {
   self->gc = gc;
   self->gray = NULL;
-  candy_vm_init(&self->vm);
+  self->optimize = 1;
+  self->lazy = false;
+  self->collected = 0;
+  candy_exce_init(&self->ctx);
+  candy_vm_init(&self->vm, self, gc, glb);
   return 0;
 }
 
 static int candy_state_deinit(candy_state_t *self) {
   candy_vm_deinit(&self->vm, self->gc);
+  candy_exce_deinit(&self->ctx);
   return 0;
 }
 
@@ -69,7 +82,9 @@ static void protect_create(struct protect_create_arg *arg) {
   memcpy(&p->gc, arg->gc, sizeof(struct candy_gc));
   candy_gc_move(&p->gc, GC_MV_MAIN);
   arg->co = &p->co;
-  candy_state_init(arg->co, &p->gc);
+  candy_state_init(arg->co, &p->gc, NULL);
+  /* the globals are created after the main state so that they are never the main object */
+  arg->co->vm.glb = candy_table_create(&p->gc, arg->ctx);
 }
 
 candy_state_t *candy_state_create(candy_gc_t *gc) {
@@ -89,7 +104,7 @@ candy_state_t *candy_state_create(candy_gc_t *gc) {
 
 candy_state_t *candy_state_create_coroutine(candy_state_t *self) {
   candy_state_t *co = (candy_state_t *)candy_gc_add(self->gc, &self->ctx, CANDY_TYPE_STATE, sizeof(struct candy_state));
-  candy_state_init(co, self->gc);
+  candy_state_init(co, self->gc, self->vm.glb);
   return co;
 }
 
@@ -115,23 +130,65 @@ int candy_state_colouring(candy_state_t *self, candy_gc_t *gc) {
 int candy_state_diffusion(candy_state_t *self, candy_gc_t *gc) {
   candy_gc_gray_swap(gc, self->gray);
   candy_object_set_mark((candy_object_t *)self, MARK_DARK);
+  candy_vm_diffusion(&self->vm, gc);
   return 0;
 }
 
+/**
+  * @brief  collect once a script is done, a suspended one only once the
+  *         memory in use has doubled since the last collection
+  */
+static void _collect(candy_state_t *self) {
+  if (candy_vm_is_suspended(&self->vm) && candy_memory_used(candy_gc_memory(self->gc)) < self->collected * 2)
+    return;
+  candy_gc_full(self->gc);
+  self->collected = candy_memory_used(candy_gc_memory(self->gc));
+}
+
 int candy_state_dostream(candy_state_t *self, candy_reader_t reader, void *arg) {
-  candy_exce_init(&self->ctx);
-  candy_object_t *out = candy_parse(self->gc, &self->ctx, reader, arg);
-  if (candy_object_get_type(out) == CANDY_TYPE_CHAR)
+  candy_object_t *msg = NULL;
+  candy_err_t err = EXCE_OK;
+  candy_object_t *out = candy_parse(self->gc, &self->ctx, self->optimize, self->lazy, reader, arg);
+  if (candy_object_get_type(out) == CANDY_TYPE_SCLSR) {
+    err = candy_vm_execute(&self->vm, (candy_sclosure_t *)out, &msg);
+  }
+  else {
+    msg = out;
+    err = EXCE_ERR_SYNTAX;
+  }
+  if (msg != NULL)
     printf("%.*s\n",
-      (int)candy_array_size((candy_array_t *)out),
-      (char *)candy_array_data((candy_array_t *)out)
+      (int)candy_array_size((candy_array_t *)msg),
+      (char *)candy_array_data((candy_array_t *)msg)
     );
-  // candy_vm_execute(&self->vm, out);
-  candy_gc_full(self->gc);
-  candy_exce_deinit(&self->ctx);
-  return 0;
+  _collect(self);
+  return err;
+}
+
+int candy_state_resume(candy_state_t *self) {
+  candy_object_t *msg = NULL;
+  candy_err_t err = candy_vm_resume(&self->vm, &msg);
+  if (msg != NULL)
+    printf("%.*s\n",
+      (int)candy_array_size((candy_array_t *)msg),
+      (char *)candy_array_data((candy_array_t *)msg)
+    );
+  _collect(self);
+  return err;
 }
 
 bool candy_state_is_main(candy_state_t *self) {
   return candy_gc_main(self->gc) == (candy_object_t *)self;
 }
+
+candy_vm_t *candy_state_vm(candy_state_t *self) {
+  return &self->vm;
+}
+
+void candy_state_set_optimize(candy_state_t *self, int level) {
+  self->optimize = level;
+}
+
+void candy_state_set_lazy(candy_state_t *self, bool lazy) {
+  self->lazy = lazy;
+}
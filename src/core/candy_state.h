@@ -35,10 +35,18 @@ int candy_state_diffusion(candy_state_t *self, candy_gc_t *gc);
 
 int candy_state_dostream(candy_state_t *self, candy_reader_t reader, void *arg);
 
+int candy_state_resume(candy_state_t *self);
+
 bool candy_state_is_main(candy_state_t *self);
 
 candy_types_t candy_state_get_type(candy_state_t *self, size_t pos);
 
+candy_vm_t *candy_state_vm(candy_state_t *self);
+
+void candy_state_set_optimize(candy_state_t *self, int level);
+
+void candy_state_set_lazy(candy_state_t *self, bool lazy);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -19,6 +19,7 @@
 #include "core/candy_wrap.h"
 #include "core/candy_vector.h"
 #include "core/candy_gc.h"
+#include "core/candy_array.h"
 #include <string.h>
 
 typedef struct candy_pair candy_pair_t;
@@ -28,11 +29,6 @@ struct candy_pair {
   candy_wrap_t val;
 };
 
-struct candy_table {
-  candy_object_t header;
-  candy_vector_t vec;
-};
-
 static  size_t _capacity(const candy_vector_t *self) {
   return candy_vector_capacity(self);
 }
@@ -62,12 +58,21 @@ static inline bool _boundary_check(const candy_vector_t *self, candy_pair_t *pai
 // }
 
 static size_t _hash(const candy_wrap_t *key) {
+  if (candy_wrap_is_string(key)) {
+    const candy_array_t *str = (const candy_array_t *)candy_wrap_get_object(key);
+    return djb_hash((const char *)candy_array_data(str), candy_array_size(str));
+  }
   switch (candy_wrap_get_type(key)) {
+    case CANDY_TYPE_BOOLEAN:
+      return candy_wrap_get_boolean(key);
     case CANDY_TYPE_INTEGER:
+    case CANDY_TYPE_FLOAT:
+    case CANDY_TYPE_CFUNC:
+    case CANDY_TYPE_CFAST:
       return djb_hash(candy_wrap_data(key), 8);
-    case CANDY_TYPE_CHAR:
-      return 0;
     default:
+      if (candy_wrap_is_object(key))
+        return (size_t)candy_wrap_get_object(key) >> 3;
       return 0;
   }
 }
@@ -77,36 +82,58 @@ static inline candy_pair_t *_main_position(const candy_vector_t *self, const can
 }
 
 static bool _equal(const candy_wrap_t *keyl, const candy_wrap_t *keyr) {
-  if (keyl->type != keyr->type)
+  if (keyl->type != keyr->type || keyl->mask != keyr->mask)
     return false;
+  if (candy_wrap_is_string(keyl)) {
+    const candy_array_t *strl = (const candy_array_t *)candy_wrap_get_object(keyl);
+    const candy_array_t *strr = (const candy_array_t *)candy_wrap_get_object(keyr);
+    return strl == strr || (candy_array_size(strl) == candy_array_size(strr) &&
+      memcmp(candy_array_data(strl), candy_array_data(strr), candy_array_size(strl)) == 0);
+  }
   switch (candy_wrap_get_type(keyl)) {
+    case CANDY_TYPE_BOOLEAN:
+      return candy_wrap_get_boolean(keyl) == candy_wrap_get_boolean(keyr);
     case CANDY_TYPE_INTEGER:
       return candy_wrap_get_integer(keyl) == candy_wrap_get_integer(keyr);
     case CANDY_TYPE_FLOAT:
       return candy_wrap_get_float(keyl) == candy_wrap_get_float(keyr);
+    case CANDY_TYPE_CFUNC:
+      return candy_wrap_get_cfunc(keyl) == candy_wrap_get_cfunc(keyr);
+    case CANDY_TYPE_CFAST:
+      return candy_wrap_get_fast(keyl) == candy_wrap_get_fast(keyr);
     default:
-      return false;
+      return candy_wrap_is_object(keyl) && candy_wrap_get_object(keyl) == candy_wrap_get_object(keyr);
   }
 }
 
+/**
+  * @retval 1 if the key has been added, 0 if it was present, -1 if there is
+  *         no free pair along the probe sequence
+  */
 static int _set(const candy_vector_t *self, const candy_wrap_t *key, const candy_wrap_t *val) {
   candy_pair_t *pair = _main_position(self, key);
   for (size_t idx = 0; _boundary_check(self, pair); pair += _next(++idx)) {
     switch (candy_wrap_get_type(&pair->key)) {
       case CANDY_TYPE_NULL:
         pair->key = *key;
-        break;
+        pair->val = *val;
+        return 1;
       default:
-        if (_equal(&pair->key, key))
-          break;
-        continue;
+        if (!_equal(&pair->key, key))
+          continue;
+        pair->val = *val;
+        return 0;
     }
-    pair->val = *val;
-    return 0;
   }
   return -1;
 }
 
+static inline void _update_version(candy_table_t *self) {
+  /* zero is reserved for caches which have never been filled */
+  if (++self->version == 0)
+    self->version = 1;
+}
+
 static int _resize(candy_table_t *self, candy_gc_t *gc, candy_exce_t *ctx) {
   candy_vector_t vec;
   candy_vector_init(&vec, sizeof(struct candy_wrap[2]));
@@ -128,6 +155,8 @@ static int _resize(candy_table_t *self, candy_gc_t *gc, candy_exce_t *ctx) {
 
 candy_table_t *candy_table_create(candy_gc_t *gc, candy_exce_t *ctx) {
   candy_table_t *self = (candy_table_t *)candy_gc_add(gc, ctx, CANDY_TYPE_TABLE, sizeof(struct candy_table));
+  self->gray = NULL;
+  self->version = 1;
   candy_vector_init(&self->vec, sizeof(struct candy_wrap[2]));
   candy_vector_reserve(&self->vec, candy_gc_memory(gc), ctx, 8);
   memset(_head(&self->vec), 0, sizeof(struct candy_wrap[2]) * _capacity(&self->vec));
@@ -140,6 +169,22 @@ int candy_table_delete(candy_table_t *self, candy_gc_t *gc) {
   return 0;
 }
 
+int candy_table_colouring(candy_table_t *self, candy_gc_t *gc) {
+  self->gray = candy_gc_gray_swap(gc, (candy_object_t *)self);
+  candy_object_set_mark((candy_object_t *)self, MARK_GRAY);
+  return 0;
+}
+
+int candy_table_diffusion(candy_table_t *self, candy_gc_t *gc) {
+  candy_gc_gray_swap(gc, self->gray);
+  candy_object_set_mark((candy_object_t *)self, MARK_DARK);
+  for (candy_pair_t *pair = _head(&self->vec); pair <= _tail(&self->vec); ++pair) {
+    candy_wrap_colouring(&pair->key, gc);
+    candy_wrap_colouring(&pair->val, gc);
+  }
+  return 0;
+}
+
 int candy_table_fprint(const candy_table_t *self, FILE *out) {
   fprintf(out, "\033[1;35m>>> table %p head\033[0m\n", self);
   fprintf(out, "pos  key-type         key-val  val-type         val-val\n");
@@ -167,7 +212,12 @@ const candy_wrap_t *candy_table_get(const candy_table_t *self, const candy_wrap_
 }
 
 int candy_table_set(candy_table_t *self, candy_gc_t *gc, candy_exce_t *ctx, const candy_wrap_t *key, const candy_wrap_t *val) {
-  while (_set(&self->vec, key, val) < 0)
+  int res;
+  while ((res = _set(&self->vec, key, val)) < 0) {
     _resize(self, gc, ctx);
+    _update_version(self);
+  }
+  if (res > 0)
+    _update_version(self);
   return 0;
 }
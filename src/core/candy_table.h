@@ -19,15 +19,36 @@
 extern "C" {
 #endif /* __cplusplus */
 
+#include "core/candy_object.h"
+#include "core/candy_vector.h"
 #include "core/candy_priv.h"
 
+struct candy_table {
+  candy_object_t header;
+  candy_object_t *gray;
+  candy_vector_t vec;
+  /* changes whenever a key is added or the pairs are moved */
+  uint32_t version;
+};
+
 candy_table_t *candy_table_create(candy_gc_t *gc, candy_exce_t *ctx);
 int candy_table_delete(candy_table_t *self, candy_gc_t *gc);
 
+int candy_table_colouring(candy_table_t *self, candy_gc_t *gc);
+int candy_table_diffusion(candy_table_t *self, candy_gc_t *gc);
+
 int candy_table_fprint(const candy_table_t *self, FILE *out);
 const candy_wrap_t *candy_table_get(const candy_table_t *self, const candy_wrap_t *key);
 int candy_table_set(candy_table_t *self, candy_gc_t *gc, candy_exce_t *ctx, const candy_wrap_t *key, const candy_wrap_t *val);
 
+/**
+  * @brief  a value returned by @ref candy_table_get stays at the same address
+  *         as long as the version is unchanged, it is never zero.
+  */
+static inline uint32_t candy_table_version(const candy_table_t *self) {
+  return self->version;
+}
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
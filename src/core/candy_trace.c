@@ -0,0 +1,341 @@
+/**
+  * Copyright 2022-2024 ShunzDai
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+#include "core/candy_trace.h"
+#include "core/candy_peephole.h"
+#include "core/candy_vector.h"
+#include "core/candy_memory.h"
+#include "core/candy_table.h"
+#include "core/candy_wrap.h"
+#include "core/candy_jit.h"
+#include "core/candy_gc.h"
+#include <string.h>
+
+struct candy_trace {
+  uint32_t header;
+  bool stable;
+  candy_vector_t steps;
+  candy_vector_t guards;
+  candy_jit_t *jit;
+};
+
+typedef struct trace_recorder {
+  candy_trace_t *trace;
+  /* the registers of the frame as one iteration leaves them */
+  candy_wrap_t *regs;
+  /* registers that have been guarded or written */
+  bool *seen;
+  size_t nregs;
+  const candy_wrap_t *cnst;
+  candy_cache_t *caches;
+  const candy_table_t *glb;
+  candy_memory_t *mem;
+  candy_exce_t *ctx;
+} trace_recorder_t;
+
+static inline uint16_t _tags(const candy_wrap_t *wrap) {
+  return candy_trace_tags(candy_wrap_get_type(wrap), candy_wrap_get_mask(wrap));
+}
+
+/* the quickened forms are recorded as the instruction they came from */
+static candy_opcodes_t _generic(candy_opcodes_t op) {
+  switch (op = candy_peephole_first(op)) {
+    case OP_ADDII: case OP_ADDFF: return OP_ADD;
+    case OP_SUBII: case OP_SUBFF: return OP_SUB;
+    case OP_MULII: case OP_MULFF: return OP_MUL;
+    case OP_EQII:                 return OP_EQ;
+    case OP_LTII:  case OP_LTFF:  return OP_LT;
+    case OP_LEII:  case OP_LEFF:  return OP_LE;
+    case OP_JFORLOOP:
+    case OP_IFORLOOP:             return OP_FORLOOP;
+    default:                      return op;
+  }
+}
+
+/* a register is guarded the first time it is read before being written */
+static const candy_wrap_t *_read(trace_recorder_t *self, uint32_t rk) {
+  if (candy_inst_is_k(rk))
+    return &self->cnst[candy_inst_get_k(rk)];
+  if (rk >= self->nregs)
+    return NULL;
+  if (!self->seen[rk]) {
+    candy_trace_guard_t guard = {rk, _tags(&self->regs[rk])};
+    candy_vector_append(&self->trace->guards, self->mem, self->ctx, &guard, 1);
+    self->seen[rk] = true;
+  }
+  return &self->regs[rk];
+}
+
+static candy_wrap_t *_write(trace_recorder_t *self, uint32_t reg) {
+  if (reg >= self->nregs)
+    return NULL;
+  self->seen[reg] = true;
+  return &self->regs[reg];
+}
+
+/* the value of the global 'key' as the interpreter would look it up through 'cache' */
+static const candy_wrap_t *_global(trace_recorder_t *self, candy_cache_t *cache, const candy_wrap_t *key) {
+  if (cache->version != candy_table_version(self->glb) || cache->key != candy_wrap_get_object(key)) {
+    cache->val = candy_table_get(self->glb, key);
+    cache->key = candy_wrap_get_object(key);
+    cache->version = candy_table_version(self->glb);
+  }
+  return cache->val;
+}
+
+/* both operands have to be integers or both floats */
+static candy_types_t _numeric(const candy_wrap_t *rb, const candy_wrap_t *rc) {
+  if (!rb || !rc || candy_wrap_get_type(rb) != candy_wrap_get_type(rc))
+    return CANDY_TYPE_NULL;
+  if (candy_wrap_get_type(rb) != CANDY_TYPE_INTEGER && candy_wrap_get_type(rb) != CANDY_TYPE_FLOAT)
+    return CANDY_TYPE_NULL;
+  return candy_wrap_get_type(rb);
+}
+
+static void _arith(candy_opcodes_t op, candy_types_t type, candy_wrap_t *ra, const candy_wrap_t *rb, const candy_wrap_t *rc) {
+  if (op == OP_DIV) {
+    candy_float_t l = type == CANDY_TYPE_INTEGER ? (candy_float_t)candy_wrap_get_integer(rb) : candy_wrap_get_float(rb);
+    candy_float_t r = type == CANDY_TYPE_INTEGER ? (candy_float_t)candy_wrap_get_integer(rc) : candy_wrap_get_float(rc);
+    candy_wrap_set_float(ra, l / r);
+    return;
+  }
+  if (type == CANDY_TYPE_INTEGER) {
+    uint64_t l = (uint64_t)candy_wrap_get_integer(rb), r = (uint64_t)candy_wrap_get_integer(rc);
+    candy_wrap_set_integer(ra, (candy_integer_t)(op == OP_ADD ? l + r : op == OP_SUB ? l - r : l * r));
+  }
+  else {
+    candy_float_t l = candy_wrap_get_float(rb), r = candy_wrap_get_float(rc);
+    candy_wrap_set_float(ra, op == OP_ADD ? l + r : op == OP_SUB ? l - r : l * r);
+  }
+}
+
+static bool _compare(candy_opcodes_t op, candy_types_t type, const candy_wrap_t *rb, const candy_wrap_t *rc) {
+  if (type == CANDY_TYPE_INTEGER) {
+    candy_integer_t l = candy_wrap_get_integer(rb), r = candy_wrap_get_integer(rc);
+    return op == OP_EQ ? l == r : op == OP_LT ? l < r : l <= r;
+  }
+  candy_float_t l = candy_wrap_get_float(rb), r = candy_wrap_get_float(rc);
+  return op == OP_LT ? l < r : l <= r;
+}
+
+/* the next value of an integer for loop, false once it would pass the limit */
+static bool _count(candy_wrap_t *ra, const candy_wrap_t *limit, const candy_wrap_t *by) {
+  candy_integer_t i = candy_wrap_get_integer(ra), step = candy_wrap_get_integer(by);
+  uint64_t left = step > 0 ? (uint64_t)candy_wrap_get_integer(limit) - (uint64_t)i : (uint64_t)i - (uint64_t)candy_wrap_get_integer(limit);
+  if (left < (step > 0 ? (uint64_t)step : -(uint64_t)step))
+    return false;
+  candy_wrap_set_integer(ra, (candy_integer_t)((uint64_t)i + (uint64_t)step));
+  return true;
+}
+
+/**
+  * @brief  follow one iteration from the header back to it
+  * @retval false if the path leaves what a trace can hold
+  */
+static bool _record(trace_recorder_t *self, const candy_inst_t *inst, uint32_t ninst) {
+  candy_trace_t *trace = self->trace;
+  uint32_t pc = trace->header;
+  while (candy_vector_size(&trace->steps) < CANDY_TRACE_MAX_STEPS && pc < ninst) {
+    candy_trace_step_t step = {inst[pc], pc, 0, false};
+    candy_inst_t ins = step.ins;
+    ins.op = _generic((candy_opcodes_t)ins.op);
+    step.ins = ins;
+    uint32_t next = pc + 1;
+    switch (ins.op) {
+      case OP_MOVE: {
+        const candy_wrap_t *rb = _read(self, ins.iabc.b);
+        candy_wrap_t *ra = _write(self, ins.iabc.a);
+        if (!rb || !ra)
+          return false;
+        *ra = *rb;
+        break;
+      }
+      case OP_LOADK: {
+        candy_wrap_t *ra = _write(self, ins.iabx.a);
+        if (!ra)
+          return false;
+        *ra = self->cnst[ins.iabx.b];
+        break;
+      }
+      case OP_LOADBOOL: {
+        candy_wrap_t *ra = _write(self, ins.iabc.a);
+        if (!ra)
+          return false;
+        candy_wrap_set_boolean(ra, ins.iabc.b);
+        next += ins.iabc.c ? 1 : 0;
+        break;
+      }
+      case OP_LOADNONE:
+        for (uint32_t idx = 0; idx <= ins.iabc.b; ++idx) {
+          candy_wrap_t *ra = _write(self, ins.iabc.a + idx);
+          if (!ra)
+            return false;
+          candy_wrap_set_none(ra);
+        }
+        break;
+      case OP_GETTABUP: {
+        candy_wrap_t *ra = _write(self, ins.iabc.a);
+        if (!ra || !candy_inst_is_k(ins.iabc.c))
+          return false;
+        *ra = *_global(self, &self->caches[ins.iabc.b], _read(self, ins.iabc.c));
+        step.tags = _tags(ra);
+        break;
+      }
+      case OP_SETTABUP: {
+        /* only an existing global with a cache, the table itself is left as it is */
+        if (!ins.iabc.a || !candy_inst_is_k(ins.iabc.b) || !_read(self, ins.iabc.c))
+          return false;
+        if (_global(self, &self->caches[ins.iabc.a - 1], _read(self, ins.iabc.b)) == &CANDY_WRAP_NULL)
+          return false;
+        break;
+      }
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV: {
+        const candy_wrap_t *rb = _read(self, ins.iabc.b), *rc = _read(self, ins.iabc.c);
+        candy_types_t type = _numeric(rb, rc);
+        candy_wrap_t *ra = _write(self, ins.iabc.a);
+        if (type == CANDY_TYPE_NULL || !ra)
+          return false;
+        _arith((candy_opcodes_t)ins.op, type, ra, rb, rc);
+        step.tags = candy_trace_tags(type, MASK_NONE);
+        break;
+      }
+      case OP_EQ:
+      case OP_LT:
+      case OP_LE: {
+        const candy_wrap_t *rb = _read(self, ins.iabc.b), *rc = _read(self, ins.iabc.c);
+        candy_types_t type = _numeric(rb, rc);
+        /* an unordered float equality takes two branches */
+        if (type == CANDY_TYPE_NULL || (ins.op == OP_EQ && type != CANDY_TYPE_INTEGER))
+          return false;
+        step.skip = _compare((candy_opcodes_t)ins.op, type, rb, rc) != ins.iabc.a;
+        step.tags = candy_trace_tags(type, MASK_NONE);
+        next += step.skip ? 1 : 0;
+        break;
+      }
+      case OP_JMP: {
+        int64_t target = (int64_t)pc + 1 + candy_inst_get_sbx(ins);
+        if (target < 0 || target >= ninst)
+          return false;
+        /* a forward jump only moves along the path */
+        if (target != trace->header) {
+          next = (uint32_t)target;
+          break;
+        }
+        candy_vector_append(&trace->steps, self->mem, self->ctx, &step, 1);
+        return true;
+      }
+      case OP_FORLOOP: {
+        const candy_wrap_t *limit = _read(self, ins.iabx.a + 1), *by = _read(self, ins.iabx.a + 2);
+        candy_wrap_t *ra = _read(self, ins.iabx.a) ? _write(self, ins.iabx.a) : NULL, *var = _write(self, ins.iabx.a + 3);
+        /* only the back edge of an integer loop that goes on closes the trace */
+        if (!var || _numeric(ra, limit) != CANDY_TYPE_INTEGER || _numeric(ra, by) != CANDY_TYPE_INTEGER)
+          return false;
+        if (pc + 1 + candy_inst_get_sbx(ins) != trace->header || !_count(ra, limit, by))
+          return false;
+        *var = *ra;
+        step.tags = candy_trace_tags(CANDY_TYPE_INTEGER, MASK_NONE);
+        candy_vector_append(&trace->steps, self->mem, self->ctx, &step, 1);
+        return true;
+      }
+      default:
+        return false;
+    }
+    if (ins.op != OP_JMP)
+      candy_vector_append(&trace->steps, self->mem, self->ctx, &step, 1);
+    pc = next;
+  }
+  return false;
+}
+
+candy_trace_t *candy_trace_create(candy_proto_t *proto, const candy_wrap_t *base, const candy_table_t *glb, uint32_t header, candy_gc_t *gc, candy_exce_t *ctx) {
+  candy_memory_t *mem = candy_gc_memory(gc);
+  size_t nregs = candy_proto_get_maxstack(proto);
+  candy_trace_t *self = (candy_trace_t *)candy_memory_alloc(mem, ctx, sizeof(struct candy_trace));
+  self->header = header;
+  self->stable = true;
+  self->jit = NULL;
+  candy_vector_init(&self->steps, sizeof(candy_trace_step_t));
+  candy_vector_init(&self->guards, sizeof(candy_trace_guard_t));
+  trace_recorder_t recorder = {
+    .trace = self,
+    .regs = (candy_wrap_t *)candy_memory_alloc(mem, ctx, nregs * sizeof(struct candy_wrap)),
+    .seen = (bool *)candy_memory_alloc(mem, ctx, nregs * sizeof(bool)),
+    .nregs = nregs,
+    .cnst = candy_proto_get_cnst(proto),
+    .caches = candy_proto_get_cache(proto),
+    .glb = glb,
+    .mem = mem,
+    .ctx = ctx,
+  };
+  memcpy(recorder.regs, base, nregs * sizeof(struct candy_wrap));
+  memset(recorder.seen, 0, nregs * sizeof(bool));
+  bool done = _record(&recorder, candy_proto_get_inst(proto), (uint32_t)candy_proto_get_size_inst(proto));
+  if (done) {
+    const candy_trace_guard_t *guards = candy_trace_get_guards(self);
+    for (size_t idx = 0; idx < candy_trace_get_size_guards(self); ++idx)
+      if (_tags(&recorder.regs[guards[idx].reg]) != guards[idx].tags)
+        self->stable = false;
+  }
+  candy_memory_free(mem, recorder.regs, nregs * sizeof(struct candy_wrap));
+  candy_memory_free(mem, recorder.seen, nregs * sizeof(bool));
+  if (done)
+    self->jit = candy_jit_trace(self, gc, ctx);
+  if (!self->jit) {
+    candy_trace_delete(self, gc);
+    return NULL;
+  }
+  return self;
+}
+
+int candy_trace_delete(candy_trace_t *self, candy_gc_t *gc) {
+  if (self->jit)
+    candy_jit_delete(self->jit, gc);
+  candy_vector_deinit(&self->steps, candy_gc_memory(gc));
+  candy_vector_deinit(&self->guards, candy_gc_memory(gc));
+  candy_memory_free(candy_gc_memory(gc), self, sizeof(struct candy_trace));
+  return 0;
+}
+
+size_t candy_trace_run(const candy_trace_t *self, candy_wrap_t *base, const candy_wrap_t *cnst, candy_cache_t *caches, const candy_table_t *glb, int64_t *budget) {
+  /* a trace has a single entry */
+  return candy_jit_run(self->jit, base, cnst, caches, glb, budget, 0);
+}
+
+uint32_t candy_trace_get_header(const candy_trace_t *self) {
+  return self->header;
+}
+
+const candy_trace_step_t *candy_trace_get_steps(const candy_trace_t *self) {
+  return (const candy_trace_step_t *)candy_vector_data(&self->steps);
+}
+
+size_t candy_trace_get_size_steps(const candy_trace_t *self) {
+  return candy_vector_size(&self->steps);
+}
+
+const candy_trace_guard_t *candy_trace_get_guards(const candy_trace_t *self) {
+  return (const candy_trace_guard_t *)candy_vector_data(&self->guards);
+}
+
+size_t candy_trace_get_size_guards(const candy_trace_t *self) {
+  return candy_vector_size(&self->guards);
+}
+
+bool candy_trace_is_stable(const candy_trace_t *self) {
+  return self->stable;
+}
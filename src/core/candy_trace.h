@@ -0,0 +1,88 @@
+/**
+  * Copyright 2022-2024 ShunzDai
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+#ifndef CANDY_CORE_TRACE_H
+#define CANDY_CORE_TRACE_H
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include "core/candy_priv.h"
+#include "core/candy_proto.h"
+
+/* longest path through a loop body that is recorded */
+#define CANDY_TRACE_MAX_STEPS 256
+
+/**
+  * @brief  one instruction of the recorded path with the operand types it
+  *         is specialized for
+  */
+typedef struct candy_trace_step {
+  candy_inst_t ins;
+  uint32_t pc;
+  /* type and mask of the operands, or of the value a global had */
+  uint16_t tags;
+  /* whether a comparison skipped the instruction after it */
+  bool skip;
+} candy_trace_step_t;
+
+/* type and mask a register must have when the trace is entered */
+typedef struct candy_trace_guard {
+  uint32_t reg;
+  uint16_t tags;
+} candy_trace_guard_t;
+
+/**
+  * @brief  record the path one iteration of the loop starting at 'header'
+  *         takes, on a copy of the registers, and compile it.
+  * @retval NULL if the body does something a trace cannot, or there is no jit;
+  *         the steps run as a bytecode fragment were slower than the quickened
+  *         instructions they come from
+  */
+candy_trace_t *candy_trace_create(candy_proto_t *proto, const candy_wrap_t *base, const candy_table_t *glb, uint32_t header, candy_gc_t *gc, candy_exce_t *ctx);
+
+int candy_trace_delete(candy_trace_t *self, candy_gc_t *gc);
+
+/**
+  * @brief  run the loop until one of the guards of the trace fails or the
+  *         'budget' is used up
+  * @retval index of the instruction the interpreter resumes at
+  */
+size_t candy_trace_run(const candy_trace_t *self, candy_wrap_t *base, const candy_wrap_t *cnst, candy_cache_t *caches, const candy_table_t *glb, int64_t *budget);
+
+uint32_t candy_trace_get_header(const candy_trace_t *self);
+
+const candy_trace_step_t *candy_trace_get_steps(const candy_trace_t *self);
+
+size_t candy_trace_get_size_steps(const candy_trace_t *self);
+
+const candy_trace_guard_t *candy_trace_get_guards(const candy_trace_t *self);
+
+size_t candy_trace_get_size_guards(const candy_trace_t *self);
+
+/**
+  * @brief  whether the types the body leaves behind are the ones its
+  *         guards check, the loop can then skip the guards
+  */
+bool candy_trace_is_stable(const candy_trace_t *self);
+
+static inline uint16_t candy_trace_tags(candy_types_t type, uint8_t mask) {
+  return (uint16_t)(type | mask << 8);
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* CANDY_CORE_TRACE_H */
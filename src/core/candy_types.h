@@ -49,6 +49,25 @@ typedef struct candy_regist {
   candy_cfunc_t func;
 } candy_regist_t;
 
+/* slots a fast c-function may write results to, even with fewer arguments */
+#define CANDY_FAST_RESULTS 4
+
+/* the slots of the stack a fast c-function is lent, see the candy_arg functions */
+typedef struct candy_args candy_args_t;
+
+/**
+  * @brief  c-type function working on its arguments where the caller left
+  *         them, the results are written over 'args' from the first slot on
+  *         and their number is returned. it gets no state, the stack may not
+  *         grow under the slots while it runs.
+  */
+typedef int (*candy_fast_t)(candy_args_t *args, int nargs);
+
+typedef struct candy_regist_fast {
+  const char *name;
+  candy_fast_t func;
+} candy_regist_fast_t;
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -56,11 +56,12 @@ void candy_vector_reserve(candy_vector_t *self, candy_memory_t *mem, candy_exce_
   size_t cap = candy_vector_capacity(self);
   if (capacity <= cap)
     return;
-  _set_capacity(self, capacity);
+  /* the capacity is only updated once the memory is there, a throw leaves it as it was */
   _set_data(self, candy_memory_realloc(mem, ctx, candy_vector_data(self),
     candy_vector_cell(self) * cap,
-    candy_vector_cell(self) * candy_vector_capacity(self)
+    candy_vector_cell(self) * capacity
   ));
+  _set_capacity(self, capacity);
 }
 
 void candy_vector_resize(candy_vector_t *self, candy_memory_t *mem, candy_exce_t *ctx, size_t size) {
@@ -16,87 +16,906 @@
 #include "core/candy_vm.h"
 #include "core/candy_wrap.h"
 #include "core/candy_gc.h"
+#include "core/candy_array.h"
 #include "core/candy_table.h"
 #include "core/candy_proto.h"
+#include "core/candy_closure.h"
+#include "core/candy_peephole.h"
+#include "core/candy_parser.h"
+#include "core/candy_jit.h"
+#include "core/candy_trace.h"
+#include "core/candy_print.h"
 #include <string.h>
-#include <assert.h>
-
-#define vm_assert(_condition, _format, ...) candy_assert((candy_exce_t *)(self), _condition, vm, _format, ##__VA_ARGS__)
-
-// static const candy_inst_t *_get_ins(candy_proto_t *block) {
-//   return (const candy_inst_t *)candy_array_data(candy_proto_get_inst(block));
-// }
-
-// static void execute(candy_vm_t *self, candy_proto_t *block) {
-//   for (const candy_inst_t *ins = _get_ins(block); (size_t)(ins - _get_ins(block)) < candy_array_size(candy_proto_get_inst(block)); ++ins) {
-//     switch (ins->op) {
-//       #define CANDY_OP_CASE
-//       #include "core/candy_opcode.list"
-//       default:
-//       break;
-//     }
-//   }
-// }
-
-int candy_vm_init(candy_vm_t *self) {
+#include <math.h>
+#include <inttypes.h>
+
+#define vm_assert(_condition, _format, ...) \
+candy_assert(&self->ctx, self->gc, _condition, EXCE_ERR_RUNTIME, _format, ##__VA_ARGS__)
+
+/* only calls crossing a c-function are nested on the c stack */
+#define VM_MAX_DEPTH  200
+#define VM_MAX_FRAMES (1 << 17)
+/* backward jumps a loop takes before it is traced */
+#define VM_HOTLOOP    56
+
+#define R(_idx)   (base + (_idx))
+#define K(_idx)   (cnst + (_idx))
+#define RK(_rk)   (candy_inst_is_k(_rk) ? K(candy_inst_get_k(_rk)) : R(_rk))
+#define RA        R(ins.iabc.a)
+#define RB        R(ins.iabc.b)
+#define RKB       RK(ins.iabc.b)
+#define RKC       RK(ins.iabc.c)
+#define KBX       K(ins.iabx.b)
+
+#define vm_jump(_offset) (pc += (_offset))
+#define vm_reenter()     goto _reenter
+
+/* the instruction being executed, rewritten in place when quickening */
+#define vm_inst()        ((candy_inst_t *)pc - 1)
+#define vm_quicken(_op)  _quicken(vm_inst(), RKB, RKC, OP_##_op##II, OP_##_op##FF)
+#define vm_deopt(_op)    _retag(vm_inst(), OP_##_op)
+/* operand types assumed by a quickened instruction */
+#define vm_guard(_type)  \
+(candy_wrap_get_type(rb) == CANDY_TYPE_##_type && candy_wrap_get_type(rc) == CANDY_TYPE_##_type)
+
+/* leave the running frame, back to the host if it was entered from there */
+#define vm_return(_ins) { \
+  size_t nresults = _op_return(self, base, _ins); \
+  if (self->nframes == entry) \
+    return nresults; \
+  _op_result(self, nresults); \
+  vm_reenter(); \
+}
+
+/**
+  * @brief  backward jumps and calls use up the budget, an empty one
+  *         suspends the frames with the running one resuming at '_pc'
+  */
+#define vm_budget(_pc)  if (--self->budget == 0 && _suspend(self, _pc)) return 0
+/* the native code has used up the budget */
+#define vm_preempt(_pc) if (self->budget == 0 && _suspend(self, _pc)) return 0
+
+#if CANDY_PROFILE
+#define vm_profile() (++self->pairs[prev][ins.op], prev = ins.op)
+#else
+#define vm_profile() ((void)0)
+#endif /* CANDY_PROFILE */
+
+#if CANDY_COMPUTED_GOTO && defined(__GNUC__)
+#define VM_COMPUTED_GOTO 1
+#define vm_next() goto *_label[(ins = *pc++, vm_profile(), ins.op)]
+#else
+#define VM_COMPUTED_GOTO 0
+#define vm_next() continue
+#endif
+
+/* integer fast path of the binary operators, anything else goes through @ref _arith */
+#define vm_arith(_op, _iop) { \
+  const candy_wrap_t *rb = RKB, *rc = RKC; \
+  if (candy_wrap_get_type(rb) == CANDY_TYPE_INTEGER && candy_wrap_get_type(rc) == CANDY_TYPE_INTEGER) \
+    candy_wrap_set_integer(RA, _iop(candy_wrap_get_integer(rb), candy_wrap_get_integer(rc))); \
+  else \
+    _arith(self, OP_##_op, RA, rb, rc); \
+}
+
+static inline candy_wrap_t *_stack(candy_vm_t *self) {
+  return (candy_wrap_t *)candy_vector_data(&self->root);
+}
+
+static inline candy_frame_t *_frames(candy_vm_t *self) {
+  return (candy_frame_t *)candy_vector_data(&self->frames);
+}
+
+static inline candy_frame_t *_frame(candy_vm_t *self) {
+  return _frames(self) + self->nframes - 1;
+}
+
+static void _reserve(candy_vm_t *self, size_t size) {
+  size_t cap = candy_vector_capacity(&self->root);
+  if (size <= cap)
+    return;
+  size_t next = cap ? cap : 16;
+  while (next < size)
+    next <<= 1;
+  uintptr_t prev = (uintptr_t)_stack(self);
+  candy_vector_reserve(&self->root, candy_gc_memory(self->gc), &self->ctx, next);
+  memset(_stack(self) + cap, 0, (next - cap) * sizeof(struct candy_wrap));
+  /* the frames address their registers directly */
+  for (size_t idx = 0; idx < self->nframes; ++idx)
+    _frames(self)[idx].base = (candy_wrap_t *)((uintptr_t)_frames(self)[idx].base - prev + (uintptr_t)_stack(self));
+  candy_upval_relocate(self->openupval, prev, (uintptr_t)_stack(self));
+}
+
+static candy_frame_t *_frame_push(candy_vm_t *self) {
+  size_t cap = candy_vector_capacity(&self->frames);
+  if (self->nframes == cap) {
+    vm_assert(cap < VM_MAX_FRAMES, "maximum recursion depth exceeded");
+    candy_vector_reserve(&self->frames, candy_gc_memory(self->gc), &self->ctx, cap ? cap << 1 : 8);
+  }
+  return &_frames(self)[self->nframes++];
+}
+
+static inline void _fill(candy_wrap_t *self, size_t size) {
+  for (size_t idx = 0; idx < size; ++idx)
+    candy_wrap_set_none(&self[idx]);
+}
+
+static inline candy_integer_t _iadd(candy_integer_t l, candy_integer_t r) {
+  return (candy_integer_t)((uint64_t)l + (uint64_t)r);
+}
+
+static inline candy_integer_t _isub(candy_integer_t l, candy_integer_t r) {
+  return (candy_integer_t)((uint64_t)l - (uint64_t)r);
+}
+
+static inline candy_integer_t _imul(candy_integer_t l, candy_integer_t r) {
+  return (candy_integer_t)((uint64_t)l * (uint64_t)r);
+}
+
+static inline candy_integer_t _iand(candy_integer_t l, candy_integer_t r) {
+  return l & r;
+}
+
+static inline candy_integer_t _ior(candy_integer_t l, candy_integer_t r) {
+  return l | r;
+}
+
+static inline candy_integer_t _ixor(candy_integer_t l, candy_integer_t r) {
+  return l ^ r;
+}
+
+static inline candy_integer_t _ishl(candy_integer_t l, candy_integer_t r) {
+  if (r <= -64 || r >= 64)
+    return 0;
+  return r >= 0 ? (candy_integer_t)((uint64_t)l << r) : (candy_integer_t)((uint64_t)l >> -r);
+}
+
+/* the result takes the sign of the divisor */
+static inline candy_integer_t _imod(candy_integer_t l, candy_integer_t r) {
+  if (r == -1)
+    return 0;
+  candy_integer_t m = l % r;
+  return (m != 0 && (m ^ r) < 0) ? m + r : m;
+}
+
+static inline candy_float_t _fmod(candy_float_t l, candy_float_t r) {
+  candy_float_t m = fmod(l, r);
+  return (m != 0 && (m < 0) != (r < 0)) ? m + r : m;
+}
+
+static inline bool _is_number(const candy_wrap_t *self) {
+  return candy_wrap_get_type(self) == CANDY_TYPE_INTEGER || candy_wrap_get_type(self) == CANDY_TYPE_FLOAT;
+}
+
+static inline candy_float_t _tofloat(const candy_wrap_t *self) {
+  if (candy_wrap_get_type(self) == CANDY_TYPE_INTEGER)
+    return (candy_float_t)candy_wrap_get_integer(self);
+  return candy_wrap_get_float(self);
+}
+
+/**
+  * @brief  rewrite 'inst' as 'op', still fused with the next instruction if
+  *         there is a superinstruction for the pair. a quickened instruction
+  *         is never the last one, a return follows it somewhere.
+  */
+static void _retag(candy_inst_t *inst, candy_opcodes_t op) {
+  inst->op = CANDY_PROFILE ? op : candy_peephole_fuse(op, (candy_opcodes_t)inst[1].op);
+}
+
+/**
+  * @brief  specialize a generic instruction for the operand types it sees,
+  *         the specialized form turns itself back once its guard fails,
+  *         OP_NUM if there is no form for floats
+  */
+static inline void _quicken(candy_inst_t *inst, const candy_wrap_t *rb, const candy_wrap_t *rc, candy_opcodes_t ii, candy_opcodes_t ff) {
+  candy_types_t tb = candy_wrap_get_type(rb), tc = candy_wrap_get_type(rc);
+  if (tb == CANDY_TYPE_INTEGER && tc == CANDY_TYPE_INTEGER)
+    _retag(inst, ii);
+  else if (ff != OP_NUM && tb == CANDY_TYPE_FLOAT && tc == CANDY_TYPE_FLOAT)
+    _retag(inst, ff);
+}
+
+static inline bool _truthy(const candy_wrap_t *self) {
+  switch (candy_wrap_get_type(self)) {
+    case CANDY_TYPE_NULL:
+    case CANDY_TYPE_NONE:
+      return false;
+    case CANDY_TYPE_BOOLEAN:
+      return candy_wrap_get_boolean(self);
+    default:
+      return true;
+  }
+}
+
+static inline const candy_array_t *_string(const candy_wrap_t *self) {
+  return (const candy_array_t *)candy_wrap_get_object(self);
+}
+
+static int _strcmp(const candy_wrap_t *l, const candy_wrap_t *r) {
+  size_t sl = candy_array_size(_string(l)), sr = candy_array_size(_string(r));
+  int res = memcmp(candy_array_data(_string(l)), candy_array_data(_string(r)), sl < sr ? sl : sr);
+  return res ? res : (sl > sr) - (sl < sr);
+}
+
+static bool _equal(const candy_wrap_t *l, const candy_wrap_t *r) {
+  if (_is_number(l) && _is_number(r)) {
+    if (candy_wrap_get_type(l) == CANDY_TYPE_INTEGER && candy_wrap_get_type(r) == CANDY_TYPE_INTEGER)
+      return candy_wrap_get_integer(l) == candy_wrap_get_integer(r);
+    return _tofloat(l) == _tofloat(r);
+  }
+  if (candy_wrap_is_string(l) && candy_wrap_is_string(r))
+    return _strcmp(l, r) == 0;
+  /* 'false' only equals itself, the other falsy values are all the same */
+  if (!_truthy(l) && !_truthy(r))
+    return (candy_wrap_get_type(l) == CANDY_TYPE_BOOLEAN) == (candy_wrap_get_type(r) == CANDY_TYPE_BOOLEAN);
+  if (candy_wrap_get_type(l) != candy_wrap_get_type(r))
+    return false;
+  switch (candy_wrap_get_type(l)) {
+    case CANDY_TYPE_BOOLEAN:
+      return candy_wrap_get_boolean(l) == candy_wrap_get_boolean(r);
+    case CANDY_TYPE_CFUNC:
+      return candy_wrap_get_cfunc(l) == candy_wrap_get_cfunc(r);
+    case CANDY_TYPE_CFAST:
+      return candy_wrap_get_fast(l) == candy_wrap_get_fast(r);
+    default:
+      return candy_wrap_is_object(l) && candy_wrap_get_object(l) == candy_wrap_get_object(r);
+  }
+}
+
+static bool _less(candy_vm_t *self, const candy_wrap_t *l, const candy_wrap_t *r, bool eq) {
+  if (candy_wrap_get_type(l) == CANDY_TYPE_INTEGER && candy_wrap_get_type(r) == CANDY_TYPE_INTEGER)
+    return eq ? candy_wrap_get_integer(l) <= candy_wrap_get_integer(r) : candy_wrap_get_integer(l) < candy_wrap_get_integer(r);
+  if (_is_number(l) && _is_number(r))
+    return eq ? _tofloat(l) <= _tofloat(r) : _tofloat(l) < _tofloat(r);
+  if (candy_wrap_is_string(l) && candy_wrap_is_string(r))
+    return eq ? _strcmp(l, r) <= 0 : _strcmp(l, r) < 0;
+  vm_assert(false, "'%s' not supported between '%s' and '%s'", eq ? "<=" : "<",
+    candy_type_str(candy_wrap_get_type(l)), candy_type_str(candy_wrap_get_type(r))
+  );
+  return false;
+}
+
+/**
+  * @brief  check the counter, limit and step of a numeric for, they are all
+  *         turned into floats unless all of them are integers
+  * @retval false if the loop does not run at all
+  */
+static bool _forprep(candy_vm_t *self, candy_wrap_t *ra) {
+  vm_assert(_is_number(ra) && _is_number(ra + 1) && _is_number(ra + 2), "'for' expects numbers, got '%s', '%s' and '%s'",
+    candy_type_str(candy_wrap_get_type(ra)), candy_type_str(candy_wrap_get_type(ra + 1)), candy_type_str(candy_wrap_get_type(ra + 2))
+  );
+  if (candy_wrap_get_type(ra) == CANDY_TYPE_INTEGER && candy_wrap_get_type(ra + 1) == CANDY_TYPE_INTEGER && candy_wrap_get_type(ra + 2) == CANDY_TYPE_INTEGER) {
+    candy_integer_t init = candy_wrap_get_integer(ra), limit = candy_wrap_get_integer(ra + 1), step = candy_wrap_get_integer(ra + 2);
+    vm_assert(step != 0, "'for' step is zero");
+    if (step > 0 ? init > limit : init < limit)
+      return false;
+  }
+  else {
+    for (int idx = 0; idx < 3; ++idx)
+      candy_wrap_set_float(ra + idx, _tofloat(ra + idx));
+    candy_float_t init = candy_wrap_get_float(ra), limit = candy_wrap_get_float(ra + 1), step = candy_wrap_get_float(ra + 2);
+    vm_assert(step != 0, "'for' step is zero");
+    if (step > 0 ? !(init <= limit) : !(init >= limit))
+      return false;
+  }
+  ra[3] = ra[0];
+  return true;
+}
+
+/* the next value of a numeric for, false once it would pass the limit */
+static inline bool _forloop(candy_wrap_t *ra) {
+  if (candy_wrap_get_type(ra + 2) == CANDY_TYPE_INTEGER) {
+    candy_integer_t i = candy_wrap_get_integer(ra), limit = candy_wrap_get_integer(ra + 1), step = candy_wrap_get_integer(ra + 2);
+    /* the distance left and the step, unsigned so that neither overflows */
+    uintmax_t left = step > 0 ? (uintmax_t)limit - (uintmax_t)i : (uintmax_t)i - (uintmax_t)limit;
+    if (left < (step > 0 ? (uintmax_t)step : (uintmax_t)-(step + 1) + 1))
+      return false;
+    candy_wrap_set_integer(ra, _iadd(i, step));
+  }
+  else {
+    candy_float_t f = candy_wrap_get_float(ra) + candy_wrap_get_float(ra + 2), limit = candy_wrap_get_float(ra + 1);
+    if (candy_wrap_get_float(ra + 2) > 0 ? !(f <= limit) : !(f >= limit))
+      return false;
+    candy_wrap_set_float(ra, f);
+  }
+  ra[3] = ra[0];
+  return true;
+}
+
+/**
+  * @brief  look a value up in the cases of a jump table, a float equal to
+  *         an integer case takes it as an equality test would
+  * @retval how far to jump, past the default jump to the one of the case
+  */
+static int32_t _jmptab(const candy_wrap_t *ra, const candy_wrap_t *k) {
+  candy_wrap_t key = *ra;
+  if (candy_wrap_get_type(ra) == CANDY_TYPE_FLOAT) {
+    candy_float_t f = candy_wrap_get_float(ra);
+    if (f >= -0x1p63 && f < 0x1p63 && f == (candy_float_t)(candy_integer_t)f)
+      candy_wrap_set_integer(&key, (candy_integer_t)f);
+  }
+  const candy_wrap_t *val = candy_table_get((const candy_table_t *)candy_wrap_get_object(k), &key);
+  if (candy_wrap_get_type(val) != CANDY_TYPE_INTEGER)
+    return 0;
+  return 1 + (int32_t)candy_wrap_get_integer(val);
+}
+
+/* the arithmetic on numbers, false for any other operand or a modulo by zero */
+static bool _arith_number(candy_opcodes_t op, candy_wrap_t *ra, const candy_wrap_t *rb, const candy_wrap_t *rc) {
+  if (candy_wrap_get_type(rb) == CANDY_TYPE_INTEGER && candy_wrap_get_type(rc) == CANDY_TYPE_INTEGER) {
+    candy_integer_t l = candy_wrap_get_integer(rb), r = candy_wrap_get_integer(rc);
+    switch (op) {
+      case OP_ADD:  candy_wrap_set_integer(ra, _iadd(l, r));  return true;
+      case OP_SUB:  candy_wrap_set_integer(ra, _isub(l, r));  return true;
+      case OP_MUL:  candy_wrap_set_integer(ra, _imul(l, r));  return true;
+      case OP_BAND: candy_wrap_set_integer(ra, _iand(l, r));  return true;
+      case OP_BOR:  candy_wrap_set_integer(ra, _ior(l, r));   return true;
+      case OP_BXOR: candy_wrap_set_integer(ra, _ixor(l, r));  return true;
+      case OP_SHL:  candy_wrap_set_integer(ra, _ishl(l, r));  return true;
+      case OP_SHR:  candy_wrap_set_integer(ra, _ishl(l, _isub(0, r))); return true;
+      case OP_UNM:  candy_wrap_set_integer(ra, _isub(0, l));  return true;
+      case OP_BNOT: candy_wrap_set_integer(ra, ~l);           return true;
+      case OP_MOD:
+        if (r == 0)
+          return false;
+        candy_wrap_set_integer(ra, _imod(l, r));
+        return true;
+      /* true division always results in a float */
+      default:
+        break;
+    }
+  }
+  if (_is_number(rb) && _is_number(rc)) {
+    candy_float_t l = _tofloat(rb), r = _tofloat(rc);
+    switch (op) {
+      case OP_ADD: candy_wrap_set_float(ra, l + r);       return true;
+      case OP_SUB: candy_wrap_set_float(ra, l - r);       return true;
+      case OP_MUL: candy_wrap_set_float(ra, l * r);       return true;
+      case OP_DIV: candy_wrap_set_float(ra, l / r);       return true;
+      case OP_MOD: candy_wrap_set_float(ra, _fmod(l, r)); return true;
+      case OP_UNM: candy_wrap_set_float(ra, -l);          return true;
+      default:
+        break;
+    }
+  }
+  return false;
+}
+
+static void _arith(candy_vm_t *self, candy_opcodes_t op, candy_wrap_t *ra, const candy_wrap_t *rb, const candy_wrap_t *rc) {
+  if (_arith_number(op, ra, rb, rc))
+    return;
+  vm_assert(op != OP_MOD || candy_wrap_get_type(rb) != CANDY_TYPE_INTEGER || candy_wrap_get_type(rc) != CANDY_TYPE_INTEGER, "integer modulo by zero");
+  if (op == OP_ADD && candy_wrap_is_string(rb) && candy_wrap_is_string(rc)) {
+    candy_array_t *str = candy_array_create(self->gc, &self->ctx, CANDY_TYPE_CHAR, MASK_NONE);
+    candy_array_reserve(str, self->gc, &self->ctx, candy_array_size(_string(rb)) + candy_array_size(_string(rc)));
+    candy_array_append(str, self->gc, &self->ctx, candy_array_data(_string(rb)), candy_array_size(_string(rb)));
+    candy_array_append(str, self->gc, &self->ctx, candy_array_data(_string(rc)), candy_array_size(_string(rc)));
+    candy_wrap_set_object(ra, (candy_object_t *)str);
+    return;
+  }
+  vm_assert(false, "unsupported operand type(s) for %s: '%s' and '%s'", candy_opcode_str(op),
+    candy_type_str(candy_wrap_get_type(rb)), candy_type_str(candy_wrap_get_type(rc))
+  );
+}
+
+static void _call(candy_vm_t *self, size_t func, size_t nargs, int nresults);
+
+/**
+  * @brief  leave the frames to @ref candy_vm_resume, which is only possible
+  *         if no c-function is running below them; otherwise the budget is
+  *         checked again at the next backward jump or call
+  * @param  pc the instruction the running frame resumes at, NULL if the
+  *         frames are already up to date
+  */
+static bool _suspend(candy_vm_t *self, const candy_inst_t *pc) {
+  if (!self->preemptible || self->depth > 1) {
+    self->budget = 1;
+    return false;
+  }
+  if (pc)
+    _frame(self)->pc = pc;
+  self->suspended = true;
+  return true;
+}
+
+/* the value of the global 'key', or the null wrap of a missing one, refilling 'cache' on a miss */
+static inline const candy_wrap_t *_global(candy_vm_t *self, candy_cache_t *cache, const candy_wrap_t *key) {
+  if (cache->version != candy_table_version(self->glb) || cache->key != candy_wrap_get_object(key)) {
+    cache->val = candy_table_get(self->glb, key);
+    cache->key = candy_wrap_get_object(key);
+    cache->version = candy_table_version(self->glb);
+  }
+  return cache->val;
+}
+
+/**
+  * @brief  count a backward jump or a for loop, once hot the loop it closes
+  *         is traced and the jump turned into a JLOOP, or a JFORLOOP; a loop
+  *         that cannot be traced is marked in the A field of its jump, or
+  *         becomes an IFORLOOP, and is never counted again
+  */
+static void _hotloop(candy_vm_t *self, candy_inst_t *jmp, const candy_wrap_t *base) {
+  uint16_t *count = &self->hotloops[((uintptr_t)jmp >> 2) % CANDY_VM_HOTLOOPS];
+  if (--*count)
+    return;
+  *count = VM_HOTLOOP;
+  candy_proto_t *proto = (candy_proto_t *)_frame(self)->proto;
+  candy_inst_t *inst = candy_proto_get_inst(proto);
+  candy_trace_t *trace = NULL;
+  bool forloop = jmp->op == OP_FORLOOP;
+  if (candy_proto_get_size_trace(proto) <= 0xFF)
+    trace = candy_trace_create(proto, base, self->glb, (uint32_t)(jmp + 1 + candy_inst_get_sbx(*jmp) - inst), self->gc, &self->ctx);
+  if (!trace) {
+    if (forloop)
+      jmp->op = OP_IFORLOOP;
+    else
+      jmp->iabx.a = 1;
+    return;
+  }
+  uint32_t idx = candy_proto_add_trace(proto, self->gc, &self->ctx, trace);
+  /* the A field of a for loop is its counter, its trace is looked up instead */
+  if (forloop)
+    jmp->op = OP_JFORLOOP;
+  else {
+    jmp->iabx.a = idx;
+    jmp->op = OP_JLOOP;
+  }
+  /* a superinstruction ending in the jump would run it inline */
+  if (jmp > inst && candy_peephole_first((candy_opcodes_t)jmp[-1].op) != jmp[-1].op)
+    jmp[-1].op = candy_peephole_first((candy_opcodes_t)jmp[-1].op);
+}
+
+/* the trace of the for loop whose body starts at 'header', any trace starting there will do */
+static const candy_trace_t *_looptrace(const candy_proto_t *proto, const candy_inst_t *header) {
+  uint32_t pc = (uint32_t)(header - candy_proto_get_inst(proto));
+  size_t idx = 0;
+  while (candy_trace_get_header(candy_proto_get_trace(proto, idx)) != pc)
+    ++idx;
+  return candy_proto_get_trace(proto, idx);
+}
+
+/**
+  * @brief  push the frame of the script function at R(func), missing
+  *         parameters and the remaining registers are none
+  */
+static void _enter(candy_vm_t *self, size_t func, size_t nargs) {
+  candy_proto_t *proto = candy_sclosure_get_proto((candy_sclosure_t *)candy_wrap_get_object(_stack(self) + func));
+  /* a body the parser has only skimmed is compiled on the first call */
+  if (candy_proto_get_source(proto))
+    candy_parse_body(proto, self->gc, &self->ctx);
+  size_t nparams = candy_proto_get_nparams(proto);
+  size_t maxstack = candy_proto_get_maxstack(proto);
+  size_t nfixed = nargs < nparams ? nargs : nparams;
+  /* a failed compilation is not retried, the threshold is only reached once */
+  if (candy_proto_heat(proto, CANDY_JIT_THRESHOLD) && CANDY_JIT_X64)
+    candy_proto_set_jit(proto, candy_jit_compile(proto, self->gc, &self->ctx));
+  _reserve(self, func + 1 + maxstack);
+  candy_frame_t *frame = _frame_push(self);
+  frame->base = _stack(self) + func + 1;
+  frame->pc = candy_proto_get_inst(proto);
+  frame->proto = proto;
+  _fill(frame->base + nfixed, maxstack - nfixed);
+  self->top = func + 1 + maxstack;
+}
+
+/**
+  * @brief  whether 'cls' captures what a new closure would, an open upvalue
+  *         only points into the frame that has created it
+  */
+static bool _reusable(candy_sclosure_t *cls, candy_wrap_t *base, candy_upval_t **enclosing) {
+  candy_upval_t **upval = candy_sclosure_get_upval(cls);
+  const candy_proto_t *proto = candy_sclosure_get_proto(cls);
+  const candy_upvaldesc_t *desc = candy_proto_get_upval(proto);
+  for (size_t idx = 0; idx < candy_proto_get_size_upval(proto); ++idx) {
+    if (desc[idx].instack ? candy_upval_get(upval[idx]) != base + desc[idx].idx : upval[idx] != enclosing[desc[idx].idx])
+      return false;
+  }
+  return true;
+}
+
+/**
+  * @brief  a closure of 'proto' in R(A), the enclosing frame lends it its
+  *         registers and its own upvalues. nobody can tell two closures of a
+  *         framed prototype apart, so one without upvalues is created once and
+  *         one still in R(A) from the last run of the loop is used again.
+  */
+static void _op_closure(candy_vm_t *self, candy_wrap_t *base, candy_wrap_t *ra, candy_proto_t *proto) {
+  candy_upval_t **enclosing = candy_sclosure_get_upval((candy_sclosure_t *)candy_wrap_get_object(base - 1));
+  bool framed = candy_proto_is_framed(proto);
+  if (framed && candy_proto_get_size_upval(proto) == 0 && candy_proto_get_closure(proto) != NULL) {
+    candy_wrap_set_object(ra, (candy_object_t *)candy_proto_get_closure(proto));
+    return;
+  }
+  if (framed && candy_wrap_get_type(ra) == CANDY_TYPE_SCLSR) {
+    candy_sclosure_t *prev = (candy_sclosure_t *)candy_wrap_get_object(ra);
+    if (candy_sclosure_get_proto(prev) == proto && _reusable(prev, base, enclosing))
+      return;
+  }
+  candy_sclosure_t *cls = candy_sclosure_create(self->gc, &self->ctx, proto);
+  candy_upval_t **upval = candy_sclosure_get_upval(cls);
+  const candy_upvaldesc_t *desc = candy_proto_get_upval(proto);
+  for (size_t idx = 0; idx < candy_proto_get_size_upval(proto); ++idx) {
+    if (desc[idx].instack)
+      upval[idx] = candy_upval_find(&self->openupval, self->gc, &self->ctx, base + desc[idx].idx);
+    else
+      upval[idx] = enclosing[desc[idx].idx];
+  }
+  if (framed && candy_proto_get_size_upval(proto) == 0)
+    candy_proto_set_closure(proto, cls);
+  candy_wrap_set_object(ra, (candy_object_t *)cls);
+}
+
+/* a script callee only gets its frame pushed, the loop picks it up */
+static void _op_call(candy_vm_t *self, candy_wrap_t *base, candy_inst_t ins) {
+  size_t offset = base - _stack(self);
+  size_t func = offset + ins.iabc.a;
+  size_t nargs = ins.iabc.b ? ins.iabc.b - 1U : self->top - func - 1;
+  if (candy_wrap_get_type(_stack(self) + func) == CANDY_TYPE_SCLSR) {
+    _enter(self, func, nargs);
+    return;
+  }
+  _call(self, func, nargs, (int)ins.iabc.c - 1);
+  /* a variable number of results leaves the top behind the last one */
+  if (ins.iabc.c)
+    self->top = offset + candy_proto_get_maxstack(_frame(self)->proto);
+}
+
+/**
+  * @brief  a script callee replaces the running frame, so tail recursion
+  *         runs in constant space; a c-function is simply called
+  * @retval true if a frame has been entered
+  */
+static bool _op_tailcall(candy_vm_t *self, candy_wrap_t *base, candy_inst_t ins) {
+  size_t func = base - _stack(self) + ins.iabc.a;
+  size_t nargs = ins.iabc.b ? ins.iabc.b - 1U : self->top - func - 1;
+  if (candy_wrap_get_type(_stack(self) + func) != CANDY_TYPE_SCLSR) {
+    _call(self, func, nargs, -1);
+    return false;
+  }
+  candy_upval_close(&self->openupval, base);
+  memmove(base - 1, _stack(self) + func, (nargs + 1) * sizeof(struct candy_wrap));
+  --self->nframes;
+  _enter(self, base - 1 - _stack(self), nargs);
+  return true;
+}
+
+/* move the results into the slot of the callee and pop its frame */
+static size_t _op_return(candy_vm_t *self, candy_wrap_t *base, candy_inst_t ins) {
+  candy_wrap_t *ra = base + ins.iabc.a;
+  size_t nresults = ins.iabc.b ? ins.iabc.b - 1U : (size_t)(_stack(self) + self->top - ra);
+  candy_upval_close(&self->openupval, base);
+  memmove(base - 1, ra, nresults * sizeof(struct candy_wrap));
+  self->top = (size_t)(base - 1 - _stack(self)) + nresults;
+  --self->nframes;
+  return nresults;
+}
+
+/* adjust the results to what the pending call of the caller asks for */
+static void _op_result(candy_vm_t *self, size_t nresults) {
+  const candy_frame_t *frame = _frame(self);
+  candy_inst_t call = frame->pc[-1];
+  if (call.iabc.c == 0)
+    return;
+  if (nresults < call.iabc.c - 1U)
+    _fill(frame->base + call.iabc.a + nresults, call.iabc.c - 1U - nresults);
+  self->top = (size_t)(frame->base - _stack(self)) + candy_proto_get_maxstack(frame->proto);
+}
+
+/* run the frames above 'entry', the topmost one from its saved pc on */
+static size_t _run(candy_vm_t *self, size_t entry) {
+  const candy_frame_t *frame;
+  const candy_inst_t *pc;
+  const candy_wrap_t *cnst;
+  candy_cache_t *caches;
+  candy_upval_t **upval;
+  candy_wrap_t *base;
+  candy_inst_t ins;
+  #if CANDY_PROFILE
+  uint32_t prev = OP_NUM;
+  #endif /* CANDY_PROFILE */
+  #if VM_COMPUTED_GOTO
+  static const void *const _label[] = {
+    #define CANDY_OP_LABEL
+    #include "core/candy_opcode.list"
+  };
+  #endif /* VM_COMPUTED_GOTO */
+  _reenter:
+  frame = _frame(self);
+  pc = frame->pc;
+  cnst = candy_proto_get_cnst(frame->proto);
+  caches = candy_proto_get_cache(frame->proto);
+  base = frame->base;
+  upval = candy_sclosure_get_upval((candy_sclosure_t *)candy_wrap_get_object(base - 1));
+  /* the native code runs on the same frame, up to what it cannot handle */
+  if (CANDY_JIT_X64 && candy_proto_get_jit(frame->proto)) {
+    const candy_inst_t *inst = candy_proto_get_inst(frame->proto);
+    pc = inst + candy_jit_run(candy_proto_get_jit(frame->proto), base, cnst, caches, self->glb, &self->budget, pc - inst);
+    vm_preempt(pc);
+  }
+  #if VM_COMPUTED_GOTO
+  vm_next();
+  #define CANDY_OP_GOTO
+  #include "core/candy_opcode.list"
+  #else /* VM_COMPUTED_GOTO */
+  while (1) {
+    ins = *pc++;
+    vm_profile();
+    switch (ins.op) {
+      #define CANDY_OP_CASE
+      #include "core/candy_opcode.list"
+      default:
+        vm_assert(false, "unknown opcode %d", ins.op);
+    }
+  }
+  #endif /* VM_COMPUTED_GOTO */
+}
+
+static size_t _execute(candy_vm_t *self, size_t func, size_t nargs) {
+  size_t entry = self->nframes;
+  _enter(self, func, nargs);
+  return _run(self, entry);
+}
+
+static size_t _ccall(candy_vm_t *self, candy_cfunc_t cfunc, size_t func, size_t nargs) {
+  size_t base = self->base;
+  self->base = func + 1;
+  self->top = self->base + nargs;
+  int nresults = cfunc(self->co);
+  vm_assert(nresults >= 0 && (size_t)nresults <= self->top - self->base, "c-function returned %d values", nresults);
+  memmove(_stack(self) + func, _stack(self) + self->top - nresults, nresults * sizeof(struct candy_wrap));
+  /* a call that keeps every result takes them up to the top */
+  self->top = func + nresults;
+  self->base = base;
+  return nresults;
+}
+
+/**
+  * @brief  a fast c-function gets its arguments in place, the results only
+  *         move down into the slot of the function
+  */
+static size_t _cfast(candy_vm_t *self, candy_fast_t fast, size_t func, size_t nargs) {
+  size_t base = self->base;
+  size_t window = nargs > CANDY_FAST_RESULTS ? nargs : CANDY_FAST_RESULTS;
+  _reserve(self, func + 1 + window);
+  self->base = func + 1;
+  self->top = self->base + nargs;
+  int nresults = fast((candy_args_t *)(_stack(self) + self->base), (int)nargs);
+  vm_assert(nresults >= 0 && (size_t)nresults <= window, "c-function returned %d values", nresults);
+  memmove(_stack(self) + func, _stack(self) + func + 1, nresults * sizeof(struct candy_wrap));
+  self->top = func + nresults;
+  self->base = base;
+  return nresults;
+}
+
+static void _call(candy_vm_t *self, size_t func, size_t nargs, int nresults) {
+  const candy_wrap_t *fn = _stack(self) + func;
+  size_t n = 0;
+  vm_assert(self->depth < VM_MAX_DEPTH, "maximum recursion depth exceeded");
+  ++self->depth;
+  switch (candy_wrap_get_type(fn)) {
+    case CANDY_TYPE_SCLSR:
+      n = _execute(self, func, nargs);
+      /* the results are left to the call that resumes the frames */
+      if (self->suspended) {
+        --self->depth;
+        return;
+      }
+      break;
+    case CANDY_TYPE_CFUNC:
+      n = _ccall(self, candy_wrap_get_cfunc(fn), func, nargs);
+      break;
+    case CANDY_TYPE_CFAST:
+      n = _cfast(self, candy_wrap_get_fast(fn), func, nargs);
+      break;
+    default:
+      vm_assert(false, "'%s' object is not callable", candy_type_str(candy_wrap_get_type(fn)));
+  }
+  --self->depth;
+  if (nresults < 0)
+    return;
+  if (n < (size_t)nresults) {
+    _reserve(self, func + nresults);
+    _fill(_stack(self) + func + n, nresults - n);
+  }
+  self->top = func + nresults;
+}
+
+int candy_vm_init(candy_vm_t *self, candy_state_t *co, candy_gc_t *gc, candy_table_t *glb) {
   candy_exce_init(&self->ctx);
   candy_vector_init(&self->root, sizeof(struct candy_wrap));
+  candy_vector_init(&self->frames, sizeof(struct candy_frame));
+  self->nframes = 0;
+  self->openupval = NULL;
+  self->base = 0;
+  self->top = 0;
+  self->depth = 0;
+  self->glb = glb;
+  self->co = co;
+  self->gc = gc;
+  self->budget = INT64_MAX;
+  self->slice = INT64_MAX;
+  self->preemptible = false;
+  self->suspended = false;
+  for (size_t idx = 0; idx < CANDY_VM_HOTLOOPS; ++idx)
+    self->hotloops[idx] = VM_HOTLOOP;
   return 0;
 }
 
 int candy_vm_deinit(candy_vm_t *self, candy_gc_t *gc) {
   candy_vector_deinit(&self->root, candy_gc_memory(gc));
+  candy_vector_deinit(&self->frames, candy_gc_memory(gc));
   candy_exce_deinit(&self->ctx);
   return 0;
 }
 
-// int candy_vm_fprint(candy_vm_t *self, FILE *out) {
-//   return candy_wrap_fprint(candy_vm_pop(self), out, 0, candy_table_fprint);
-// }
-
-// void candy_vm_push(candy_vm_t *self, const candy_wrap_t *wrap) {
-//   if (self->top < candy_wrap_size(&self->base))
-//     ((candy_wrap_t *)candy_wrap_get_wrap(&self->base))[self->top] = *wrap;
-//   else
-//     candy_wrap_append(&self->base, wrap, 1);
-//   ++self->top;
-// }
-
-// const candy_wrap_t *candy_vm_pop(candy_vm_t *self) {
-//   return self->top ? &candy_wrap_get_wrap(&self->base)[--self->top] : &null;
-// }
-
-// int candy_vm_regist(candy_vm_t *self, const candy_regist_t list[], int size) {
-//   for (int idx = 0; idx < size; ++idx) {
-//     candy_wrap_t key = {0}, val = {0};
-//     candy_wrap_set_string(&key, list[idx].name, strlen(list[idx].name));
-//     candy_wrap_set_cfunc(&val, &list[idx].func, 1);
-//     candy_table_set(&self->glb, &key, &val);
-//   }
-//   return 0;
-// }
-
-// int candy_vm_set_global(candy_vm_t *self, const char name[]) {
-//   candy_wrap_t key;
-//   candy_wrap_set_string(&key, name, strlen(name));
-//   candy_table_set(&self->glb, &key, candy_vm_pop(self));
-//   candy_wrap_deinit(&key);
-//   return 0;
-// }
-
-// int candy_vm_get_global(candy_vm_t *self, const char name[]) {
-//   candy_wrap_t key;
-//   candy_wrap_set_string(&key, name, strlen(name));
-//   candy_vm_push(self, candy_table_get(&self->glb, &key));
-//   candy_wrap_deinit(&key);
-//   return 0;
-// }
-
-// int candy_vm_call(candy_vm_t *self, int nargs, int nresults) {
-//   (*candy_wrap_get_cfunc(candy_vm_pop(self)))((candy_state_t *)self);
-//   return 0;
-// }
-
-// int candy_vm_execute(candy_vm_t *self, candy_proto_t *block) {
-//   return candy_exce_try(&self->io, (candy_try_catch_cb_t)execute, self, block);
-// }
+int candy_vm_diffusion(candy_vm_t *self, candy_gc_t *gc) {
+  candy_gc_colouring(gc, (candy_object_t *)self->glb);
+  for (size_t idx = 0; idx < self->top; ++idx)
+    candy_wrap_colouring(&_stack(self)[idx], gc);
+  for (candy_upval_t *it = self->openupval; it; it = candy_upval_next(it))
+    candy_gc_colouring(gc, (candy_object_t *)it);
+  return 0;
+}
+
+int candy_vm_fprint(candy_vm_t *self, size_t idx, FILE *out) {
+  return candy_wrap_fprint(candy_vm_get(self, idx), out, 0);
+}
+
+void candy_vm_push(candy_vm_t *self, const candy_wrap_t *wrap) {
+  _reserve(self, self->top + 1);
+  _stack(self)[self->top++] = *wrap;
+}
+
+const candy_wrap_t *candy_vm_pop(candy_vm_t *self) {
+  return self->top > self->base ? &_stack(self)[--self->top] : &CANDY_WRAP_NULL;
+}
+
+const candy_wrap_t *candy_vm_get(candy_vm_t *self, size_t idx) {
+  return self->base + idx < self->top ? &_stack(self)[self->base + idx] : &CANDY_WRAP_NULL;
+}
+
+size_t candy_vm_get_top(candy_vm_t *self) {
+  return self->top - self->base;
+}
+
+candy_wrap_t candy_vm_string(candy_vm_t *self, const char str[], size_t size) {
+  candy_wrap_t wrap;
+  candy_array_t *arr = candy_array_create(self->gc, &self->ctx, CANDY_TYPE_CHAR, MASK_NONE);
+  candy_array_append(arr, self->gc, &self->ctx, str, size);
+  candy_wrap_set_object(&wrap, (candy_object_t *)arr);
+  return wrap;
+}
+
+int candy_vm_regist(candy_vm_t *self, const candy_regist_t list[]) {
+  for (const candy_regist_t *it = list; it->name; ++it) {
+    candy_wrap_t val;
+    candy_wrap_set_cfunc(&val, it->func);
+    candy_vm_push(self, &val);
+    candy_vm_set_global(self, it->name);
+  }
+  return 0;
+}
+
+int candy_vm_regist_fast(candy_vm_t *self, const candy_regist_fast_t list[]) {
+  for (const candy_regist_fast_t *it = list; it->name; ++it) {
+    candy_wrap_t val;
+    candy_wrap_set_fast(&val, it->func);
+    candy_vm_push(self, &val);
+    candy_vm_set_global(self, it->name);
+  }
+  return 0;
+}
+
+int candy_vm_set_global(candy_vm_t *self, const char name[]) {
+  candy_wrap_t key = candy_vm_string(self, name, strlen(name));
+  candy_table_set(self->glb, self->gc, &self->ctx, &key, candy_vm_pop(self));
+  return 0;
+}
+
+int candy_vm_get_global(candy_vm_t *self, const char name[]) {
+  candy_wrap_t key = candy_vm_string(self, name, strlen(name));
+  candy_vm_push(self, candy_table_get(self->glb, &key));
+  return 0;
+}
+
+int candy_vm_call(candy_vm_t *self, int nargs, int nresults) {
+  _call(self, self->top - nargs - 1, nargs, nresults);
+  return 0;
+}
+
+int candy_vm_profile(candy_vm_t *self, FILE *out) {
+  #if CANDY_PROFILE
+  for (size_t first = 0; first < OP_NUM; ++first)
+    for (size_t second = 0; second < OP_NUM; ++second)
+      if (self->pairs[first][second])
+        fprintf(out, "%s %s %" PRIu64 "\n",
+          candy_opcode_str(first), candy_opcode_str(second), self->pairs[first][second]
+        );
+  #endif /* CANDY_PROFILE */
+  return 0;
+}
+
+bool candy_vm_fold(candy_opcodes_t op, candy_wrap_t *ra, const candy_wrap_t *rb, const candy_wrap_t *rc) {
+  if (!_is_number(rb) || !_is_number(rc))
+    return false;
+  switch (op) {
+    case OP_EQ:
+      candy_wrap_set_boolean(ra, _equal(rb, rc));
+      return true;
+    /* numbers are always ordered, nothing is raised */
+    case OP_LT:
+    case OP_LE:
+      candy_wrap_set_boolean(ra, _less(NULL, rb, rc, op == OP_LE));
+      return true;
+    default:
+      return _arith_number(op, ra, rb, rc);
+  }
+}
+
+void candy_vm_set_budget(candy_vm_t *self, int64_t budget) {
+  self->slice = budget > 0 ? budget : INT64_MAX;
+  self->budget = self->slice;
+}
+
+bool candy_vm_is_suspended(const candy_vm_t *self) {
+  return self->suspended;
+}
+
+struct protect_execute_arg {
+  candy_vm_t *vm;
+  candy_sclosure_t *cls;
+};
+
+static void protect_execute(struct protect_execute_arg *arg) {
+  candy_wrap_t wrap;
+  candy_wrap_set_object(&wrap, (candy_object_t *)arg->cls);
+  candy_vm_push(arg->vm, &wrap);
+  candy_vm_call(arg->vm, 0, 0);
+}
+
+/* finish the call of @ref protect_execute where it has been suspended */
+static void protect_resume(candy_vm_t *self) {
+  size_t func = _frames(self)[0].base - 1 - _stack(self);
+  ++self->depth;
+  _run(self, 0);
+  --self->depth;
+  if (!self->suspended)
+    self->top = func;
+}
+
+/**
+  * @brief  run 'cb' so that it may be suspended, an error drops whatever
+  *         frames it has left
+  */
+static candy_err_t _preemptible(candy_vm_t *self, candy_exce_cb_t cb, void *arg, size_t top, size_t nframes, candy_object_t **msg) {
+  size_t base = self->base, depth = self->depth;
+  self->budget = self->slice;
+  self->preemptible = true;
+  self->suspended = false;
+  candy_err_t err = candy_exce_try(&self->ctx, cb, arg, msg);
+  self->preemptible = false;
+  if (err != EXCE_OK) {
+    candy_upval_close(&self->openupval, _stack(self) + top);
+    self->base = base;
+    self->top = top;
+    self->depth = depth;
+    self->nframes = nframes;
+    self->suspended = false;
+  }
+  return err;
+}
+
+candy_err_t candy_vm_execute(candy_vm_t *self, candy_sclosure_t *cls, candy_object_t **msg) {
+  struct protect_execute_arg arg = {
+    .vm = self,
+    .cls = cls,
+  };
+  return _preemptible(self, (candy_exce_cb_t)protect_execute, &arg, self->top, self->nframes, msg);
+}
+
+candy_err_t candy_vm_resume(candy_vm_t *self, candy_object_t **msg) {
+  if (!self->suspended)
+    return EXCE_OK;
+  /* only the outermost call is suspended, its frame is the first one */
+  return _preemptible(self, (candy_exce_cb_t)protect_resume, self, _frames(self)[0].base - 1 - _stack(self), 0, msg);
+}
@@ -21,27 +21,100 @@ extern "C" {
 
 #include "core/candy_exception.h"
 #include "core/candy_vector.h"
+#include "core/candy_proto.h"
 #include "core/candy_priv.h"
 
-typedef struct candy_vm candy_vm_t;
+typedef struct candy_frame candy_frame_t;
+
+/* counters of the loops about to be traced */
+#define CANDY_VM_HOTLOOPS 64
+
+/**
+  * @brief  activation record of a script function, the records of nested
+  *         calls are stacked in one region that only grows when it is full
+  */
+struct candy_frame {
+  /* first register, fixed up whenever the register stack moves */
+  candy_wrap_t *base;
+  /* instruction to resume at once the callee returns */
+  const candy_inst_t *pc;
+  const candy_proto_t *proto;
+};
 
 struct candy_vm {
   candy_exce_t ctx;
+  /* register stack shared by every frame of this state */
   candy_vector_t root;
+  candy_vector_t frames;
+  size_t nframes;
+  /* upvalues still in registers, from the highest one down */
+  candy_upval_t *openupval;
+  /* window of the running c-function, relative to root */
+  size_t base;
+  size_t top;
+  /* calls nested on the c stack */
+  size_t depth;
+  /* backward jumps and calls left until the frames are suspended */
+  int64_t budget;
+  /* what the budget is refilled with at each execute or resume */
+  int64_t slice;
+  /* whether the running call has been started by @ref candy_vm_execute */
+  bool preemptible;
+  bool suspended;
+  candy_table_t *glb;
+  candy_state_t *co;
+  candy_gc_t *gc;
+  /* iterations left until a loop is traced, hashed by its backward jump */
+  uint16_t hotloops[CANDY_VM_HOTLOOPS];
+  #if CANDY_PROFILE
+  /* dynamic count of each pair of consecutive opcodes */
+  uint64_t pairs[CANDY_OPCODE_MAX][CANDY_OPCODE_MAX];
+  #endif /* CANDY_PROFILE */
 };
 
-int candy_vm_init(candy_vm_t *self);
+int candy_vm_init(candy_vm_t *self, candy_state_t *co, candy_gc_t *gc, candy_table_t *glb);
 int candy_vm_deinit(candy_vm_t *self, candy_gc_t *gc);
 
-int candy_vm_fprint(candy_vm_t *self, FILE *out);
+int candy_vm_diffusion(candy_vm_t *self, candy_gc_t *gc);
+
+int candy_vm_fprint(candy_vm_t *self, size_t idx, FILE *out);
 
 void candy_vm_push(candy_vm_t *self, const candy_wrap_t *wrap);
 const candy_wrap_t *candy_vm_pop(candy_vm_t *self);
+const candy_wrap_t *candy_vm_get(candy_vm_t *self, size_t idx);
+size_t candy_vm_get_top(candy_vm_t *self);
 
+candy_wrap_t candy_vm_string(candy_vm_t *self, const char str[], size_t size);
+
+int candy_vm_regist(candy_vm_t *self, const candy_regist_t list[]);
+int candy_vm_regist_fast(candy_vm_t *self, const candy_regist_fast_t list[]);
 int candy_vm_set_global(candy_vm_t *self, const char name[]);
 int candy_vm_get_global(candy_vm_t *self, const char name[]);
 int candy_vm_call(candy_vm_t *self, int nargs, int nresults);
-int candy_vm_execute(candy_vm_t *self, candy_gc_t *gc);
+candy_err_t candy_vm_execute(candy_vm_t *self, candy_sclosure_t *cls, candy_object_t **msg);
+
+/**
+  * @brief  apply an arithmetic or comparison opcode to two numbers the way
+  *         the interpreter does, so the compiler can fold constants
+  * @retval false if an operand is no number or the operation would raise
+  */
+bool candy_vm_fold(candy_opcodes_t op, candy_wrap_t *ra, const candy_wrap_t *rb, const candy_wrap_t *rc);
+
+/**
+  * @brief  limit how many backward jumps and calls each call of
+  *         @ref candy_vm_execute and @ref candy_vm_resume runs before it
+  *         returns with the frames suspended, a budget of 0 removes the limit
+  */
+void candy_vm_set_budget(candy_vm_t *self, int64_t budget);
+bool candy_vm_is_suspended(const candy_vm_t *self);
+/* continue the suspended frames for another slice of the budget */
+candy_err_t candy_vm_resume(candy_vm_t *self, candy_object_t **msg);
+
+/**
+  * @brief  dump the opcode pair counts as 'first second count' lines, which
+  *         is the input of candy_opcode.py, only recorded by CANDY_PROFILE builds
+  */
+int candy_vm_profile(candy_vm_t *self, FILE *out);
 
 #ifdef __cplusplus
 }
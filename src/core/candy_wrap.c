@@ -15,6 +15,7 @@
   */
 #include "core/candy_wrap.h"
 #include "core/candy_lib.h"
+#include "core/candy_array.h"
 #include <inttypes.h>
 
 const candy_wrap_t CANDY_WRAP_NULL = {0};
@@ -27,9 +28,19 @@ int candy_wrap_fprint(const candy_wrap_t *self, FILE *out, int align) {
       return fprintf(out, "%*" PRId64, align, candy_wrap_get_integer(self));
     case CANDY_TYPE_FLOAT:
       return fprintf(out, "%*f", align, candy_wrap_get_float(self));
+    case CANDY_TYPE_BOOLEAN:
+      return fprintf(out, "%*s", align, candy_wrap_get_boolean(self) ? "true" : "false");
+    case CANDY_TYPE_CHAR:
+      if (!candy_wrap_is_string(self))
+        break;
+      return fprintf(out, "%*.*s", align,
+        (int)candy_array_size((candy_array_t *)candy_wrap_get_object(self)),
+        (char *)candy_array_data((candy_array_t *)candy_wrap_get_object(self))
+      );
     // case CANDY_TYPE_CFUNC:
     //   return fprintf(out, "%*p", align, candy_wrap_get_cfunc(self));
     default:
-      return fprintf(out, "%*s", align, "NA");
+      break;
   }
+  return fprintf(out, "%*s", align, "NA");
 }
@@ -20,6 +20,7 @@ extern "C" {
 #endif /* __cplusplus */
 
 #include "core/candy_object.h"
+#include "core/candy_gc.h"
 #include "core/candy_priv.h"
 #include <assert.h>
 
@@ -79,6 +80,11 @@ static inline void candy_wrap_set_mask(candy_wrap_t *self, uint8_t mask) {
   self->mask = mask;
 }
 
+static inline void candy_wrap_set_none(candy_wrap_t *self) {
+  candy_wrap_set_type(self, CANDY_TYPE_NONE);
+  candy_wrap_set_mask(self, MASK_NONE);
+}
+
 static inline candy_integer_t candy_wrap_get_integer(const candy_wrap_t *self) {
   assert(candy_wrap_get_type(self) == CANDY_TYPE_INTEGER);
   assert(self->mask == MASK_NONE);
@@ -127,8 +133,43 @@ static inline void candy_wrap_set_cfunc(candy_wrap_t *self, const candy_cfunc_t
   *(candy_cfunc_t *)candy_wrap_data(self) = val;
 }
 
+static inline candy_fast_t candy_wrap_get_fast(const candy_wrap_t *self) {
+  assert(candy_wrap_get_type(self) == CANDY_TYPE_CFAST);
+  assert(self->mask == MASK_NONE);
+  return *(candy_fast_t *)candy_wrap_data(self);
+}
+
+static inline void candy_wrap_set_fast(candy_wrap_t *self, const candy_fast_t val) {
+  candy_wrap_set_type(self, CANDY_TYPE_CFAST);
+  candy_wrap_set_mask(self, MASK_NONE);
+  *(candy_fast_t *)candy_wrap_data(self) = val;
+}
+
+/**
+  * @brief  whether the wrap refers to a garbage collected object
+  */
+static inline bool candy_wrap_is_object(const candy_wrap_t *self) {
+  if (candy_wrap_get_mask(self) & MASK_ARRAY)
+    return true;
+  switch (candy_wrap_get_type(self)) {
+    case CANDY_TYPE_CCLSR:
+    case CANDY_TYPE_SCLSR:
+    case CANDY_TYPE_UDHVY:
+    case CANDY_TYPE_TABLE:
+    case CANDY_TYPE_PROTO:
+    case CANDY_TYPE_STATE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static inline bool candy_wrap_is_string(const candy_wrap_t *self) {
+  return candy_wrap_get_type(self) == CANDY_TYPE_CHAR && (candy_wrap_get_mask(self) & MASK_ARRAY);
+}
+
 static inline candy_object_t *candy_wrap_get_object(const candy_wrap_t *self) {
-  assert(self->mask != MASK_NONE);
+  assert(candy_wrap_is_object(self));
   return *(candy_object_t **)candy_wrap_data(self);
 }
 
@@ -138,6 +179,11 @@ static inline void candy_wrap_set_object(candy_wrap_t *self, const candy_object_
   *(const candy_object_t **)candy_wrap_data(self) = val;
 }
 
+static inline void candy_wrap_colouring(const candy_wrap_t *self, candy_gc_t *gc) {
+  if (candy_wrap_is_object(self))
+    candy_gc_colouring(gc, candy_wrap_get_object(self));
+}
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -20,9 +20,13 @@
 #include "core/candy_reader.h"
 #include "core/candy_array.h"
 #include <string>
+#include <vector>
 
 #define TEST_BODY(_name, _token, _exp, ...) \
-TEST(lexer, unique_name(_name)) { tast_body<_token>(_exp __VA_OPT__(,) __VA_ARGS__); }
+TEST(lexer, unique_name(_name)) { \
+  tast_body<_token>(string_reader, _exp __VA_OPT__(,) __VA_ARGS__); \
+  tast_body<_token>(stream_reader, _exp __VA_OPT__(,) __VA_ARGS__); \
+}
 
 #define TEST_ASSERT(_name, _exp, ...) \
 TEST_BODY(_name, TK_EOS, _exp __VA_OPT__(,) __VA_ARGS__)
@@ -66,8 +70,13 @@ static void test_normal(const candy_meta_t &meta, const supposed &val) {
   }
 }
 
+/* any other reader than the string one is read through the buffer */
+static int stream_reader(char buffer[], const size_t max_len, void *arg) {
+  return string_reader(buffer, max_len, arg);
+}
+
 template <candy_tokens_t token, typename ... supposed>
-static void tast_body(const char exp[], const supposed & ... value) {
+static void tast_body(candy_reader_t reader, const char exp[], const supposed & ... value) {
   struct catch_info {
     candy_lexer ls{};
     candy_meta_t next{};
@@ -78,7 +87,7 @@ static void tast_body(const char exp[], const supposed & ... value) {
   str_info info{exp, strlen(exp), 0};
   candy_exce_init(&ctx);
   candy_gc_init(&gc, handler, test_allocator, nullptr);
-  candy_lexer_init(&cinfo.ls, &gc, &ctx, string_reader, &info);
+  candy_lexer_init(&cinfo.ls, &gc, &ctx, reader, &info);
   candy_object_t *msg = nullptr;
   auto err = candy_exce_try(&ctx, (candy_exce_cb_t)+[](catch_info *self) {
     EXPECT_EQ(candy_lexer_lookahead(&self->ls), token);
@@ -191,6 +200,55 @@ TEST_ASSERT(number_invalid, "0x1x",  "lexical error: extra text after expected e
 TEST_ASSERT(number_invalid, "0x1.4", "lexical error: invalid float number"sv)
 TEST_ASSERT(number_invalid, "1..2",  "lexical error: malformed number"sv)
 
+/* a few bytes per call, the tokens cross the end of the ring many times */
+static int trickle_reader(char buffer[], const size_t max_len, void *arg) {
+  return string_reader(buffer, max_len < 7 ? max_len : 7, arg);
+}
+
+/* the tokens of 'exp', each one with its text or value */
+static std::vector<std::string> tokens(candy_reader_t reader, const std::string &exp) {
+  struct catch_info {
+    candy_lexer ls{};
+    std::vector<std::string> out;
+  };
+  catch_info cinfo{};
+  candy_exce_t ctx{};
+  candy_gc_t gc{};
+  str_info info{exp.data(), exp.size(), 0};
+  candy_exce_init(&ctx);
+  candy_gc_init(&gc, handler, test_allocator, nullptr);
+  candy_lexer_init(&cinfo.ls, &gc, &ctx, reader, &info);
+  candy_object_t *msg = nullptr;
+  auto err = candy_exce_try(&ctx, (candy_exce_cb_t)+[](catch_info *self) {
+    for (candy_tokens_t token; (token = candy_lexer_lookahead(&self->ls)) != TK_EOS;) {
+      const candy_meta_t *meta = candy_lexer_next(&self->ls);
+      std::string text = candy_token_str(token);
+      if (token == TK_IDENT || token == TK_STRING)
+        text += " " + std::string((const char *)candy_array_data(meta->s), candy_array_size(meta->s));
+      else if (token == TK_INTEGER)
+        text += " " + std::to_string(meta->i);
+      else if (token == TK_FLOAT)
+        text += " " + std::to_string(meta->f);
+      self->out.push_back(text);
+    }
+  }, &cinfo, &msg);
+  EXPECT_EQ(err, EXCE_OK);
+  candy_lexer_deinit(&cinfo.ls);
+  candy_gc_deinit(&gc);
+  candy_exce_deinit(&ctx);
+  return cinfo.out;
+}
+
+TEST(lexer, stream) {
+  std::string exp;
+  for (int idx = 0; idx < 2000; ++idx)
+    exp += "name" + std::to_string(idx) + " = 0x" + std::to_string(idx) + " + 'a\\x41\\n" + std::to_string(idx) + "' ... 1.5e2 # note\n";
+  auto in_place = tokens(string_reader, exp);
+  EXPECT_EQ(in_place.size(), 2000U * 7);
+  EXPECT_EQ(tokens(stream_reader, exp), in_place);
+  EXPECT_EQ(tokens(trickle_reader, exp), in_place);
+}
+
 TEST_NORMAL(ident, TK_IDENT, "i")
 TEST_NORMAL(ident, TK_IDENT, "ifif")
 
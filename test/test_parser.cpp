@@ -14,28 +14,580 @@
   * limitations under the License.
   */
 #include "test.h"
-#include "core/candy_exce.h"
+#include "core/candy.h"
+#include "core/candy_state.h"
+#include "core/candy_vm.h"
+#include "core/candy_wrap.h"
 #include "core/candy_parser.h"
 #include "core/candy_reader.h"
+#include "core/candy_closure.h"
+#include "core/candy_proto.h"
+#include "core/candy_peephole.h"
+#include <string.h>
+#include <cmath>
+#include <string>
 
-#define PARSER_TEST(_name, _exp) TEST(parser, _name) {test_body(_exp);}
-
-// static void test_body(const char exp[]) {
-//   str_info info = {exp, strlen(exp), 0};
-//   candy_exce_t io;
-//   candy_exce_init(&io);
-//   auto tick = os::tick_ns();
-//   EXPECT_EQ(candy_parse(&io, string_reader, &info) != 0, false);
-//   printf("delta time = %ld ns\n", os::tick_ns() - tick);
-//   candy_exce_deinit(&io);
-// }
-
-// PARSER_TEST(exp_add_0, "a = 1 + 2")
-// PARSER_TEST(exp_add_1, "a = (1 + 2)")
-// PARSER_TEST(exp_sub_0, "a = 1 - 2")
-// PARSER_TEST(exp_sub_1, "a = (1 - 2)")
-// PARSER_TEST(exp_mul_0, "a = 1 * 2")
-// PARSER_TEST(exp_mul_1, "a = (1 * 2)")
-// PARSER_TEST(exp_div_0, "a = 1 / 2")
-// PARSER_TEST(exp_div_1, "a = (1 / 2)")
-// PARSER_TEST(exp, "a = (((-0xa + (-2e+3 *+2e-2)/(-4.5e+5 +-1.5e-2))*(6.4 --7.6) + (+8.4 + 9) * 10)/11) - 12")
+struct parser_fixture : public testing::Test {
+  candy_state_t *state = nullptr;
+  int level = 1;
+  bool lazy = false;
+
+  void SetUp() override {
+    state = candy_new_state(test_allocator, nullptr);
+  }
+
+  void TearDown() override {
+    candy_close(state);
+  }
+
+  int run(const char exp[]) {
+    return candy_dostring(state, exp, strlen(exp));
+  }
+
+  const candy_wrap_t *global(const char name[]) {
+    candy_vm_t *vm = candy_state_vm(state);
+    candy_vm_get_global(vm, name);
+    return candy_vm_pop(vm);
+  }
+
+  candy_integer_t integer(const char name[]) {
+    return candy_wrap_get_integer(global(name));
+  }
+
+  candy_proto_t *compile(const char exp[]) {
+    candy_vm_t *vm = candy_state_vm(state);
+    str_info info = {exp, strlen(exp), 0};
+    candy_object_t *out = candy_parse(vm->gc, &vm->ctx, level, lazy, string_reader, &info);
+    EXPECT_EQ(candy_object_get_type(out), CANDY_TYPE_SCLSR);
+    return candy_sclosure_get_proto((candy_sclosure_t *)out);
+  }
+
+  /* how often 'op' occurs in the instructions of 'proto' */
+  size_t count(const candy_proto_t *proto, candy_opcodes_t op) {
+    size_t n = 0;
+    for (size_t idx = 0; idx < candy_proto_get_size_inst(proto); ++idx)
+      n += candy_peephole_first((candy_opcodes_t)candy_proto_get_inst(proto)[idx].op) == op;
+    return n;
+  }
+};
+
+#define PARSER_TEST(_name, _exp, _val) TEST_F(parser_fixture, _name) { \
+  EXPECT_EQ(run("a = " _exp), 0); \
+  EXPECT_EQ(integer("a"), _val); \
+}
+
+PARSER_TEST(exp_add_0, "1 + 2", 3)
+PARSER_TEST(exp_add_1, "(1 + 2)", 3)
+PARSER_TEST(exp_sub_0, "1 - 2", -1)
+PARSER_TEST(exp_sub_1, "(1 - 2)", -1)
+PARSER_TEST(exp_mul_0, "1 * 2", 2)
+PARSER_TEST(exp_mul_1, "(1 * 2)", 2)
+PARSER_TEST(exp_precedence, "1 + 2 * 3 - 4", 3)
+PARSER_TEST(exp_unary, "-(2 - 5) * -+2", -6)
+PARSER_TEST(exp_bitwise, "1 | 6 & 3 ^ 1 << 2", 7)
+PARSER_TEST(exp_hex, "0xe+1", 15)
+
+TEST_F(parser_fixture, exp_float) {
+  EXPECT_EQ(run("a = (((-0xa + (-2e+3 *+2e-2)/(-4.5e+5 +-1.5e-2))*(6.4 --7.6) + (+8.4 + 9) * 10)/11) - 12"), 0);
+  EXPECT_DOUBLE_EQ(candy_wrap_get_float(global("a")), (((-0xa + (-2e+3 * +2e-2) / (-4.5e+5 + -1.5e-2)) * (6.4 - -7.6) + (+8.4 + 9) * 10) / 11) - 12);
+}
+
+TEST_F(parser_fixture, compare) {
+  EXPECT_EQ(run("a = 1 < 2 b = 1 >= 2 c = 3 != 3 d = 2 == 2"), 0);
+  EXPECT_EQ(candy_wrap_get_boolean(global("a")), true);
+  EXPECT_EQ(candy_wrap_get_boolean(global("b")), false);
+  EXPECT_EQ(candy_wrap_get_boolean(global("c")), false);
+  EXPECT_EQ(candy_wrap_get_boolean(global("d")), true);
+}
+
+TEST_F(parser_fixture, control) {
+  EXPECT_EQ(run(
+    "a = 0 n = 0\n"
+    "while n < 10\n"
+    "  n += 1\n"
+    "  if n % 2 == 0\n"
+    "    a += n\n"
+    "  elif n == 5\n"
+    "    a -= 100\n"
+    "  else\n"
+    "    a += 1\n"
+    "  end\n"
+    "end\n"
+  ), 0);
+  EXPECT_EQ(integer("a"), 2 + 4 + 6 + 8 + 10 + 4 - 100);
+}
+
+TEST_F(parser_fixture, numeric_for) {
+  EXPECT_EQ(run(
+    "def sum(n) s = 0 for i = 1, n s += i end return s end\n"
+    "def count(a, b, c) n = 0 for i = a, b, c n += 1 end return n end\n"
+    "a = sum(100) b = 0 for j = 10, 1, -3 b += j end\n"
+    "c = 0 for k = 0.5, 2 c += k end\n"
+    "d = count(5, 1, 1) e = count(9223372036854775805, 9223372036854775807, 1)\n"
+    "f = count(-9223372036854775807 - 1, 9223372036854775807, 9223372036854775807)\n"
+  ), 0);
+  EXPECT_EQ(integer("a"), 5050);
+  EXPECT_EQ(integer("b"), 10 + 7 + 4 + 1);
+  EXPECT_EQ(candy_wrap_get_float(global("c")), 2.0);
+  /* the variable of the chunk is a global, left at its last value */
+  EXPECT_EQ(integer("j"), 1);
+  EXPECT_EQ(integer("d"), 0);
+  /* no overflow near the ends of the integers */
+  EXPECT_EQ(integer("e"), 3);
+  EXPECT_EQ(integer("f"), 3);
+  EXPECT_NE(run("for i = 1, 2, 0 end"), 0);
+  EXPECT_NE(run("for i = 1, 'x' end"), 0);
+}
+
+TEST_F(parser_fixture, jump_table) {
+  const char exp[] =
+    "def kind(x)\n"
+    "  if x == 1 return 10\n"
+    "  elif x == 'two' return 20\n"
+    "  elif 3 == x return 30\n"
+    "  elif x == 1 return 40\n"
+    "  elif x == -5 return 50\n"
+    "  else return 0 end\n"
+    "end\n"
+    "def last(x) r = 0 if x == 1 r = 1 elif x == 2 r = 2 elif x == 3 r = 3 elif x == 4 end return r end\n"
+    "def few(x, y) if x == 1 return 1 elif x == 2 return 2 elif x == 3 return 3 end\n"
+    "  if x == 1 return 1 elif y == 2 return 2 elif x == 3 return 3 elif x == 4 return 4 end return 0 end\n";
+  auto chunk = compile(exp);
+  /* the tests left behind the table are dead */
+  EXPECT_EQ(count(candy_proto_get_proto(chunk, 0), OP_JMPTAB), 1);
+  EXPECT_EQ(count(candy_proto_get_proto(chunk, 0), OP_EQ), 0);
+  EXPECT_EQ(count(candy_proto_get_proto(chunk, 1), OP_JMPTAB), 1);
+  /* too short a chain or one on two locals */
+  EXPECT_EQ(count(candy_proto_get_proto(chunk, 2), OP_JMPTAB), 0);
+  level = 0;
+  EXPECT_EQ(count(candy_proto_get_proto(compile(exp), 0), OP_JMPTAB), 0);
+  level = 1;
+  EXPECT_EQ(run(exp), 0);
+  EXPECT_EQ(run(
+    "a = kind(1) b = kind('two') c = kind(3.0) d = kind(-5) e = kind(7) f = kind('three') g = kind(1.5)\n"
+    "h = last(3) i = last(4) j = last(9)\n"
+  ), 0);
+  EXPECT_EQ(integer("a"), 10);
+  EXPECT_EQ(integer("b"), 20);
+  /* a float equal to a case takes it as the comparison would */
+  EXPECT_EQ(integer("c"), 30);
+  EXPECT_EQ(integer("d"), 50);
+  EXPECT_EQ(integer("e"), 0);
+  EXPECT_EQ(integer("f"), 0);
+  EXPECT_EQ(integer("g"), 0);
+  EXPECT_EQ(integer("h"), 3);
+  EXPECT_EQ(integer("i"), 0);
+  EXPECT_EQ(integer("j"), 0);
+}
+
+TEST_F(parser_fixture, function) {
+  EXPECT_EQ(run(
+    "def fib(n)\n"
+    "  if (n < 2)\n"
+    "    return n\n"
+    "  end\n"
+    "  return fib(n - 2) + fib(n - 1)\n"
+    "end\n"
+    "def add(a, b) return a + b end\n"
+    "def sum(n, acc)\n"
+    "  if n == 0 return acc end\n"
+    "  return sum(n - 1, acc + n)\n"
+    "end\n"
+    "a = fib(20) b = add(add(1, 2), fib(10)) c = sum(100000, 0)\n"
+  ), 0);
+  EXPECT_EQ(integer("a"), 6765);
+  EXPECT_EQ(integer("b"), 58);
+  /* a returned call runs as a tail call */
+  EXPECT_EQ(integer("c"), 5000050000);
+}
+
+static int cfunc_one(candy_state_t *self) {
+  candy_push_integer(self, 42);
+  return 1;
+}
+
+static int cfunc_count(candy_state_t *self) {
+  candy_push_integer(self, candy_get_top(self));
+  return 1;
+}
+
+TEST_F(parser_fixture, cfunction) {
+  static const candy_regist_t list[] = {
+    {"one", cfunc_one},
+    {"count", cfunc_count},
+    {nullptr, nullptr},
+  };
+  candy_regist(state, list);
+  /* a call that keeps every result gets only the returned ones */
+  EXPECT_EQ(run("a = count(one()) b = count(1, one(2, 3)) c = count(one(), one())"), 0);
+  EXPECT_EQ(integer("a"), 1);
+  EXPECT_EQ(integer("b"), 2);
+  EXPECT_EQ(integer("c"), 2);
+  /* a tail call returns nothing but the results either */
+  EXPECT_EQ(count(candy_proto_get_proto(compile("def g(x) return one(x, x, x) end"), 0), OP_TAILCALL), 1U);
+  EXPECT_EQ(run(
+    "def g(x) return one(x, x, x) end\n"
+    "def h() return count(g(1), g(2)) end\n"
+    "d = count(g(1)) e = h()\n"
+  ), 0);
+  EXPECT_EQ(integer("d"), 1);
+  EXPECT_EQ(integer("e"), 2);
+}
+
+static int fast_count(candy_args_t *args, int nargs) {
+  candy_arg_set_integer(args, 0, nargs);
+  return 1;
+}
+
+static int fast_pair(candy_args_t *args, int nargs) {
+  candy_arg_set_integer(args, 0, 40);
+  candy_arg_set_integer(args, 1, 2);
+  return 2;
+}
+
+TEST_F(parser_fixture, cfast) {
+  static const candy_regist_fast_t list[] = {
+    {"count", fast_count},
+    {"pair", fast_pair},
+    {nullptr, nullptr},
+  };
+  candy_regist_fast(state, list);
+  /* the window is wider than the results, only these are kept */
+  EXPECT_EQ(run("a = count(pair()) b = count(1, 2, 3, pair()) c = count(count(1, 2, 3, 4, 5, 6))"), 0);
+  EXPECT_EQ(integer("a"), 2);
+  EXPECT_EQ(integer("b"), 5);
+  EXPECT_EQ(integer("c"), 1);
+}
+
+TEST_F(parser_fixture, local) {
+  const char exp[] =
+    "def f(n)\n"
+    "  a = n * 2\n"
+    "  b = a + 1\n"
+    "  c = b * b\n"
+    "  d = c - a\n"
+    "  return d\n"
+    "end\n"
+    "def g(n)\n"
+    "  i = 0 s = 0\n"
+    "  while i < n\n"
+    "    if i == 0 first = 10 end\n"
+    "    s += first\n"
+    "    i += 1\n"
+    "    t = i * 100\n"
+    "    s += t - t\n"
+    "  end\n"
+    "  return s\n"
+    "end\n"
+    "def h(c)\n"
+    "  if c x = 1 elif c == false y = 2 return y end\n"
+    "  return x\n"
+    "end\n";
+  /* 'b' is dead once 'c' is known, 'd' takes its slot */
+  EXPECT_EQ(candy_proto_get_maxstack(candy_proto_get_proto(compile(exp), 0)), 4);
+  EXPECT_EQ(run(exp), 0);
+  EXPECT_EQ(run("r = f(3) s = g(3) t = h(true) u = h(false) v = h(none)"), 0);
+  EXPECT_EQ(integer("r"), 43);
+  EXPECT_EQ(integer("s"), 30);
+  EXPECT_EQ(integer("t"), 1);
+  EXPECT_EQ(integer("u"), 2);
+  EXPECT_EQ(candy_wrap_get_type(global("v")), CANDY_TYPE_NONE);
+  /* none of them leaks out of its function */
+  EXPECT_EQ(candy_wrap_get_type(global("a")), CANDY_TYPE_NULL);
+  EXPECT_EQ(candy_wrap_get_type(global("first")), CANDY_TYPE_NULL);
+}
+
+TEST_F(parser_fixture, upvalue) {
+  const char exp[] =
+    "def counter()\n"
+    "  n = 0\n"
+    "  def inc() n += 1 return n end\n"
+    "  return inc\n"
+    "end\n"
+    "def shared()\n"
+    "  x = 10\n"
+    "  def get() return x end\n"
+    "  def set(v) x = v end\n"
+    "  set(5) r = get() x = 7\n"
+    "  return r * 100 + get()\n"
+    "end\n"
+    "def outer(k)\n"
+    "  def mid()\n"
+    "    def fact(m) if m < 2 return k end return m * fact(m - 1) end\n"
+    "    return fact\n"
+    "  end\n"
+    "  return mid()\n"
+    "end\n";
+  auto proto = candy_proto_get_proto(compile(exp), 0);
+  /* 'n' is read twice and written once through the upvalue, 'inc' is a local */
+  EXPECT_EQ(count(candy_proto_get_proto(proto, 0), OP_GETUPVAL), 2);
+  EXPECT_EQ(count(candy_proto_get_proto(proto, 0), OP_SETUPVAL), 1);
+  EXPECT_EQ(count(proto, OP_GETTABUP), 0);
+  for (int opt : {0, 1}) {
+    candy_set_optimize(state, opt);
+    EXPECT_EQ(run(exp), 0);
+    EXPECT_EQ(run("c = counter() c() c() a = c() b = counter()() d = shared() e = outer(2)(5)"), 0);
+    EXPECT_EQ(integer("a"), 3);
+    EXPECT_EQ(integer("b"), 1);
+    EXPECT_EQ(integer("d"), 507);
+    EXPECT_EQ(integer("e"), 240);
+    EXPECT_EQ(candy_wrap_get_type(global("inc")), CANDY_TYPE_NULL);
+  }
+}
+
+static int cfunc_used(candy_state_t *self) {
+  candy_vm_t *vm = candy_state_vm(self);
+  candy_push_integer(self, (candy_integer_t)candy_memory_used(candy_gc_memory(vm->gc)));
+  return 1;
+}
+
+TEST_F(parser_fixture, closure) {
+  const char exp[] =
+    "def helper() def inc(x) return x + 1 end return inc end\n"
+    "def capture(x) def get() return x end return get end\n"
+    "def loop(n)\n"
+    "  s = 0 i = 0\n"
+    "  while i < n\n"
+    "    def add(v) s += v end\n"
+    "    add(i) i += 1\n"
+    "  end\n"
+    "  return s\n"
+    "end\n"
+    "def twice(x) def sq(y) return y * y end return sq(x) + sq(x) end\n"
+    "def many(n) i = 0 t = 0 while i < n t += twice(i) i += 1 end return t end\n"
+    "def func(str) def lambda() return str end return str end\n";
+  auto chunk = compile(exp);
+  /* returned, so each call needs a closure of its own */
+  EXPECT_FALSE(candy_proto_is_framed(candy_proto_get_proto(candy_proto_get_proto(chunk, 0), 0)));
+  EXPECT_FALSE(candy_proto_is_framed(candy_proto_get_proto(candy_proto_get_proto(chunk, 1), 0)));
+  /* only ever called */
+  EXPECT_TRUE(candy_proto_is_framed(candy_proto_get_proto(candy_proto_get_proto(chunk, 2), 0)));
+  EXPECT_TRUE(candy_proto_is_framed(candy_proto_get_proto(candy_proto_get_proto(chunk, 3), 0)));
+  /* never read, it is not created at all */
+  EXPECT_EQ(count(candy_proto_get_proto(chunk, 5), OP_CLOSURE), 0);
+  EXPECT_EQ(run(exp), 0);
+  EXPECT_EQ(run("a = helper() == helper() p = capture(1) q = capture(2) b = p == q c = p() * 10 + q()"), 0);
+  EXPECT_FALSE(candy_wrap_get_boolean(global("a")));
+  EXPECT_FALSE(candy_wrap_get_boolean(global("b")));
+  EXPECT_EQ(integer("c"), 12);
+  static const candy_regist_t list[] = {
+    {"used", cfunc_used},
+    {nullptr, nullptr},
+  };
+  candy_regist(state, list);
+  /* the collector only runs between scripts, the loops stay too short to be traced */
+  EXPECT_EQ(run("d = 0 e = 0 u0 = 0 u1 = 0 u2 = 0"), 0);
+  EXPECT_EQ(run("u0 = used() d = loop(1) u1 = used() e = loop(50) u2 = used()"), 0);
+  EXPECT_EQ(integer("d"), 0);
+  EXPECT_EQ(integer("e"), 1225);
+  /* a call creates 'add' once, however often it loops */
+  EXPECT_GT(integer("u1") - integer("u0"), 0);
+  EXPECT_EQ(integer("u2") - integer("u1"), integer("u1") - integer("u0"));
+  EXPECT_EQ(run("u0 = used() d = many(1) u1 = used() e = many(50) u2 = used()"), 0);
+  EXPECT_EQ(integer("d"), 0);
+  EXPECT_EQ(integer("e"), 2 * 40425);
+  /* 'sq' is created by the first call only */
+  EXPECT_GT(integer("u1") - integer("u0"), 0);
+  EXPECT_EQ(integer("u2") - integer("u1"), 0);
+}
+
+TEST_F(parser_fixture, lazy) {
+  const char exp[] =
+    "def f(x, y)\n"
+    "  def g(v) return v * y end\n"
+    "  if x > 0 while x > 10 x -= 10 end end\n"
+    "  return g(x) # end\n"
+    "end\n"
+    "def broken() return ) end\n"
+    "a = f(25, 3)\n";
+  lazy = true;
+  auto skimmed = candy_proto_get_proto(compile(exp), 0);
+  /* nothing but the parameters before the first call */
+  EXPECT_NE(candy_proto_get_source(skimmed), nullptr);
+  EXPECT_EQ(candy_proto_get_nparams(skimmed), 2);
+  EXPECT_EQ(candy_proto_get_size_inst(skimmed), 0U);
+  candy_set_lazy(state, true);
+  /* the broken body is never called */
+  EXPECT_EQ(run(exp), 0);
+  EXPECT_EQ(integer("a"), 15);
+  EXPECT_NE(run("broken()"), 0);
+  EXPECT_NE(run("broken()"), 0);
+  EXPECT_EQ(run("b = f(4, 2)"), 0);
+  EXPECT_EQ(integer("b"), 8);
+}
+
+TEST_F(parser_fixture, dofile) {
+  const char exp[] = "def f(x) return x * 2 + 0x10 end\na = 'text' b = f(2)\n";
+  std::string name = testing::TempDir() + "candy_dofile.candy";
+  FILE *f = fopen(name.c_str(), "w");
+  ASSERT_NE(f, nullptr);
+  fwrite(exp, 1, strlen(exp), f);
+  fclose(f);
+  /* the skimmed body outlives the mapping of the file */
+  candy_set_lazy(state, true);
+  EXPECT_EQ(candy_dofile(state, name.c_str()), 0);
+  EXPECT_EQ(run("c = f(3)"), 0);
+  EXPECT_TRUE(candy_wrap_is_string(global("a")));
+  EXPECT_EQ(integer("b"), 20);
+  EXPECT_EQ(integer("c"), 22);
+  remove(name.c_str());
+  EXPECT_EQ(candy_dofile(state, name.c_str()), -1);
+}
+
+TEST_F(parser_fixture, inline) {
+  const char exp[] =
+    "def get(x) return x * 2 + k end\n"
+    "def pick(c) if c > 0 return 1 end return 2 end\n"
+    "def user(v) return get(v) + get(v + 1) + pick(v) end\n"
+    "def once(x) return x end\n"
+    "once = get\n"
+    "def other(v) return once(v) end\n";
+  auto chunk = compile(exp);
+  /* both bodies are in place of the calls, each one still guarded */
+  auto user = candy_proto_get_proto(chunk, 2);
+  EXPECT_EQ(count(user, OP_MUL), 2);
+  EXPECT_EQ(count(user, OP_LT), 1);
+  EXPECT_EQ(count(user, OP_CALL), 3);
+  EXPECT_EQ(count(user, OP_TESTPROTO), 3);
+  EXPECT_EQ(count(user, OP_CLOSURE), 0);
+  /* assigned again, it is called */
+  EXPECT_EQ(count(candy_proto_get_proto(chunk, 4), OP_TESTPROTO), 0);
+  EXPECT_EQ(run(exp), 0);
+  EXPECT_EQ(run("k = 1 a = user(3) b = user(-3) c = other(2)"), 0);
+  EXPECT_EQ(integer("a"), 17);
+  EXPECT_EQ(integer("b"), -6);
+  EXPECT_EQ(integer("c"), 5);
+  /* 'user' runs the bodies, only 'other' calls 'get' */
+  auto get = candy_sclosure_get_proto((candy_sclosure_t *)candy_wrap_get_object(global("get")));
+  auto pick = candy_sclosure_get_proto((candy_sclosure_t *)candy_wrap_get_object(global("pick")));
+  EXPECT_EQ(candy_proto_get_calls(get), 1U);
+  EXPECT_EQ(candy_proto_get_calls(pick), 0U);
+  /* the guard falls back to the call once the global is bound elsewhere */
+  EXPECT_EQ(run("def get(x) return 0 end d = user(3)"), 0);
+  EXPECT_EQ(integer("d"), 1);
+  get = candy_sclosure_get_proto((candy_sclosure_t *)candy_wrap_get_object(global("get")));
+  EXPECT_EQ(candy_proto_get_calls(get), 2U);
+  EXPECT_EQ(candy_proto_get_calls(pick), 0U);
+}
+
+TEST_F(parser_fixture, peephole) {
+  const char exp[] =
+    "def h(c)\n"
+    "  if c == 1 return 1 elif c == 2 x = 5 else return 3 end\n"
+    "  while c < 10\n"
+    "    if c > 5 c += 2 else c += 1 end\n"
+    "  end\n"
+    "  return c\n"
+    "end\n";
+  level = 0;
+  auto o0 = candy_proto_get_proto(compile(exp), 0);
+  level = 1;
+  auto o1 = candy_proto_get_proto(compile(exp), 0);
+  /* the jumps after a return and the return closing the body are dead */
+  EXPECT_EQ(count(o0, OP_RETURN), 4);
+  EXPECT_EQ(count(o1, OP_RETURN), 3);
+  EXPECT_EQ(candy_proto_get_size_inst(o1), candy_proto_get_size_inst(o0) - 2);
+  /* no jump lands on another one */
+  auto inst = candy_proto_get_inst(o1);
+  for (size_t idx = 0; idx < candy_proto_get_size_inst(o1); ++idx) {
+    if (candy_peephole_first((candy_opcodes_t)inst[idx].op) == OP_JMP) {
+      EXPECT_NE(candy_peephole_first((candy_opcodes_t)inst[idx + 1 + candy_inst_get_sbx(inst[idx])].op), OP_JMP);
+    }
+  }
+  for (int opt : {0, 1}) {
+    candy_set_optimize(state, opt);
+    EXPECT_EQ(run(exp), 0);
+    EXPECT_EQ(run("a = h(1) b = h(2) c = h(3) d = h(0)"), 0);
+    EXPECT_EQ(integer("a"), 1);
+    EXPECT_EQ(integer("b"), 10);
+    EXPECT_EQ(integer("c"), 3);
+    EXPECT_EQ(integer("d"), 3);
+  }
+}
+
+TEST_F(parser_fixture, constant) {
+  const char exp[] = "a = 1 a = a + 1 b = 1.0 c = -0.0 d = 0.0 e = \"a\" def f(x) return x + 1 + a end";
+  auto proto = compile(exp);
+  /* a 1 b 1.0 c -0.0 d 0.0 e f */
+  EXPECT_EQ(candy_proto_get_size_cnst(proto), 10);
+  /* a function only holds the constants it uses */
+  EXPECT_EQ(candy_proto_get_size_cnst(candy_proto_get_proto(proto, 0)), 2);
+  EXPECT_EQ(run(exp), 0);
+  EXPECT_EQ(run("g = f(1)"), 0);
+  EXPECT_EQ(integer("a"), 2);
+  EXPECT_EQ(integer("g"), 4);
+  EXPECT_EQ(candy_wrap_get_type(global("b")), CANDY_TYPE_FLOAT);
+  EXPECT_TRUE(std::signbit(candy_wrap_get_float(global("c"))));
+  EXPECT_FALSE(std::signbit(candy_wrap_get_float(global("d"))));
+}
+
+TEST_F(parser_fixture, cache) {
+  /* every read and write of a name shares one inline cache */
+  std::string exp = "a = 1 b = 2";
+  for (int idx = 0; idx < 600; ++idx)
+    exp += " s = a";
+  exp += " c = b";
+  auto proto = compile(exp.c_str());
+  EXPECT_EQ(candy_proto_get_size_cache(proto), 4);
+  EXPECT_EQ(run(exp.c_str()), 0);
+  EXPECT_EQ(integer("s"), 1);
+  EXPECT_EQ(integer("c"), 2);
+  /* a write past the caches its 'a' operand can name goes to the table */
+  exp.clear();
+  for (int idx = 0; idx < 300; ++idx)
+    exp += " g" + std::to_string(idx) + " = " + std::to_string(idx);
+  exp += " s = g299 + g0 g299 = 1 c = g299";
+  EXPECT_EQ(run(exp.c_str()), 0);
+  EXPECT_EQ(integer("s"), 299);
+  EXPECT_EQ(integer("c"), 1);
+  /* a name past the last cache a function can address is an error */
+  exp.clear();
+  for (int idx = 0; idx <= 0x200; ++idx)
+    exp += " s = g" + std::to_string(idx);
+  EXPECT_EQ(run(exp.c_str()), EXCE_ERR_SYNTAX);
+}
+
+TEST_F(parser_fixture, budget) {
+  /* the budget is per slice, so a long loop is suspended again and again */
+  candy_set_budget(state, 100);
+  EXPECT_EQ(run("s = 0 for i = 1, 100000 s = s + i end"), 0);
+  size_t slices = 1;
+  for (; candy_suspended(state); ++slices)
+    EXPECT_EQ(candy_resume(state), 0);
+  EXPECT_GE(slices, 1000);
+  EXPECT_EQ(integer("s"), 5000050000);
+}
+
+TEST_F(parser_fixture, fold) {
+  /* a = K, return */
+  EXPECT_EQ(candy_proto_get_size_inst(compile("a = (2 * 3 + 4) << 1 | -0xa & ~0")), 2);
+  EXPECT_EQ(candy_proto_get_size_inst(compile("a = 1.5 * 2 >= 3")), 2);
+  EXPECT_EQ(run("a = (2 * 3 + 4) << 1 | -0xa & ~0 b = 7 / 2 c = -7 % 3"), 0);
+  EXPECT_EQ(integer("a"), -10);
+  EXPECT_DOUBLE_EQ(candy_wrap_get_float(global("b")), 3.5);
+  EXPECT_EQ(integer("c"), 2);
+  /* what would raise is left to run time */
+  EXPECT_EQ(count(compile("a = 1 % 0"), OP_MOD), 1);
+  EXPECT_EQ(run("a = 1 % 0"), EXCE_ERR_RUNTIME);
+  /* an untaken branch costs nothing at run time */
+  EXPECT_EQ(count(compile("if 2 > 1 a = 1 end"), OP_LT), 0);
+}
+
+TEST_F(parser_fixture, identity) {
+  /* the result of a subtraction is a number, 'x' could be anything */
+  auto proto = candy_proto_get_proto(compile("def f(x) return (x - 1) * 1, x * 1, (x & 3) + 0, x + 0 end"), 0);
+  EXPECT_EQ(count(proto, OP_SUB), 1);
+  EXPECT_EQ(count(proto, OP_MUL), 1);
+  EXPECT_EQ(count(proto, OP_BAND), 1);
+  EXPECT_EQ(count(proto, OP_ADD), 1);
+  /* '-0.0 + 0' is not '-0.0' */
+  proto = candy_proto_get_proto(compile("def f(x) return (x * 1.0) + 0 end"), 0);
+  EXPECT_EQ(count(proto, OP_ADD), 1);
+}
+
+TEST_F(parser_fixture, error) {
+  EXPECT_EQ(run("a = (1 + 2"), EXCE_ERR_SYNTAX);
+  EXPECT_EQ(run("1 + 2 = a"), EXCE_ERR_SYNTAX);
+  EXPECT_EQ(run("def f(n) return n"), EXCE_ERR_SYNTAX);
+  EXPECT_EQ(run("a = 1 end"), EXCE_ERR_SYNTAX);
+}
@@ -0,0 +1,80 @@
+/**
+  * Copyright 2022-2024 ShunzDai
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+#include "test.h"
+#include "core/candy_scan.h"
+#include <ctype.h>
+#include <functional>
+#include <string>
+
+using namespace std;
+
+/* every byte value placed at every position of runs that start at every offset of a vector */
+static void tast_body(const char fill, function<size_t(const char *, size_t)> scan, function<bool(char)> stop) {
+  const candy_scan_isa_t isas[] = {SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2};
+  for (auto isa : isas) {
+    if (!candy_scan_use(isa))
+      continue;
+    for (int ch = 0; ch < 256; ++ch) {
+      for (size_t size : {0, 1, 15, 16, 17, 31, 32, 33, 70}) {
+        for (size_t offset = 0; offset < 32; offset += 7) {
+          for (size_t pos = 0; pos <= size; pos += (size > 20 ? 5 : 1)) {
+            string str(offset + size + 1, fill);
+            /* a stopper right past the end must not be looked at */
+            str[offset + size] = '\0';
+            if (pos < size)
+              str[offset + pos] = (char)ch;
+            size_t exp = pos < size && stop((char)ch) ? pos : size;
+            ASSERT_EQ(scan(str.data() + offset, size), exp) << "isa " << isa << " byte " << ch << " size " << size << " pos " << pos;
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(scan, space) {
+  tast_body(' ', candy_scan_space, [](char ch) {
+    return ch != ' ' && ch != '\t' && ch != '\v' && ch != '\f';
+  });
+  tast_body('\t', candy_scan_space, [](char ch) {
+    return ch != ' ' && ch != '\t' && ch != '\v' && ch != '\f';
+  });
+}
+
+TEST(scan, alnum) {
+  tast_body('a', candy_scan_alnum, [](char ch) {
+    return !isalnum((unsigned char)ch) && ch != '_';
+  });
+  tast_body('_', candy_scan_alnum, [](char ch) {
+    return !isalnum((unsigned char)ch) && ch != '_';
+  });
+}
+
+TEST(scan, line) {
+  tast_body('#', candy_scan_line, [](char ch) {
+    return ch == '\r' || ch == '\n' || ch == '\0';
+  });
+}
+
+TEST(scan, string) {
+  for (char del : {'"', '\''}) {
+    tast_body('x', [del](const char *str, size_t size) {
+      return candy_scan_string(str, size, del);
+    }, [del](char ch) {
+      return ch == del || ch == '\\' || ch == '\r' || ch == '\n' || ch == '\0';
+    });
+  }
+}
@@ -14,10 +14,790 @@
   * limitations under the License.
   */
 #include "test.h"
+#include "core/candy.h"
 #include "core/candy_vm.h"
+#include "core/candy_gc.h"
+#include "core/candy_object.h"
+#include "core/candy_array.h"
+#include "core/candy_table.h"
+#include "core/candy_proto.h"
+#include "core/candy_closure.h"
+#include "core/candy_wrap.h"
+#include "core/candy_memory.h"
+#include "core/candy_peephole.h"
+#include "core/candy_jit.h"
+#include "core/candy_trace.h"
+#include "core/candy_exception.h"
+#include <string>
 
-TEST(vm, call) {
+#define K(_idx) candy_inst_rk(_idx)
+
+static int handler(candy_object_t *self, candy_gc_t *gc, candy_events_t evt) {
+  if (candy_object_get_mask(self) & MASK_ARRAY)
+    return candy_array_delete((candy_array_t *)self, gc);
+  switch (candy_object_get_type(self)) {
+    case CANDY_TYPE_SCLSR: return candy_sclosure_delete((candy_sclosure_t *)self, gc);
+    case CANDY_TYPE_TABLE: return candy_table_delete((candy_table_t *)self, gc);
+    case CANDY_TYPE_PROTO: return candy_proto_delete((candy_proto_t *)self, gc);
+    default:               return -1;
+  }
+}
+
+/* allocations past the limit fail */
+static size_t alloc_limit = SIZE_MAX;
+
+/* counts every allocation or reallocation that reaches the allocator */
+static void *counting_allocator(void *ptr, size_t old_size, size_t new_size, void *arg) {
+  if (new_size && ++*(size_t *)arg > alloc_limit)
+    return NULL;
+  return test_allocator(ptr, old_size, new_size, arg);
+}
+
+struct vm_fixture : public testing::Test {
+  candy_gc_t gc{};
   candy_vm_t vm{};
-  candy_vm_init(&vm);
-  candy_vm_deinit(&vm);
+  size_t allocs = 0;
+
+  void SetUp() override {
+    candy_gc_init(&gc, handler, counting_allocator, &allocs);
+    candy_vm_init(&vm, nullptr, &gc, candy_table_create(&gc, nullptr));
+  }
+
+  void TearDown() override {
+    candy_vm_deinit(&vm, &gc);
+    candy_gc_deinit(&gc);
+  }
+
+  int integer(candy_proto_t *proto, candy_integer_t val) {
+    candy_wrap_t wrap{};
+    candy_wrap_set_integer(&wrap, val);
+    return candy_proto_add_cnst(proto, &gc, nullptr, &wrap);
+  }
+
+  int string(candy_proto_t *proto, const char str[]) {
+    candy_wrap_t wrap = candy_vm_string(&vm, str, strlen(str));
+    return candy_proto_add_cnst(proto, &gc, nullptr, &wrap);
+  }
+
+  void push(candy_proto_t *proto) {
+    candy_wrap_t wrap{};
+    candy_wrap_set_object(&wrap, (candy_object_t *)candy_sclosure_create(&gc, nullptr, proto));
+    candy_vm_push(&vm, &wrap);
+  }
+
+  /* registers the global 'fib' as the naive recursive fibonacci */
+  candy_proto_t *fibonacci() {
+    auto proto = candy_proto_create(&gc, nullptr);
+    candy_proto_set_nparams(proto, 1);
+    candy_proto_set_maxstack(proto, 4);
+    integer(proto, 2);
+    string(proto, "fib");
+    integer(proto, 1);
+    /* if (n < 2) return n */
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_LT, 0, 0, K(0));
+    candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 1);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 0, 2, 0);
+    /* return fib(n - 2) + fib(n - 1) */
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_GETTABUP, 1, candy_proto_add_cache(proto, &gc, nullptr), K(1));
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_SUB, 2, 0, K(0));
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_CALL, 1, 2, 2);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_GETTABUP, 2, candy_proto_add_cache(proto, &gc, nullptr), K(1));
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_SUB, 3, 0, K(2));
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_CALL, 2, 2, 2);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 1, 1, 2);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 1, 2, 0);
+    push(proto);
+    candy_vm_set_global(&vm, "fib");
+    return proto;
+  }
+
+  /* returns the sum of 1 to n, counted up in a loop */
+  candy_proto_t *summation() {
+    auto proto = candy_proto_create(&gc, nullptr);
+    candy_proto_set_nparams(proto, 1);
+    candy_proto_set_maxstack(proto, 3);
+    integer(proto, 0);
+    integer(proto, 1);
+    candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 1, 0);
+    candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 2, 1);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_LE, 0, 2, 0);
+    candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 3);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 1, 1, 2);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 2, 2, K(1));
+    candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, -5);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 1, 2, 0);
+    return proto;
+  }
+
+  candy_integer_t sum(candy_proto_t *proto, const candy_wrap_t &n) {
+    push(proto);
+    candy_vm_push(&vm, &n);
+    candy_vm_call(&vm, 1, 1);
+    return candy_wrap_get_integer(candy_vm_pop(&vm));
+  }
+
+  /* calls the global 'fib' with a single integer argument */
+  candy_integer_t call(candy_integer_t n) {
+    candy_wrap_t arg{};
+    candy_vm_get_global(&vm, "fib");
+    candy_wrap_set_integer(&arg, n);
+    candy_vm_push(&vm, &arg);
+    candy_vm_call(&vm, 1, 1);
+    return candy_wrap_get_integer(candy_vm_pop(&vm));
+  }
+};
+
+TEST_F(vm_fixture, loop) {
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_maxstack(proto, 2);
+  integer(proto, 0);
+  integer(proto, 1);
+  integer(proto, 100);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 0, 0);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 1, 1);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_LE, 0, 1, K(2));
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 3);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 0, 0, 1);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 1, 1, K(1));
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, -5);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 0, 2, 0);
+  push(proto);
+  candy_vm_call(&vm, 0, 1);
+  EXPECT_EQ(candy_vm_get_top(&vm), 1);
+  EXPECT_EQ(candy_wrap_get_integer(candy_vm_get(&vm, 0)), 5050);
+}
+
+TEST_F(vm_fixture, forloop) {
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_maxstack(proto, 5);
+  integer(proto, 0);
+  integer(proto, 1);
+  integer(proto, 100);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 0, 0);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 1, 1);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 2, 2);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 3, 1);
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_FORPREP, 1, 2);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 0, 0, 4);
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_FORLOOP, 1, -2);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 0, 2, 0);
+  push(proto);
+  candy_vm_call(&vm, 0, 1);
+  EXPECT_EQ(candy_vm_get_top(&vm), 1);
+  EXPECT_EQ(candy_wrap_get_integer(candy_vm_get(&vm, 0)), 5050);
+}
+
+TEST_F(vm_fixture, recursion) {
+  fibonacci();
+  EXPECT_EQ(call(20), 6765);
+}
+
+TEST_F(vm_fixture, frame) {
+  fibonacci();
+  EXPECT_EQ(call(25), 75025);
+  candy_wrap_t arg{};
+  candy_vm_get_global(&vm, "fib");
+  candy_wrap_set_integer(&arg, 25);
+  candy_vm_push(&vm, &arg);
+  /* the frames and registers are reused once they have grown */
+  size_t prev = allocs;
+  candy_vm_call(&vm, 1, 1);
+  EXPECT_EQ(allocs, prev);
+  EXPECT_EQ(candy_wrap_get_integer(candy_vm_pop(&vm)), 75025);
+}
+
+TEST_F(vm_fixture, tailcall) {
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_nparams(proto, 2);
+  candy_proto_set_maxstack(proto, 5);
+  integer(proto, 0);
+  string(proto, "loop");
+  integer(proto, 1);
+  /* if (n == 0) return acc */
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_EQ, 1, 0, K(0));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 1, 2, 0);
+  /* return loop(n - 1, acc + n) */
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_GETTABUP, 2, candy_proto_add_cache(proto, &gc, nullptr), K(1));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_SUB, 3, 0, K(2));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 4, 1, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_TAILCALL, 2, 3, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 2, 0, 0);
+  push(proto);
+  candy_vm_set_global(&vm, "loop");
+  auto loop = [this](candy_integer_t n) {
+    candy_wrap_t arg{};
+    candy_vm_get_global(&vm, "loop");
+    candy_wrap_set_integer(&arg, n);
+    candy_vm_push(&vm, &arg);
+    candy_wrap_set_integer(&arg, 0);
+    candy_vm_push(&vm, &arg);
+    candy_vm_call(&vm, 2, 1);
+    return candy_wrap_get_integer(candy_vm_pop(&vm));
+  };
+  EXPECT_EQ(loop(1000), 500500);
+  size_t used = candy_memory_used(candy_gc_memory(&gc));
+  EXPECT_EQ(loop(1000000), 500000500000);
+  /* the global key is the only new allocation */
+  EXPECT_LE(candy_memory_used(candy_gc_memory(&gc)), used + 64);
+}
+
+TEST_F(vm_fixture, cache) {
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_maxstack(proto, 1);
+  string(proto, "x");
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_GETTABUP, 0, candy_proto_add_cache(proto, &gc, nullptr), K(0));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 0, 2, 0);
+  push(proto);
+  candy_vm_set_global(&vm, "get");
+  auto get = [this]() {
+    candy_vm_get_global(&vm, "get");
+    candy_vm_call(&vm, 0, 1);
+    return candy_vm_pop(&vm);
+  };
+  auto set = [this](const char name[], candy_integer_t val) {
+    candy_wrap_t wrap{};
+    candy_wrap_set_integer(&wrap, val);
+    candy_vm_push(&vm, &wrap);
+    candy_vm_set_global(&vm, name);
+  };
+  /* a missing global is cached as well */
+  EXPECT_EQ(candy_wrap_get_type(get()), CANDY_TYPE_NULL);
+  set("x", 1);
+  EXPECT_EQ(candy_wrap_get_integer(get()), 1);
+  auto version = candy_table_version(vm.glb);
+  set("x", 2);
+  EXPECT_EQ(candy_table_version(vm.glb), version);
+  EXPECT_EQ(candy_wrap_get_integer(get()), 2);
+  /* moving the pairs invalidates the cache */
+  char name[] = "y0";
+  for (; name[1] <= '9'; ++name[1])
+    set(name, 0);
+  EXPECT_NE(candy_table_version(vm.glb), version);
+  EXPECT_EQ(candy_wrap_get_integer(get()), 2);
+}
+
+TEST_F(vm_fixture, cache_key) {
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_maxstack(proto, 2);
+  string(proto, "a");
+  string(proto, "b");
+  /* both reads go through one cache, a hit must still be the same name */
+  auto cache = candy_proto_add_cache(proto, &gc, nullptr);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_GETTABUP, 0, cache, K(0));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_GETTABUP, 1, cache, K(1));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_SUB, 0, 0, 1);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 0, 2, 0);
+  push(proto);
+  candy_vm_set_global(&vm, "f");
+  for (auto [name, val] : {std::pair{"a", 7}, std::pair{"b", 2}}) {
+    candy_wrap_t wrap{};
+    candy_wrap_set_integer(&wrap, val);
+    candy_vm_push(&vm, &wrap);
+    candy_vm_set_global(&vm, name);
+  }
+  /* past the threshold the compiled code checks the key as well */
+  for (int i = 0; i < CANDY_JIT_THRESHOLD + 3; ++i) {
+    candy_vm_get_global(&vm, "f");
+    candy_vm_call(&vm, 0, 1);
+    ASSERT_EQ(candy_wrap_get_integer(candy_vm_pop(&vm)), 5);
+  }
+}
+
+TEST_F(vm_fixture, quicken) {
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_nparams(proto, 2);
+  candy_proto_set_maxstack(proto, 3);
+  /* return a < b ? a + b : b - a */
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_LT, 0, 0, 1);
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 2);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 2, 0, 1);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 2, 2, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_SUB, 2, 1, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 2, 2, 0);
+  push(proto);
+  candy_vm_set_global(&vm, "f");
+  auto f = [this](const candy_wrap_t &a, const candy_wrap_t &b) {
+    candy_vm_get_global(&vm, "f");
+    candy_vm_push(&vm, &a);
+    candy_vm_push(&vm, &b);
+    candy_vm_call(&vm, 2, 1);
+    return *candy_vm_pop(&vm);
+  };
+  /* a quickened compare may be fused with its jump, see the superinstruction test */
+  auto op = [proto](size_t pc) {
+    return candy_peephole_first((candy_opcodes_t)candy_proto_get_inst(proto)[pc].op);
+  };
+  candy_wrap_t i1{}, i2{}, f1{}, f2{}, res{};
+  candy_wrap_set_integer(&i1, 1);
+  candy_wrap_set_integer(&i2, 2);
+  candy_wrap_set_float(&f1, 1.5);
+  candy_wrap_set_float(&f2, 2.5);
+  res = f(i1, i2);
+  EXPECT_EQ(candy_wrap_get_integer(&res), 3);
+  EXPECT_EQ(op(0), OP_LTII);
+  EXPECT_EQ(op(2), OP_ADDII);
+  EXPECT_EQ(op(4), OP_SUB);
+  res = f(i2, i1);
+  EXPECT_EQ(candy_wrap_get_integer(&res), -1);
+  EXPECT_EQ(op(4), OP_SUBII);
+  /* a failed guard falls back to the generic form */
+  res = f(f1, f2);
+  EXPECT_EQ(candy_wrap_get_float(&res), 4.0);
+  EXPECT_EQ(op(0), OP_LT);
+  EXPECT_EQ(op(2), OP_ADD);
+  res = f(f1, f2);
+  EXPECT_EQ(candy_wrap_get_float(&res), 4.0);
+  EXPECT_EQ(op(0), OP_LTFF);
+  EXPECT_EQ(op(2), OP_ADDFF);
+  /* mixed operands stay generic */
+  res = f(i1, f2);
+  EXPECT_EQ(candy_wrap_get_float(&res), 3.5);
+  EXPECT_EQ(op(2), OP_ADD);
+  res = f(i1, f2);
+  EXPECT_EQ(op(2), OP_ADD);
+}
+
+TEST_F(vm_fixture, superinstruction) {
+  auto proto = fibonacci();
+  auto inst = candy_proto_get_inst(proto);
+  candy_peephole(proto, &gc, nullptr, 1);
+  /* only the quickened compare has a superinstruction with its jump */
+  EXPECT_EQ(inst[0].op, OP_LT);
+  EXPECT_EQ(call(20), 6765);
+  /* the vm fuses it once it quickens */
+  EXPECT_EQ(inst[0].op, OP_LTII_JMP);
+  EXPECT_EQ(inst[1].op, OP_JMP);
+  /* return n % 2 == 0 and 1 or 0 */
+  proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_nparams(proto, 1);
+  candy_proto_set_maxstack(proto, 2);
+  integer(proto, 2);
+  integer(proto, 0);
+  integer(proto, 1);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_MOD, 1, 0, K(0));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_EQ, 0, 1, K(1));
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 2);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 1, 2);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 1, 2, 0);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 1, 1);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 1, 2, 0);
+  inst = candy_proto_get_inst(proto);
+  candy_peephole(proto, &gc, nullptr, 1);
+  EXPECT_EQ(inst[0].op, OP_MOD_EQ);
+  EXPECT_EQ(inst[1].op, OP_EQ_JMP);
+  candy_wrap_t n{};
+  candy_wrap_set_integer(&n, 100);
+  EXPECT_EQ(sum(proto, n), 1);
+  candy_wrap_set_integer(&n, 7);
+  EXPECT_EQ(sum(proto, n), 0);
+  /* the second of a pair is not quickened, a jump into it still is */
+  EXPECT_EQ(inst[0].op, OP_MOD_EQ);
+  EXPECT_EQ(inst[1].op, OP_EQ_JMP);
+  /* a quickened first one stays fused across a failed guard */
+  auto eq = candy_proto_create(&gc, nullptr);
+  candy_proto_set_nparams(eq, 2);
+  candy_proto_set_maxstack(eq, 2);
+  integer(eq, 1);
+  integer(eq, 0);
+  candy_proto_add_iabc(eq, &gc, nullptr, OP_EQ, 0, 0, 1);
+  candy_proto_add_iasbx(eq, &gc, nullptr, OP_JMP, 0, 2);
+  candy_proto_add_iabx(eq, &gc, nullptr, OP_LOADK, 0, 0);
+  candy_proto_add_iabc(eq, &gc, nullptr, OP_RETURN, 0, 2, 0);
+  candy_proto_add_iabx(eq, &gc, nullptr, OP_LOADK, 0, 1);
+  candy_proto_add_iabc(eq, &gc, nullptr, OP_RETURN, 0, 2, 0);
+  candy_peephole(eq, &gc, nullptr, 1);
+  push(eq);
+  candy_vm_set_global(&vm, "eq");
+  auto same = [this](const candy_wrap_t &a, const candy_wrap_t &b) {
+    candy_vm_get_global(&vm, "eq");
+    candy_vm_push(&vm, &a);
+    candy_vm_push(&vm, &b);
+    candy_vm_call(&vm, 2, 1);
+    return candy_wrap_get_integer(candy_vm_pop(&vm));
+  };
+  inst = candy_proto_get_inst(eq);
+  candy_wrap_t i1{}, i2{}, f1{};
+  candy_wrap_set_integer(&i1, 1);
+  candy_wrap_set_integer(&i2, 2);
+  candy_wrap_set_float(&f1, 1.0);
+  EXPECT_EQ(inst[0].op, OP_EQ_JMP);
+  EXPECT_EQ(same(i1, i1), 1);
+  EXPECT_EQ(inst[0].op, OP_EQII_JMP);
+  EXPECT_EQ(same(i1, i2), 0);
+  EXPECT_EQ(same(f1, i1), 1);
+  EXPECT_EQ(inst[0].op, OP_EQ_JMP);
+  EXPECT_EQ(same(i2, i2), 1);
+  EXPECT_EQ(inst[0].op, OP_EQII_JMP);
+}
+
+TEST_F(vm_fixture, peephole) {
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_nparams(proto, 1);
+  candy_proto_set_maxstack(proto, 3);
+  integer(proto, 1);
+  integer(proto, 7);
+  /* if (n < 1) r = 7 else r = n; return r */
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_LT, 1, 0, K(0));
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 1);
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 3);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 2, 1);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_MOVE, 1, 2, 0);
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 1);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_MOVE, 1, 0, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_MOVE, 1, 1, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 1, 2, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 0, 1, 0);
+  candy_peephole(proto, &gc, nullptr, 0);
+  EXPECT_EQ(candy_proto_get_size_inst(proto), 10);
+  candy_peephole(proto, &gc, nullptr, 1);
+  const candy_opcodes_t expect[] = {OP_LT, OP_JMP, OP_LOADK, OP_JMP, OP_MOVE, OP_RETURN};
+  ASSERT_EQ(candy_proto_get_size_inst(proto), std::size(expect));
+  auto inst = candy_proto_get_inst(proto);
+  for (size_t idx = 0; idx < std::size(expect); ++idx)
+    EXPECT_EQ(candy_peephole_first((candy_opcodes_t)inst[idx].op), expect[idx]);
+  /* the test is flipped instead of jumping over a jump */
+  EXPECT_EQ(inst[0].iabc.a, 0);
+  EXPECT_EQ(inst[2].iabc.a, 1);
+  candy_wrap_t n{};
+  candy_wrap_set_integer(&n, 0);
+  EXPECT_EQ(sum(proto, n), 7);
+  candy_wrap_set_integer(&n, 5);
+  EXPECT_EQ(sum(proto, n), 5);
+}
+
+TEST_F(vm_fixture, jit) {
+  auto fib = fibonacci();
+  EXPECT_EQ(call(20), 6765);
+  EXPECT_EQ(candy_proto_get_jit(fib) != nullptr, CANDY_JIT_X64);
+  EXPECT_EQ(call(25), 75025);
+  auto proto = summation();
+  candy_wrap_t n{};
+  candy_wrap_set_integer(&n, 10);
+  for (int idx = 0; idx < CANDY_JIT_THRESHOLD; ++idx)
+    EXPECT_EQ(sum(proto, n), 55);
+  EXPECT_EQ(candy_proto_get_jit(proto) != nullptr, CANDY_JIT_X64);
+  candy_wrap_set_integer(&n, 100);
+  EXPECT_EQ(sum(proto, n), 5050);
+  /* a failed guard hands the loop over to the interpreter */
+  candy_wrap_set_float(&n, 10.5);
+  EXPECT_EQ(sum(proto, n), 55);
+  candy_wrap_set_integer(&n, -1);
+  EXPECT_EQ(sum(proto, n), 0);
+}
+
+TEST_F(vm_fixture, jit_modes) {
+  auto hot = summation(), cold = summation(), traced = summation();
+  /* the backward jump of a loop that cannot be traced is marked */
+  candy_proto_get_inst(hot)[6].iabx.a = 1;
+  candy_proto_get_inst(cold)[6].iabx.a = 1;
+  candy_wrap_t n{};
+  candy_wrap_set_integer(&n, 1);
+  for (int idx = 0; idx < CANDY_JIT_THRESHOLD; ++idx)
+    sum(hot, n);
+  /* interpreted, compiled and traced the loop sums up the same */
+  candy_wrap_set_integer(&n, 10000);
+  EXPECT_EQ(sum(cold, n), 50005000);
+  EXPECT_EQ(sum(hot, n), 50005000);
+  EXPECT_EQ(sum(traced, n), 50005000);
+  EXPECT_EQ(candy_proto_get_jit(cold), nullptr);
+  EXPECT_EQ(candy_proto_get_jit(hot) != nullptr, CANDY_JIT_X64);
+  EXPECT_EQ(candy_proto_get_inst(traced)[6].op, CANDY_JIT_X64 ? OP_JLOOP : OP_JMP);
+}
+
+TEST_F(vm_fixture, jit_nomem) {
+  auto proto = summation();
+  size_t used = candy_memory_used(candy_gc_memory(&gc));
+  struct jit_info {
+    candy_proto_t *proto;
+    candy_gc_t *gc;
+    candy_exce_t ctx;
+    candy_jit_t *jit;
+  } info{proto, &gc, {}, nullptr};
+  candy_exce_init(&info.ctx);
+  /* each allocation of the translation fails in turn, none of them leaks */
+  for (size_t fail = 0;; ++fail) {
+    alloc_limit = allocs + fail;
+    auto err = candy_exce_try(&info.ctx, (candy_exce_cb_t)+[](jit_info *self) {
+      self->jit = candy_jit_compile(self->proto, self->gc, &self->ctx);
+    }, &info, nullptr);
+    alloc_limit = SIZE_MAX;
+    if (err == EXCE_OK)
+      break;
+    EXPECT_EQ(err, EXCE_ERR_MEMORY);
+    EXPECT_EQ(candy_memory_used(candy_gc_memory(&gc)), used);
+  }
+  EXPECT_EQ(info.jit != nullptr, CANDY_JIT_X64);
+  if (info.jit)
+    candy_jit_delete(info.jit, &gc);
+  EXPECT_EQ(candy_memory_used(candy_gc_memory(&gc)), used);
+  candy_exce_deinit(&info.ctx);
+}
+
+TEST_F(vm_fixture, trace) {
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_nparams(proto, 1);
+  candy_proto_set_maxstack(proto, 3);
+  integer(proto, 0);
+  integer(proto, 1);
+  integer(proto, 50);
+  integer(proto, 2);
+  /* acc += i < 50 ? 1 : 2 for i in 1 to n */
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 1, 0);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 2, 1);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_LE, 0, 2, 0);
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 7);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_LT, 0, 2, K(2));
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 2);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 1, 1, K(1));
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 1);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 1, 1, K(3));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 2, 2, K(1));
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, -9);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 1, 2, 0);
+  candy_wrap_t n{};
+  candy_wrap_set_integer(&n, 100);
+  EXPECT_EQ(sum(proto, n), 151);
+  if (CANDY_JIT_X64) {
+    ASSERT_EQ(candy_proto_get_inst(proto)[10].op, OP_JLOOP);
+    auto trace = candy_proto_get_trace(proto, 0);
+    /* recorded on the path of i >= 50 */
+    EXPECT_EQ(candy_trace_get_size_steps(trace), 5);
+    EXPECT_TRUE(candy_trace_is_stable(trace));
+  }
+  EXPECT_EQ(sum(proto, n), 151);
+  /* the other path leaves the trace on every iteration */
+  candy_wrap_set_integer(&n, 30);
+  EXPECT_EQ(sum(proto, n), 30);
+  /* so does a type the trace was not recorded for */
+  candy_wrap_set_float(&n, 60.5);
+  EXPECT_EQ(sum(proto, n), 71);
+}
+
+TEST_F(vm_fixture, trace_float) {
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_nparams(proto, 1);
+  candy_proto_set_maxstack(proto, 4);
+  candy_wrap_t wrap{};
+  candy_wrap_set_float(&wrap, 0.0);
+  candy_proto_add_cnst(proto, &gc, nullptr, &wrap);
+  candy_wrap_set_float(&wrap, 0.5);
+  candy_proto_add_cnst(proto, &gc, nullptr, &wrap);
+  integer(proto, 2);
+  candy_wrap_set_float(&wrap, 1.0);
+  candy_proto_add_cnst(proto, &gc, nullptr, &wrap);
+  /* twice the mean of 0.5, 1.0, ... up to n */
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 1, 0);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 2, 1);
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 3, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_LE, 0, 2, 0);
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 4);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 1, 1, 2);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 2, 2, K(1));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 3, 3, K(3));
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, -6);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_DIV, 1, 1, 3);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_MUL, 1, 1, K(2));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 1, 2, 0);
+  candy_wrap_set_float(&wrap, 1000.0);
+  push(proto);
+  candy_vm_push(&vm, &wrap);
+  candy_vm_call(&vm, 1, 1);
+  EXPECT_DOUBLE_EQ(candy_wrap_get_float(candy_vm_pop(&vm)), 1000.5);
+  EXPECT_EQ(candy_proto_get_inst(proto)[8].op, CANDY_JIT_X64 ? OP_JLOOP : OP_JMP);
+}
+
+TEST_F(vm_fixture, trace_global) {
+  /* s = 0; for (i = 1; i <= n; ++i) s = s + i; return s, all through the global s */
+  auto build = [this](bool cached) {
+    auto proto = candy_proto_create(&gc, nullptr);
+    candy_proto_set_nparams(proto, 1);
+    candy_proto_set_maxstack(proto, 3);
+    string(proto, "s");
+    integer(proto, 1);
+    integer(proto, 0);
+    uint32_t cache = candy_proto_add_cache(proto, &gc, nullptr);
+    uint32_t set = cached ? cache + 1 : 0;
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_SETTABUP, set, K(0), K(2));
+    candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 1, 1);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_LE, 0, 1, 0);
+    candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, 5);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_GETTABUP, 2, cache, K(0));
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 2, 2, 1);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_SETTABUP, set, K(0), 2);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 1, 1, K(1));
+    candy_proto_add_iasbx(proto, &gc, nullptr, OP_JMP, 0, -7);
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_GETTABUP, 2, cache, K(0));
+    candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 2, 2, 0);
+    return proto;
+  };
+  auto cached = build(true), uncached = build(false);
+  candy_wrap_t n{};
+  candy_wrap_set_integer(&n, 10000);
+  EXPECT_EQ(sum(cached, n), 50005000);
+  EXPECT_EQ(sum(uncached, n), 50005000);
+  EXPECT_EQ(candy_proto_get_inst(cached)[8].op, CANDY_JIT_X64 ? OP_JLOOP : OP_JMP);
+  EXPECT_EQ(candy_proto_get_inst(uncached)[8].op, OP_JMP);
+  /* moving the pairs of the globals leaves the trace at the first access */
+  char name[] = "y0";
+  for (; name[1] <= '9'; ++name[1]) {
+    candy_vm_push(&vm, &n);
+    candy_vm_set_global(&vm, name);
+  }
+  EXPECT_EQ(sum(cached, n), 50005000);
+}
+
+TEST_F(vm_fixture, trace_for) {
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_nparams(proto, 3);
+  candy_proto_set_maxstack(proto, 8);
+  integer(proto, 0);
+  /* the sum of i for i = a, b, c */
+  candy_proto_add_iabx(proto, &gc, nullptr, OP_LOADK, 3, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_MOVE, 4, 0, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_MOVE, 5, 1, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_MOVE, 6, 2, 0);
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_FORPREP, 4, 2);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 3, 3, 7);
+  candy_proto_add_iasbx(proto, &gc, nullptr, OP_FORLOOP, 4, -2);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 3, 2, 0);
+  auto loop = [&](const candy_wrap_t &a, const candy_wrap_t &b, const candy_wrap_t &c) {
+    push(proto);
+    candy_vm_push(&vm, &a);
+    candy_vm_push(&vm, &b);
+    candy_vm_push(&vm, &c);
+    candy_vm_call(&vm, 3, 1);
+    return candy_vm_pop(&vm);
+  };
+  auto num = [](candy_integer_t val) {
+    candy_wrap_t wrap{};
+    candy_wrap_set_integer(&wrap, val);
+    return wrap;
+  };
+  EXPECT_EQ(candy_wrap_get_integer(loop(num(1), num(10000), num(1))), 50005000);
+  EXPECT_EQ(candy_proto_get_inst(proto)[6].op, CANDY_JIT_X64 ? OP_JFORLOOP : OP_FORLOOP);
+  /* the trace counts down as well, and leaves a float loop to the interpreter */
+  EXPECT_EQ(candy_wrap_get_integer(loop(num(10000), num(1), num(-1))), 50005000);
+  candy_wrap_t half{};
+  candy_wrap_set_float(&half, 0.5);
+  EXPECT_DOUBLE_EQ(candy_wrap_get_float(loop(half, num(100), num(1))), 5000.0);
+  /* the compiled function runs the loop too, up to the last step before an overflow */
+  for (int idx = 0; idx < CANDY_JIT_THRESHOLD; ++idx)
+    ASSERT_EQ(candy_wrap_get_integer(loop(num(3), num(-2), num(-2))), 3);
+  EXPECT_EQ(candy_proto_get_jit(proto) != nullptr, CANDY_JIT_X64);
+  EXPECT_EQ(candy_wrap_get_integer(loop(num(0), num(INT64_MAX), num(INT64_C(1) << 62))), INT64_C(1) << 62);
+  EXPECT_EQ(candy_wrap_get_integer(loop(num(-1), num(INT64_MIN), num(INT64_MIN))), -1);
+  EXPECT_EQ(candy_wrap_get_integer(loop(num(5), num(4), num(1))), 0);
+}
+
+static int fast_add(candy_args_t *args, int nargs) {
+  candy_integer_t sum = 0;
+  for (int idx = 0; idx < nargs; ++idx)
+    sum += candy_arg_integer(args, idx);
+  candy_arg_set_integer(args, 0, sum);
+  return 1;
+}
+
+static int fast_pair(candy_args_t *args, int nargs) {
+  candy_arg_set_integer(args, 0, 40);
+  candy_arg_set_integer(args, 1, 2);
+  return 2;
+}
+
+TEST_F(vm_fixture, fast) {
+  static const candy_regist_fast_t list[] = {
+    {"add", fast_add},
+    {"pair", fast_pair},
+    {nullptr, nullptr},
+  };
+  candy_vm_regist_fast(&vm, list);
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_maxstack(proto, 4);
+  string(proto, "add");
+  string(proto, "pair");
+  /* return add(pair()) with more results than arguments */
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_GETTABUP, 0, candy_proto_add_cache(proto, &gc, nullptr), K(0));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_GETTABUP, 1, candy_proto_add_cache(proto, &gc, nullptr), K(1));
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_CALL, 1, 1, 3);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_CALL, 0, 3, 2);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 0, 2, 0);
+  push(proto);
+  candy_vm_call(&vm, 0, 1);
+  EXPECT_EQ(candy_wrap_get_integer(candy_vm_pop(&vm)), 42);
+  /* the arguments are neither pushed nor copied */
+  push(proto);
+  size_t prev = allocs;
+  candy_vm_call(&vm, 0, 1);
+  EXPECT_EQ(allocs, prev);
+  EXPECT_EQ(candy_wrap_get_integer(candy_vm_pop(&vm)), 42);
+}
+
+/* runs 'result = f(n)' with a budget, resuming it until it is done */
+static size_t preempted(vm_fixture *self, const char f[], candy_integer_t n, int64_t budget) {
+  auto proto = candy_proto_create(&self->gc, nullptr);
+  candy_proto_set_maxstack(proto, 2);
+  self->string(proto, f);
+  self->integer(proto, n);
+  self->string(proto, "result");
+  candy_proto_add_iabc(proto, &self->gc, nullptr, OP_GETTABUP, 0, candy_proto_add_cache(proto, &self->gc, nullptr), K(0));
+  candy_proto_add_iabx(proto, &self->gc, nullptr, OP_LOADK, 1, 1);
+  candy_proto_add_iabc(proto, &self->gc, nullptr, OP_CALL, 0, 2, 2);
+  candy_proto_add_iabc(proto, &self->gc, nullptr, OP_SETTABUP, 0, K(2), 0);
+  candy_proto_add_iabc(proto, &self->gc, nullptr, OP_RETURN, 0, 1, 0);
+  candy_object_t *msg = nullptr;
+  size_t times = 0;
+  candy_vm_set_budget(&self->vm, budget);
+  EXPECT_EQ(candy_vm_execute(&self->vm, candy_sclosure_create(&self->gc, nullptr, proto), &msg), EXCE_OK);
+  /* every resume starts with the whole budget again */
+  while (candy_vm_is_suspended(&self->vm)) {
+    ++times;
+    EXPECT_EQ(candy_vm_resume(&self->vm, &msg), EXCE_OK);
+  }
+  candy_vm_set_budget(&self->vm, 0);
+  EXPECT_EQ(candy_vm_get_top(&self->vm), 0);
+  return times;
+}
+
+TEST_F(vm_fixture, budget) {
+  auto result = [this]() {
+    candy_vm_get_global(&vm, "result");
+    return candy_wrap_get_integer(candy_vm_pop(&vm));
+  };
+  /* the loop is suspended both while interpreted and once traced */
+  push(summation());
+  candy_vm_set_global(&vm, "sum");
+  EXPECT_GE(preempted(this, "sum", 100000, 1000), 99);
+  EXPECT_EQ(result(), 5000050000);
+  /* each call uses up the budget as well */
+  fibonacci();
+  EXPECT_GE(preempted(this, "fib", 15, 10), 190);
+  EXPECT_EQ(result(), 610);
+  /* and the native code checks it on its backward jumps */
+  auto hot = summation();
+  candy_proto_get_inst(hot)[6].iabx.a = 1;
+  candy_wrap_t n{};
+  candy_wrap_set_integer(&n, 1);
+  for (int idx = 0; idx < CANDY_JIT_THRESHOLD; ++idx)
+    sum(hot, n);
+  EXPECT_EQ(candy_proto_get_jit(hot) != nullptr, CANDY_JIT_X64);
+  push(hot);
+  candy_vm_set_global(&vm, "hot");
+  EXPECT_GE(preempted(this, "hot", 100000, 1000), 99);
+  EXPECT_EQ(result(), 5000050000);
+  /* without a budget the call runs through */
+  EXPECT_EQ(preempted(this, "sum", 1000, 0), 0);
+  EXPECT_EQ(result(), 500500);
+}
+
+TEST_F(vm_fixture, error) {
+  auto proto = candy_proto_create(&gc, nullptr);
+  candy_proto_set_maxstack(proto, 1);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_LOADBOOL, 0, 1, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_ADD, 0, 0, 0);
+  candy_proto_add_iabc(proto, &gc, nullptr, OP_RETURN, 0, 1, 0);
+  candy_object_t *msg = nullptr;
+  EXPECT_EQ(candy_vm_execute(&vm, candy_sclosure_create(&gc, nullptr, proto), &msg), EXCE_ERR_RUNTIME);
+  ASSERT_NE(msg, nullptr);
+  std::string str((char *)candy_array_data((candy_array_t *)msg), candy_array_size((candy_array_t *)msg));
+  EXPECT_EQ(str, "runtime error: unsupported operand type(s) for ADD: 'BOOLEAN' and 'BOOLEAN'");
+  EXPECT_EQ(candy_vm_get_top(&vm), 0);
 }